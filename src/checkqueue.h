@@ -10,26 +10,62 @@
 #include <util/threadnames.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
 #include <vector>
 
 template <typename T>
 class CCheckQueueControl;
 
+/**
+ * Run a batch of checks in order, and return the position of the first one
+ * that fails, or checks.size() if all of them pass. Check types that can
+ * verify several checks together faster than one by one overload this for
+ * their std::vector, which is then found by argument-dependent lookup.
+ */
+template <typename T>
+size_t RunCheckBatch(std::vector<T>& checks)
+{
+    for (size_t i = 0; i < checks.size(); i++) {
+        if (!checks[i]()) return i;
+    }
+    return checks.size();
+}
+
 /**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
-  * operator(), returning a bool.
+  * operator(), returning a bool. Each batch a thread takes off the queue
+  * is run with RunCheckBatch().
   *
   * One thread (the master) is assumed to push batches of verifications
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker (and the master) has its own deque of verifications. Add()
+  * spreads new verifications over the deques; a worker takes batches from
+  * the back of its own deque and, once that is empty, steals from the front
+  * of the others. The shared m_mutex is only taken to go to sleep and to
+  * wake sleeping threads up, so workers don't contend on it while there is
+  * work to do.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    //! Per-worker deque of verifications
+    struct WorkerQueue {
+        Mutex m_mutex;
+        //! Owner takes from the back, thieves from the front.
+        std::deque<T> checks GUARDED_BY(m_mutex);
+    };
+
+    //! Mutex to let threads sleep and wake up, and to protect the stop flag
     Mutex m_mutex;
 
     //! Worker threads block on this when out of work
@@ -38,25 +74,33 @@ private:
     //! Master thread blocks on this when out of work
     std::condition_variable m_master_cv;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue GUARDED_BY(m_mutex);
+    //! The deques of elements to be processed. Slot 0 belongs to the master,
+    //! slot n + 1 to worker thread n. Only resized while no threads run.
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle GUARDED_BY(m_mutex){0};
+    //! The slot the next call to Add() starts filling, so that small
+    //! batches are spread over all workers.
+    size_t m_next_queue{0};
 
-    //! The total number of workers (including the master).
-    int nTotal GUARDED_BY(m_mutex){0};
-
-    //! The temporary evaluation result.
-    bool fAllOk GUARDED_BY(m_mutex){true};
+    //! Number of elements in all of m_queues. Changed while holding the lock
+    //! of the deque that is being changed, so it never goes below zero.
+    std::atomic<unsigned int> m_queued{0};
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo GUARDED_BY(m_mutex){0};
+    std::atomic<unsigned int> m_todo{0};
+
+    //! The number of worker threads that are waiting for work.
+    std::atomic<int> m_idle{0};
+
+    //! The temporary evaluation result.
+    std::atomic<bool> m_all_ok{true};
+
+    //! The first check that failed, kept so the master can find out why.
+    std::optional<T> m_failed GUARDED_BY(m_mutex);
 
     //! The maximum number of elements to be processed in one batch
     const unsigned int nBatchSize;
@@ -64,67 +108,101 @@ private:
     std::vector<std::thread> m_worker_threads;
     bool m_request_stop GUARDED_BY(m_mutex){false};
 
+    //! Number of elements to take from a deque holding size of them: half,
+    //! leaving the rest for thieves, but between 1 and nBatchSize.
+    size_t BatchSize(size_t size) const
+    {
+        return std::max<size_t>(1, std::min<size_t>(nBatchSize, size / 2));
+    }
+
+    /**
+     * Move a batch of elements into vChecks, from the back of the deque in
+     * the given slot or, if that is empty, from the front of another one.
+     * Returns false if all deques are empty.
+     */
+    bool TakeWork(size_t slot, std::vector<T>& vChecks)
+    {
+        {
+            WorkerQueue& own = *m_queues[slot];
+            LOCK(own.m_mutex);
+            if (!own.checks.empty()) {
+                const size_t n = BatchSize(own.checks.size());
+                vChecks.resize(n);
+                for (size_t i = 0; i < n; i++) {
+                    // Swap instead of copying, as the original is destroyed
+                    // right after.
+                    vChecks[i].swap(own.checks.back());
+                    own.checks.pop_back();
+                }
+                m_queued -= n;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < m_queues.size() && m_queued > 0; i++) {
+            WorkerQueue& victim = *m_queues[(slot + i) % m_queues.size()];
+            LOCK(victim.m_mutex);
+            if (victim.checks.empty()) continue;
+            const size_t n = BatchSize(victim.checks.size());
+            vChecks.resize(n);
+            for (size_t j = 0; j < n; j++) {
+                vChecks[j].swap(victim.checks.front());
+                victim.checks.pop_front();
+            }
+            m_queued -= n;
+            return true;
+        }
+        return false;
+    }
+
+    //! Run a batch taken by TakeWork, and account for its completion.
+    void RunChecks(std::vector<T>& vChecks)
+    {
+        const unsigned int nNow = vChecks.size();
+        // Check whether we need to do work at all
+        bool fOk = m_all_ok;
+        if (fOk) {
+            const size_t failed = RunCheckBatch(vChecks);
+            fOk = failed == vChecks.size();
+            if (!fOk) {
+                LOCK(m_mutex);
+                if (!m_failed) {
+                    m_failed.emplace();
+                    m_failed->swap(vChecks[failed]);
+                }
+            }
+        }
+        // Destroy the checks before they are counted as done, so that they
+        // are all gone by the time the master returns.
+        vChecks.clear();
+        if (!fOk) m_all_ok = false;
+        if (m_todo.fetch_sub(nNow) == nNow) {
+            // We processed the last element; inform the master it can exit and return the result
+            LOCK(m_mutex);
+            m_master_cv.notify_one();
+        }
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster)
+    void WorkerLoop(size_t slot)
     {
-        std::condition_variable& cond = fMaster ? m_master_cv : m_worker_cv;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                WAIT_LOCK(m_mutex, lock);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        m_master_cv.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty() && !m_request_stop) {
-                    if (fMaster && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                if (m_request_stop) {
-                    return false;
-                }
-
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the m_mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+            if (TakeWork(slot, vChecks)) {
+                RunChecks(vChecks);
+                continue;
+            }
+            WAIT_LOCK(m_mutex, lock);
+            // Add() reads m_idle after updating m_queued, so either we see
+            // the new work here or it wakes us up.
+            m_idle++;
+            while (m_queued == 0 && !m_request_stop) {
+                m_worker_cv.wait(lock); // wait
+            }
+            m_idle--;
+            if (m_request_stop) {
+                return;
             }
-            // execute work
-            for (T& check : vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
         } while (true);
     }
 
@@ -136,45 +214,79 @@ public:
     explicit CCheckQueue(unsigned int nBatchSizeIn)
         : nBatchSize(nBatchSizeIn)
     {
+        m_queues.push_back(std::make_unique<WorkerQueue>());
     }
 
-    //! Create a pool of new worker threads.
-    void StartWorkerThreads(const int threads_num)
+    //! Create a pool of new worker threads, named after thread_name.
+    void StartWorkerThreads(const int threads_num, const std::string& thread_name = "scriptch")
     {
-        {
-            LOCK(m_mutex);
-            nIdle = 0;
-            nTotal = 0;
-            fAllOk = true;
-        }
+        m_all_ok = true;
         assert(m_worker_threads.empty());
+        m_queues.resize(1);
+        for (int n = 0; n < threads_num; ++n) {
+            m_queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        m_next_queue = 0;
         for (int n = 0; n < threads_num; ++n) {
-            m_worker_threads.emplace_back([this, n]() {
-                util::ThreadRename(strprintf("scriptch.%i", n));
-                Loop(false /* worker thread */);
+            m_worker_threads.emplace_back([this, n, thread_name]() {
+                util::ThreadRename(strprintf("%s.%i", thread_name, n));
+                WorkerLoop(n + 1);
             });
         }
     }
 
-    //! Wait until execution finishes, and return whether all evaluations were successful.
-    bool Wait()
+    /**
+     * Wait until execution finishes, and return whether all evaluations were
+     * successful. If not, and failed is not null, the first check that failed
+     * is swapped into it.
+     */
+    bool Wait(T* failed = nullptr)
     {
-        return Loop(true /* master thread */);
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        while (TakeWork(0, vChecks)) {
+            RunChecks(vChecks);
+        }
+        // Only the master adds work, so all that is left are the batches
+        // the workers are still running.
+        WAIT_LOCK(m_mutex, lock);
+        while (m_todo != 0) {
+            m_master_cv.wait(lock);
+        }
+        if (m_failed) {
+            if (failed) failed->swap(*m_failed);
+            m_failed.reset();
+        }
+        // return the current status, and reset it for new work later
+        return m_all_ok.exchange(true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        LOCK(m_mutex);
-        for (T& check : vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty()) return;
+        m_todo += vChecks.size();
+        // Hand out contiguous chunks, one per deque, starting where the
+        // previous call left off.
+        const size_t chunk = (vChecks.size() + m_queues.size() - 1) / m_queues.size();
+        for (size_t begin = 0; begin < vChecks.size(); begin += chunk) {
+            const size_t end = std::min(vChecks.size(), begin + chunk);
+            WorkerQueue& queue = *m_queues[m_next_queue];
+            m_next_queue = (m_next_queue + 1) % m_queues.size();
+            LOCK(queue.m_mutex);
+            for (size_t i = begin; i < end; i++) {
+                queue.checks.emplace_back();
+                vChecks[i].swap(queue.checks.back());
+            }
+            m_queued += end - begin;
+        }
+        if (m_idle > 0) {
+            LOCK(m_mutex);
+            if (vChecks.size() == 1)
+                m_worker_cv.notify_one();
+            else
+                m_worker_cv.notify_all();
         }
-        nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            m_worker_cv.notify_one();
-        else if (vChecks.size() > 1)
-            m_worker_cv.notify_all();
     }
 
     //! Stop all of the worker threads.
@@ -186,6 +298,8 @@ public:
             t.join();
         }
         m_worker_threads.clear();
+        m_queues.resize(1);
+        m_next_queue = 0;
         WITH_LOCK(m_mutex, m_request_stop = false);
     }
 
@@ -219,11 +333,11 @@ public:
         }
     }
 
-    bool Wait()
+    bool Wait(T* failed = nullptr)
     {
         if (pqueue == nullptr)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(failed);
         fDone = true;
         return fRet;
     }
@@ -9,6 +9,8 @@
 #include <random.h>
 #include <version.h>
 
+#include <map>
+
 bool CCoinsView::GetCoin(const COutPoint &outpoint, Coin &coin) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 std::vector<uint256> CCoinsView::GetHeadBlocks() const { return std::vector<uint256>(); }
@@ -39,12 +41,15 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
 
 CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) const {
     CCoinsMap::iterator it = cacheCoins.find(outpoint);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.last_used = m_access_epoch;
         return it;
+    }
     Coin tmp;
     if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(tmp))).first;
+    ret->second.last_used = m_access_epoch;
     if (ret->second.coin.IsSpent()) {
         // The parent only has an empty entry for this outpoint; we can consider our
         // version as fresh.
@@ -94,6 +99,7 @@ void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possi
     }
     it->second.coin = std::move(coin);
     it->second.flags |= CCoinsCacheEntry::DIRTY | (fresh ? CCoinsCacheEntry::FRESH : 0);
+    it->second.last_used = m_access_epoch;
     cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
 }
 
@@ -102,7 +108,19 @@ void CCoinsViewCache::EmplaceCoinInternalDANGER(COutPoint&& outpoint, Coin&& coi
     cacheCoins.emplace(
         std::piecewise_construct,
         std::forward_as_tuple(std::move(outpoint)),
-        std::forward_as_tuple(std::move(coin), CCoinsCacheEntry::DIRTY));
+        std::forward_as_tuple(std::move(coin), CCoinsCacheEntry::DIRTY)).first->second.last_used = m_access_epoch;
+}
+
+bool CCoinsViewCache::EmplaceFetchedCoin(const COutPoint& outpoint, Coin&& coin) {
+    assert(!coin.IsSpent());
+    CCoinsMap::iterator it;
+    bool inserted;
+    std::tie(it, inserted) = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::forward_as_tuple(std::move(coin)));
+    if (inserted) {
+        it->second.last_used = m_access_epoch;
+        cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+    }
+    return inserted;
 }
 
 void AddCoins(CCoinsViewCache& cache, const CTransaction &tx, int nHeight, bool check_for_overwrite) {
@@ -161,6 +179,7 @@ uint256 CCoinsViewCache::GetBestBlock() const {
 
 void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
+    ++m_access_epoch;
 }
 
 bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn) {
@@ -180,6 +199,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                 entry.coin = std::move(it->second.coin);
                 cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
                 entry.flags = CCoinsCacheEntry::DIRTY;
+                entry.last_used = m_access_epoch;
                 // We can mark it FRESH in the parent if it was FRESH in the child
                 // Otherwise it might have just been flushed from the parent's cache
                 // and already exist in the grandparent
@@ -208,6 +228,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                 itUs->second.coin = std::move(it->second.coin);
                 cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
                 itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                itUs->second.last_used = m_access_epoch;
                 // NOTE: It isn't safe to mark the coin as FRESH in the parent
                 // cache. If it already existed and was spent in the parent
                 // cache then marking it FRESH would prevent that spentness
@@ -216,6 +237,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
         }
     }
     hashBlock = hashBlockIn;
+    ++m_access_epoch;
     return true;
 }
 
@@ -223,6 +245,56 @@ bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
     cachedCoinsUsage = 0;
+    // Hand the emptied node pool back to the system at once.
+    ReallocateCache();
+    return fOk;
+}
+
+bool CCoinsViewCache::PartialFlush(size_t retain_bytes) {
+    // Tally the memory used by unspent coins per access epoch, counting an
+    // equal share of the map's own usage for each entry, and keep the most
+    // recent epochs that fit.
+    const size_t entry_overhead = cacheCoins.empty() ? 0 : memusage::DynamicUsage(cacheCoins) / cacheCoins.size();
+    std::map<uint32_t, size_t, std::greater<uint32_t>> usage_by_epoch;
+    for (const auto& [outpoint, entry] : cacheCoins) {
+        if (!entry.coin.IsSpent()) {
+            usage_by_epoch[entry.last_used] += entry_overhead + entry.coin.DynamicMemoryUsage();
+        }
+    }
+    bool retain_any = false;
+    uint32_t min_epoch = 0;
+    size_t retained_usage = 0;
+    for (const auto& [epoch, usage] : usage_by_epoch) {
+        if (retained_usage + usage > retain_bytes) break;
+        retained_usage += usage;
+        retain_any = true;
+        min_epoch = epoch;
+    }
+
+    // Move the kept entries into a map with a pool of its own, one at a
+    // time, so that the old map's pool can be released as a whole after the
+    // write. Dirty kept entries are copied instead, as they still need to be
+    // written; everything else is written and dropped by the parent.
+    CCoinsMap retained;
+    size_t retained_coins_usage = 0;
+    for (auto it = cacheCoins.begin(); it != cacheCoins.end();) {
+        CCoinsCacheEntry& entry = it->second;
+        if (!retain_any || entry.coin.IsSpent() || entry.last_used < min_epoch) {
+            ++it;
+            continue;
+        }
+        retained_coins_usage += entry.coin.DynamicMemoryUsage();
+        const bool dirty = entry.flags & CCoinsCacheEntry::DIRTY;
+        CCoinsCacheEntry& kept = retained.emplace(std::piecewise_construct, std::forward_as_tuple(it->first),
+                                                  std::forward_as_tuple(dirty ? Coin{entry.coin} : std::move(entry.coin))).first->second;
+        kept.last_used = entry.last_used;
+        it = dirty ? std::next(it) : cacheCoins.erase(it);
+    }
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+
+    cacheCoins.~CCoinsMap();
+    ::new (&cacheCoins) CCoinsMap(std::move(retained));
+    cachedCoinsUsage = retained_coins_usage;
     return fOk;
 }
 
@@ -6,11 +6,17 @@
 #ifndef BITCOIN_COINS_H
 #define BITCOIN_COINS_H
 
+#if defined(HAVE_CONFIG_H)
+#include <config/bitcoin-config.h>
+#endif
+
 #include <compressor.h>
 #include <core_memusage.h>
+#include <flathashmap.h>
 #include <memusage.h>
 #include <primitives/transaction.h>
 #include <serialize.h>
+#include <support/allocators/pool.h>
 #include <uint256.h>
 #include <util/hasher.h>
 
@@ -104,6 +110,8 @@ struct CCoinsCacheEntry
 {
     Coin coin; // The actual cached data.
     unsigned char flags;
+    //! Access epoch of the owning cache when the entry was last used (see CCoinsViewCache::PartialFlush).
+    uint32_t last_used{0};
 
     enum Flags {
         /**
@@ -131,7 +139,20 @@ struct CCoinsCacheEntry
     CCoinsCacheEntry(Coin&& coin_, unsigned char flag) : coin(std::move(coin_)), flags(flag) {}
 };
 
-typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+// last_used is only needed with -coinscacheretain, so it must not make entries larger.
+static_assert(sizeof(void*) < 8 || sizeof(CCoinsCacheEntry) == sizeof(Coin) + 8, "last_used must fit in the padding after flags");
+
+#ifdef USE_FLAT_COINS_MAP
+/** Open addressing map with flat value storage, see --enable-flat-coins-map */
+typedef FlatHashMap<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
+#else
+/** Largest allocation served from the pool: an unordered_map node holding a
+ *  CCoinsMap entry, plus room for the node's own pointers and cached hash. */
+static constexpr size_t COINS_MAP_POOL_BLOCK_BYTES{(sizeof(std::pair<const COutPoint, CCoinsCacheEntry>) + 4 * sizeof(void*) + alignof(void*) - 1) / alignof(void*) * alignof(void*)};
+/** Allocator keeping CCoinsMap nodes in a pool that is released as a whole */
+typedef PoolAllocator<std::pair<const COutPoint, CCoinsCacheEntry>, COINS_MAP_POOL_BLOCK_BYTES, alignof(void*)> CCoinsMapAllocator;
+typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher, std::equal_to<COutPoint>, CCoinsMapAllocator> CCoinsMap;
+#endif
 
 /** Cursor for iterating over CoinsView state */
 class CCoinsViewCursor
@@ -223,6 +244,9 @@ protected:
     /* Cached dynamic memory usage for the inner Coin objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Incremented whenever the best block changes, to tell recently used entries apart. */
+    uint32_t m_access_epoch{0};
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
 
@@ -275,6 +299,15 @@ public:
      */
     void EmplaceCoinInternalDANGER(COutPoint&& outpoint, Coin&& coin);
 
+    /**
+     * Insert a coin that was looked up in the backing view on another thread,
+     * exactly as FetchCoin would have cached it. Has no effect if the outpoint
+     * is already cached, as the cached entry may be newer than the base.
+     *
+     * @returns whether the coin was inserted
+     */
+    bool EmplaceFetchedCoin(const COutPoint& outpoint, Coin&& coin);
+
     /**
      * Spend a coin. Pass moveto in order to get the deleted data.
      * If no unspent output exists for the passed outpoint, this call
@@ -286,9 +319,20 @@ public:
      * Push the modifications applied to this cache to its base.
      * Failure to call this method before destruction will cause the changes to be forgotten.
      * If false is returned, the state of this cache (and its backing view) will be undefined.
+     * The memory held by the cache map is released afterwards (see ReallocateCache).
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base like Flush(),
+     * but keep the most recently used unspent coins cached, up to about
+     * retain_bytes of DynamicMemoryUsage(). Coins are kept or dropped by the
+     * block in which they were last used. Kept coins are neither DIRTY nor
+     * FRESH afterwards. While flushing, memory usage exceeds the cache's own
+     * by at most the kept coins.
+     */
+    bool PartialFlush(size_t retain_bytes);
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
@@ -167,6 +167,19 @@ public:
         return true;
     }
 
+    /** Copy the deobfuscated value into a stream, to be deserialized later,
+     *  possibly on another thread. */
+    bool GetValueStream(CDataStream& ssValue) {
+        leveldb::Slice slValue = piter->value();
+        try {
+            ssValue = CDataStream(MakeUCharSpan(slValue), SER_DISK, CLIENT_VERSION);
+            ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
     unsigned int GetValueSize() {
         return piter->value().size();
     }
@@ -5,11 +5,20 @@
 
 #include <stdexcept>
 
+#include <clientversion.h>
 #include <flatfile.h>
 #include <logging.h>
 #include <tinyformat.h>
+#include <util/lzcompress.h>
 #include <util/system.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 FlatFileSeq::FlatFileSeq(fs::path dir, const char* prefix, size_t chunk_size) :
     m_dir(std::move(dir)),
     m_prefix(prefix),
@@ -30,6 +39,11 @@ fs::path FlatFileSeq::FileName(const FlatFilePos& pos) const
     return m_dir / strprintf("%s%05u.dat", m_prefix, pos.nFile);
 }
 
+fs::path FlatFileSeq::CompressedFileName(const FlatFilePos& pos) const
+{
+    return m_dir / strprintf("%s%05u.cdat", m_prefix, pos.nFile);
+}
+
 FILE* FlatFileSeq::Open(const FlatFilePos& pos, bool read_only)
 {
     if (pos.IsNull()) {
@@ -97,3 +111,189 @@ bool FlatFileSeq::Flush(const FlatFilePos& pos, bool finalize)
     fclose(file);
     return true;
 }
+
+MappedFlatFile::~MappedFlatFile()
+{
+#ifndef WIN32
+    munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+}
+
+std::shared_ptr<const MappedFlatFile> FlatFileSeq::Map(int file, size_t size) const
+{
+#ifdef WIN32
+    return nullptr;
+#else
+    if (size == 0) {
+        return nullptr;
+    }
+    const fs::path path = FileName(FlatFilePos(file, 0));
+    // The file may have been compressed, in which case it is read without a mapping.
+    const int fd = open(path.string().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return nullptr;
+    }
+    // Accessing a mapping beyond the end of the file raises SIGBUS.
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < size) {
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LogPrint(BCLog::VALIDATION, "Unable to map %u bytes of %s\n", size, path.string());
+        return nullptr;
+    }
+    return std::make_shared<const MappedFlatFile>(static_cast<const unsigned char*>(data), size);
+#endif
+}
+
+static constexpr unsigned char COMPRESSED_FLATFILE_MAGIC[4]{'f', 'f', 'z', 1};
+
+CompressedFlatFile::CompressedFlatFile(FILE* file, uint64_t size, std::vector<uint64_t> frame_ends, long frames_start)
+    : m_file(file, SER_DISK, CLIENT_VERSION), m_size(size), m_frame_ends(std::move(frame_ends)), m_frames_start(frames_start) {}
+
+bool CompressedFlatFile::Write(const fs::path& src, uint64_t size, const fs::path& dst)
+{
+    CAutoFile in(fsbridge::fopen(src, "rb"), SER_DISK, CLIENT_VERSION);
+    if (in.IsNull()) {
+        return error("%s: failed to open %s", __func__, src.string());
+    }
+    CAutoFile out(fsbridge::fopen(dst, "wb"), SER_DISK, CLIENT_VERSION);
+    if (out.IsNull()) {
+        return error("%s: failed to create %s", __func__, dst.string());
+    }
+    std::vector<uint64_t> frame_ends((size + FRAME_SIZE - 1) / FRAME_SIZE);
+    std::vector<unsigned char> frame;
+    try {
+        // Write the header with placeholder frame offsets, which are filled in at the end.
+        out << COMPRESSED_FLATFILE_MAGIC << size;
+        const long index_start = ftell(out.Get());
+        out << frame_ends;
+        uint64_t frames_size = 0;
+        for (size_t i = 0; i < frame_ends.size(); ++i) {
+            frame.resize(std::min<uint64_t>(FRAME_SIZE, size - uint64_t{i} * FRAME_SIZE));
+            in.read(reinterpret_cast<char*>(frame.data()), frame.size());
+            const std::vector<unsigned char> compressed = lz::Compress(frame);
+            const std::vector<unsigned char>& stored = compressed.size() < frame.size() ? compressed : frame;
+            out.write(reinterpret_cast<const char*>(stored.data()), stored.size());
+            frames_size += stored.size();
+            frame_ends[i] = frames_size;
+        }
+        if (index_start < 0 || fseek(out.Get(), index_start, SEEK_SET)) {
+            return error("%s: failed to seek in %s", __func__, dst.string());
+        }
+        out << frame_ends;
+    } catch (const std::exception& e) {
+        return error("%s: failed to compress %s: %s", __func__, src.string(), e.what());
+    }
+    if (!FileCommit(out.Get())) {
+        return error("%s: failed to commit %s", __func__, dst.string());
+    }
+    return true;
+}
+
+std::unique_ptr<CompressedFlatFile> CompressedFlatFile::Open(const fs::path& path)
+{
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return nullptr;
+    }
+    unsigned char magic[sizeof(COMPRESSED_FLATFILE_MAGIC)];
+    uint64_t size;
+    std::vector<uint64_t> frame_ends;
+    try {
+        file >> magic >> size >> frame_ends;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: failed to read %s: %s\n", __func__, path.string(), e.what());
+        return nullptr;
+    }
+    if (memcmp(magic, COMPRESSED_FLATFILE_MAGIC, sizeof(magic)) || frame_ends.size() != size / FRAME_SIZE + (size % FRAME_SIZE != 0)) {
+        LogPrintf("%s: %s is not a compressed file\n", __func__, path.string());
+        return nullptr;
+    }
+    // Check the frame offsets once here, so that reads can rely on them: every
+    // frame is stored in at least one byte and at most its original size.
+    uint64_t stored_start = 0;
+    for (size_t i = 0; i < frame_ends.size(); ++i) {
+        const uint64_t frame_size = std::min<uint64_t>(FRAME_SIZE, size - uint64_t{i} * FRAME_SIZE);
+        if (frame_ends[i] <= stored_start || frame_ends[i] - stored_start > frame_size) {
+            LogPrintf("%s: %s has an invalid frame %u\n", __func__, path.string(), i);
+            return nullptr;
+        }
+        stored_start = frame_ends[i];
+    }
+    const long frames_start = ftell(file.Get());
+    if (frames_start < 0) {
+        return nullptr;
+    }
+    return std::unique_ptr<CompressedFlatFile>(new CompressedFlatFile(file.release(), size, std::move(frame_ends), frames_start));
+}
+
+bool CompressedFlatFile::ReadFrame(size_t index, std::vector<unsigned char>& frame)
+{
+    const uint64_t stored_start = index ? m_frame_ends[index - 1] : 0;
+    frame.resize(std::min<uint64_t>(FRAME_SIZE, m_size - uint64_t{index} * FRAME_SIZE));
+    const size_t stored_size = m_frame_ends[index] - stored_start;
+    if (fseek(m_file.Get(), m_frames_start + stored_start, SEEK_SET)) {
+        return error("%s: failed to seek to frame %u", __func__, index);
+    }
+    try {
+        if (stored_size == frame.size()) {
+            m_file.read(reinterpret_cast<char*>(frame.data()), frame.size());
+            return true;
+        }
+        m_stored.resize(stored_size);
+        m_file.read(reinterpret_cast<char*>(m_stored.data()), m_stored.size());
+    } catch (const std::exception& e) {
+        return error("%s: failed to read frame %u: %s", __func__, index, e.what());
+    }
+    if (!lz::Decompress(m_stored, frame)) {
+        return error("%s: failed to decompress frame %u", __func__, index);
+    }
+    return true;
+}
+
+bool CompressedFlatFile::Read(uint64_t pos, Span<unsigned char> out)
+{
+    if (pos > m_size || out.size() > m_size - pos) {
+        return error("%s: reading beyond the end of the file", __func__);
+    }
+    std::vector<unsigned char> frame;
+    while (!out.empty()) {
+        const size_t index = pos / FRAME_SIZE;
+        if (!ReadFrame(index, frame)) {
+            return false;
+        }
+        const size_t offset = pos - uint64_t{index} * FRAME_SIZE;
+        const size_t count = std::min(out.size(), frame.size() - offset);
+        memcpy(out.data(), frame.data() + offset, count);
+        out = out.subspan(count);
+        pos += count;
+    }
+    return true;
+}
+
+bool CompressedFlatFile::Restore(const fs::path& dst)
+{
+    CAutoFile out(fsbridge::fopen(dst, "wb"), SER_DISK, CLIENT_VERSION);
+    if (out.IsNull()) {
+        return error("%s: failed to create %s", __func__, dst.string());
+    }
+    std::vector<unsigned char> frame;
+    try {
+        for (size_t i = 0; i < m_frame_ends.size(); ++i) {
+            if (!ReadFrame(i, frame)) {
+                return false;
+            }
+            out.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+        }
+    } catch (const std::exception& e) {
+        return error("%s: failed to write %s: %s", __func__, dst.string(), e.what());
+    }
+    if (!FileCommit(out.Get())) {
+        return error("%s: failed to commit %s", __func__, dst.string());
+    }
+    return true;
+}
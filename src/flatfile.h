@@ -6,10 +6,14 @@
 #ifndef BITCOIN_FLATFILE_H
 #define BITCOIN_FLATFILE_H
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <fs.h>
 #include <serialize.h>
+#include <span.h>
+#include <streams.h>
 
 struct FlatFilePos
 {
@@ -39,6 +43,28 @@ struct FlatFilePos
     std::string ToString() const;
 };
 
+/**
+ * Read-only memory mapping of the start of a flat file, unmapped on
+ * destruction. Holders must not read past Data(): the mapped bytes have to
+ * stay within the file, which is not truncated below them (see
+ * FlatFileSeq::Flush).
+ */
+class MappedFlatFile
+{
+private:
+    const unsigned char* const m_data;
+    const size_t m_size;
+
+public:
+    MappedFlatFile(const unsigned char* data, size_t size) : m_data(data), m_size(size) {}
+    ~MappedFlatFile();
+
+    MappedFlatFile(const MappedFlatFile&) = delete;
+    MappedFlatFile& operator=(const MappedFlatFile&) = delete;
+
+    Span<const unsigned char> Data() const { return {m_data, m_size}; }
+};
+
 /**
  * FlatFileSeq represents a sequence of numbered files storing raw data. This class facilitates
  * access to and efficient management of these files.
@@ -63,6 +89,9 @@ public:
     /** Get the name of the file at the given position. */
     fs::path FileName(const FlatFilePos& pos) const;
 
+    /** Get the name of the compressed copy (see CompressedFlatFile) of the file at the given position. */
+    fs::path CompressedFileName(const FlatFilePos& pos) const;
+
     /** Open a handle to the file at the given position. */
     FILE* Open(const FlatFilePos& pos, bool read_only = false);
 
@@ -85,6 +114,57 @@ public:
      * @return true on success, false on failure.
      */
     bool Flush(const FlatFilePos& pos, bool finalize = false);
+
+    /**
+     * Map the first size bytes of a file into memory for reading.
+     *
+     * @param[in] file The number of the file in the sequence.
+     * @param[in] size The number of bytes to map, which must not exceed the file size.
+     * @return The mapping, or nullptr if the file could not be mapped or memory mapping is not
+     *         supported on this platform.
+     */
+    std::shared_ptr<const MappedFlatFile> Map(int file, size_t size) const;
+};
+
+/**
+ * A compressed flat file, split into frames of FRAME_SIZE bytes which are
+ * compressed independently, so that any range of the original file can be
+ * read by decompressing only the frames covering it.
+ *
+ * The file starts with a magic, the size of the original file, and the end
+ * offset of every frame relative to the end of this header, followed by the
+ * frames. A frame that does not get smaller is stored uncompressed.
+ */
+class CompressedFlatFile
+{
+public:
+    static constexpr uint32_t FRAME_SIZE{1 << 18};
+
+    /** Write a compressed copy of the first size bytes of the file at src to dst, and commit it to disk. */
+    static bool Write(const fs::path& src, uint64_t size, const fs::path& dst);
+
+    /** Open a compressed file for reading. Returns nullptr if it does not exist or is malformed. */
+    static std::unique_ptr<CompressedFlatFile> Open(const fs::path& path);
+
+    /** Read out.size() bytes starting at position pos of the original file. */
+    bool Read(uint64_t pos, Span<unsigned char> out);
+
+    /** Write the whole original file to dst, and commit it to disk. */
+    bool Restore(const fs::path& dst);
+
+    uint64_t Size() const { return m_size; }
+
+private:
+    CAutoFile m_file;
+    uint64_t m_size;
+    std::vector<uint64_t> m_frame_ends;
+    long m_frames_start;
+    std::vector<unsigned char> m_stored;
+
+    CompressedFlatFile(FILE* file, uint64_t size, std::vector<uint64_t> frame_ends, long frames_start);
+
+    /** Read and decompress the frame with the given index into frame. */
+    bool ReadFrame(size_t index, std::vector<unsigned char>& frame);
 };
 
 #endif // BITCOIN_FLATFILE_H
@@ -0,0 +1,349 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATHASHMAP_H
+#define BITCOIN_FLATHASHMAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/** Hash map with open addressing and flat, chunked value storage.
+ *
+ * Provides the subset of the std::unordered_map interface that CCoinsMap users
+ * rely on, without a separate heap allocation per element:
+ *
+ * - Values live in fixed-size chunks of CHUNK_SIZE slots. Chunks are never
+ *   moved or released until clear(), so pointers and references to values stay
+ *   valid until the value is erased, like for a node based container. Erased
+ *   slots are reused for later insertions.
+ * - The lookup table is a power-of-two array of 8-byte buckets holding a slot
+ *   number and 32 bits of the key's hash, probed linearly. The stored hash
+ *   avoids most key comparisons and lets the table grow without rehashing keys.
+ *   Erasing uses backward shifting, so no tombstones accumulate.
+ *
+ * Iteration visits values in slot order. Unlike std::unordered_map, iterators
+ * (other than those to the erased value) also stay valid across erase() and
+ * insertion, so erase(it++) and it = erase(it) loops both work.
+ */
+template <typename K, typename V, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+class FlatHashMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+    typedef Hash hasher;
+    typedef KeyEqual key_equal;
+
+    //! Number of value slots per storage chunk (one bit each in Chunk::live).
+    static constexpr size_t CHUNK_SIZE{64};
+
+private:
+    static_assert(sizeof(value_type) >= sizeof(uint32_t), "free slots store the next free slot number");
+
+    struct Chunk {
+        uint64_t live{0};
+        alignas(value_type) unsigned char data[CHUNK_SIZE * sizeof(value_type)];
+    };
+
+    struct Bucket {
+        //! Slot number plus one, or 0 for an empty bucket.
+        uint32_t slot{0};
+        //! Low 32 bits of the key's hash.
+        uint32_t hash{0};
+    };
+
+    static constexpr size_t MIN_BUCKETS{16};
+
+    std::vector<Bucket> m_table;
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
+    //! Number of slots handed out so far; slots at or above this have never been used.
+    size_t m_slots_used{0};
+    //! Head of the list of erased slots threaded through their storage, plus one.
+    uint32_t m_free_head{0};
+    size_t m_size{0};
+    Hash m_hash;
+    KeyEqual m_equal;
+
+    unsigned char* SlotData(size_t slot) const { return m_chunks[slot / CHUNK_SIZE]->data + (slot % CHUNK_SIZE) * sizeof(value_type); }
+    value_type* Slot(size_t slot) const { return std::launder(reinterpret_cast<value_type*>(SlotData(slot))); }
+    void SetLive(size_t slot, bool live)
+    {
+        const uint64_t bit{uint64_t{1} << (slot % CHUNK_SIZE)};
+        if (live) {
+            m_chunks[slot / CHUNK_SIZE]->live |= bit;
+        } else {
+            m_chunks[slot / CHUNK_SIZE]->live &= ~bit;
+        }
+    }
+
+    //! First live slot at or after slot, or m_slots_used if there is none.
+    size_t NextLive(size_t slot) const
+    {
+        while (slot < m_slots_used) {
+            const uint64_t word{m_chunks[slot / CHUNK_SIZE]->live >> (slot % CHUNK_SIZE)};
+            if (word != 0) {
+                for (uint64_t w = word; (w & 1) == 0; w >>= 1) ++slot;
+                return slot;
+            }
+            slot += CHUNK_SIZE - slot % CHUNK_SIZE;
+        }
+        return m_slots_used;
+    }
+
+    //! Take a slot from the free list, or a fresh one, without marking it live.
+    size_t AllocateSlot()
+    {
+        if (m_free_head != 0) {
+            const size_t slot{m_free_head - 1U};
+            std::memcpy(&m_free_head, SlotData(slot), sizeof(m_free_head));
+            return slot;
+        }
+        if (m_slots_used >= std::numeric_limits<uint32_t>::max() - 1) throw std::length_error("FlatHashMap too large");
+        if (m_slots_used == m_chunks.size() * CHUNK_SIZE) {
+            m_chunks.emplace_back(new Chunk);
+        }
+        return m_slots_used++;
+    }
+
+    void FreeSlot(size_t slot)
+    {
+        std::memcpy(SlotData(slot), &m_free_head, sizeof(m_free_head));
+        m_free_head = slot + 1;
+    }
+
+    size_t Mask() const { return m_table.size() - 1; }
+
+    //! Bucket holding key, or m_table.size() if it is not present.
+    size_t FindBucket(const K& key, size_t hash) const
+    {
+        if (m_table.empty()) return 0;
+        const uint32_t hash32{static_cast<uint32_t>(hash)};
+        for (size_t i = hash & Mask();; i = (i + 1) & Mask()) {
+            const Bucket& bucket = m_table[i];
+            if (bucket.slot == 0) return m_table.size();
+            if (bucket.hash == hash32 && m_equal(Slot(bucket.slot - 1)->first, key)) return i;
+        }
+    }
+
+    void InsertBucket(Bucket bucket)
+    {
+        size_t i = bucket.hash & Mask();
+        while (m_table[i].slot != 0) i = (i + 1) & Mask();
+        m_table[i] = bucket;
+    }
+
+    void Rehash(size_t buckets)
+    {
+        std::vector<Bucket> old_table;
+        old_table.swap(m_table);
+        m_table.resize(buckets);
+        for (const Bucket& bucket : old_table) {
+            if (bucket.slot != 0) InsertBucket(bucket);
+        }
+    }
+
+    //! Empty a bucket, moving later entries of its probe sequence back into the gap.
+    void EraseBucket(size_t hole)
+    {
+        for (size_t i = (hole + 1) & Mask(); m_table[i].slot != 0; i = (i + 1) & Mask()) {
+            const size_t home{m_table[i].hash & Mask()};
+            if (((i - home) & Mask()) >= ((i - hole) & Mask())) {
+                m_table[hole] = m_table[i];
+                hole = i;
+            }
+        }
+        m_table[hole] = Bucket{};
+    }
+
+    void DestroyValues()
+    {
+        for (size_t slot = NextLive(0); slot < m_slots_used; slot = NextLive(slot + 1)) {
+            Slot(slot)->~value_type();
+        }
+    }
+
+    template <bool IsConst>
+    class Iter
+    {
+        friend class FlatHashMap;
+        friend class Iter<!IsConst>;
+        typedef std::conditional_t<IsConst, const FlatHashMap, FlatHashMap> Map;
+
+        Map* m_map{nullptr};
+        size_t m_slot{0};
+
+        Iter(Map* map, size_t slot) : m_map(map), m_slot(slot) {}
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef FlatHashMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef std::conditional_t<IsConst, const value_type*, value_type*> pointer;
+        typedef std::conditional_t<IsConst, const value_type&, value_type&> reference;
+
+        Iter() = default;
+        template <bool C = IsConst, typename = std::enable_if_t<C>>
+        Iter(const Iter<false>& other) : m_map(other.m_map), m_slot(other.m_slot) {}
+
+        reference operator*() const { return *m_map->Slot(m_slot); }
+        pointer operator->() const { return m_map->Slot(m_slot); }
+        Iter& operator++()
+        {
+            m_slot = m_map->NextLive(m_slot + 1);
+            return *this;
+        }
+        Iter operator++(int)
+        {
+            Iter ret{*this};
+            ++*this;
+            return ret;
+        }
+        friend bool operator==(const Iter& a, const Iter& b) { return a.m_slot == b.m_slot; }
+        friend bool operator!=(const Iter& a, const Iter& b) { return a.m_slot != b.m_slot; }
+    };
+
+public:
+    typedef Iter<false> iterator;
+    typedef Iter<true> const_iterator;
+
+    FlatHashMap() = default;
+    FlatHashMap(const FlatHashMap&) = delete;
+    FlatHashMap& operator=(const FlatHashMap&) = delete;
+    FlatHashMap& operator=(FlatHashMap&&) = delete;
+
+    FlatHashMap(FlatHashMap&& other) noexcept
+        : m_table(std::move(other.m_table)),
+          m_chunks(std::move(other.m_chunks)),
+          m_slots_used(std::exchange(other.m_slots_used, 0)),
+          m_free_head(std::exchange(other.m_free_head, 0)),
+          m_size(std::exchange(other.m_size, 0)),
+          m_hash(other.m_hash),
+          m_equal(other.m_equal)
+    {
+        other.m_table.clear();
+        other.m_chunks.clear();
+    }
+
+    ~FlatHashMap() { DestroyValues(); }
+
+    iterator begin() { return iterator(this, NextLive(0)); }
+    iterator end() { return iterator(this, m_slots_used); }
+    const_iterator begin() const { return const_iterator(this, NextLive(0)); }
+    const_iterator end() const { return const_iterator(this, m_slots_used); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    bool empty() const { return m_size == 0; }
+    size_type size() const { return m_size; }
+    //! Number of buckets in the lookup table.
+    size_type bucket_count() const { return m_table.size(); }
+    //! Number of allocated value storage chunks.
+    size_type chunk_count() const { return m_chunks.size(); }
+
+    static constexpr size_t BucketSize() { return sizeof(Bucket); }
+    static constexpr size_t ChunkSize() { return sizeof(Chunk); }
+
+    iterator find(const K& key)
+    {
+        const size_t i{FindBucket(key, m_hash(key))};
+        return i < m_table.size() ? iterator(this, m_table[i].slot - 1) : end();
+    }
+
+    const_iterator find(const K& key) const
+    {
+        const size_t i{FindBucket(key, m_hash(key))};
+        return i < m_table.size() ? const_iterator(this, m_table[i].slot - 1) : end();
+    }
+
+    size_type count(const K& key) const { return find(key) != end() ? 1 : 0; }
+
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args)
+    {
+        const size_t slot{AllocateSlot()};
+        value_type* value;
+        try {
+            value = ::new (SlotData(slot)) value_type(std::forward<Args>(args)...);
+        } catch (...) {
+            FreeSlot(slot);
+            throw;
+        }
+        const size_t hash{m_hash(value->first)};
+        const size_t existing{FindBucket(value->first, hash)};
+        if (existing < m_table.size()) {
+            value->~value_type();
+            FreeSlot(slot);
+            return {iterator(this, m_table[existing].slot - 1), false};
+        }
+        if ((m_size + 1) * 4 > m_table.size() * 3) {
+            Rehash(std::max(MIN_BUCKETS, m_table.size() * 2));
+        }
+        InsertBucket(Bucket{static_cast<uint32_t>(slot + 1), static_cast<uint32_t>(hash)});
+        SetLive(slot, true);
+        ++m_size;
+        return {iterator(this, slot), true};
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value) { return emplace(std::move(value)); }
+
+    V& operator[](const K& key)
+    {
+        const iterator it{find(key)};
+        if (it != end()) return it->second;
+        return emplace(std::piecewise_construct, std::forward_as_tuple(key), std::tuple<>()).first->second;
+    }
+
+    //! Erase the value at pos and return an iterator to the next value in iteration order.
+    iterator erase(const_iterator pos)
+    {
+        const size_t slot{pos.m_slot};
+        value_type* value{Slot(slot)};
+        size_t i = m_hash(value->first) & Mask();
+        while (m_table[i].slot != slot + 1) i = (i + 1) & Mask();
+        EraseBucket(i);
+        value->~value_type();
+        SetLive(slot, false);
+        FreeSlot(slot);
+        --m_size;
+        return iterator(this, NextLive(slot + 1));
+    }
+
+    iterator erase(iterator pos) { return erase(const_iterator(pos)); }
+
+    size_type erase(const K& key)
+    {
+        const const_iterator it{find(key)};
+        if (it == end()) return 0;
+        erase(it);
+        return 1;
+    }
+
+    /** Destroy all values and release their storage. The lookup table keeps
+     *  its size, like the bucket array of std::unordered_map. */
+    void clear()
+    {
+        DestroyValues();
+        m_chunks.clear();
+        m_slots_used = 0;
+        m_free_head = 0;
+        m_size = 0;
+        std::fill(m_table.begin(), m_table.end(), Bucket{});
+    }
+};
+
+#endif // BITCOIN_FLATHASHMAP_H
@@ -209,6 +209,11 @@ void Shutdown(NodeContext& node)
     if (node.scheduler) node.scheduler->stop();
     if (node.chainman && node.chainman->m_load_block.joinable()) node.chainman->m_load_block.join();
     StopScriptCheckWorkerThreads();
+    StopHeaderCheckThreads();
+    StopBlockPrefetchThreads();
+    StopCoinsPrefetchThreads();
+    StopBlockFileCompression();
+    StopBlockWriteThread();
 
     // After the threads that potentially access these pointers have been stopped,
     // destruct and reset all to nullptr.
@@ -264,8 +269,11 @@ void Shutdown(NodeContext& node)
                 chainstate->ResetCoinsViews();
             }
         }
+        node.chainman->m_blockman.WriteIndexSnapshot(Params().GetConsensus());
         pblocktree.reset();
     }
+    // The coins flush threads are kept until here to speed up the final flushes above.
+    StopCoinsFlushThreads();
     for (const auto& client : node.chain_clients) {
         client->stop();
     }
@@ -377,30 +385,41 @@ void SetupServerArgs(ArgsManager& argsman)
     argsman.AddArg("-assumevalid=<hex>", strprintf("If this block is in the chain assume that it and its ancestors are valid and potentially skip their script verification (0 to verify all, default: %s, testnet: %s, signet: %s)", defaultChainParams->GetConsensus().defaultAssumeValid.GetHex(), testnetChainParams->GetConsensus().defaultAssumeValid.GetHex(), signetChainParams->GetConsensus().defaultAssumeValid.GetHex()), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-blocksdir=<dir>", "Specify directory to hold blocks subdirectory for *.dat files (default: <datadir>)", ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-fastprune", "Use smaller block files and lower minimum prune height for testing purposes", ArgsManager::ALLOW_ANY | ArgsManager::DEBUG_ONLY, OptionsCategory::DEBUG_TEST);
+    argsman.AddArg("-blockindexsnapshot", strprintf("Write a snapshot of the block index at shutdown, which is loaded at the next startup instead of reading the whole block index database and then checked against it in the background (default: %u)", DEFAULT_BLOCKINDEX_SNAPSHOT), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
 #if HAVE_SYSTEM
     argsman.AddArg("-blocknotify=<cmd>", "Execute command when the best block changes (%s in cmd is replaced by block hash)", ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
 #endif
+    argsman.AddArg("-blockprefetch=<n>", strprintf("Number of blocks to read from disk ahead of connecting them to the active chain (0 to disable, max: %d, default: %d)", MAX_BLOCK_PREFETCH, DEFAULT_BLOCK_PREFETCH), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-blockreconstructionextratxn=<n>", strprintf("Extra transactions to keep in memory for compact block reconstructions (default: %u)", DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-blocksonly", strprintf("Whether to reject transactions from network peers. Automatic broadcast and rebroadcast of any transactions from inbound peers is disabled, unless the peer has the 'forcerelay' permission. RPC transactions are not affected. (default: %u)", DEFAULT_BLOCKSONLY), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-blockwritebehind", strprintf("Write block and undo data on a separate thread, only waiting for it when the block index is written (default: %u)", DEFAULT_BLOCK_WRITE_BEHIND), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-coinsbackgroundflush", strprintf("Write periodic flushes of the UTXO cache to disk on a background thread while validation continues. Memory usage may temporarily exceed -dbcache by the size of the flushed cache (default: %u)", DEFAULT_COINS_BACKGROUND_FLUSH), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-coinscacheretain=<n>", strprintf("Percentage of the UTXO cache to keep in memory when it is flushed because of its size or periodically. The most recently used coins are kept (0 to empty the cache on every flush, max: %d, default: %d)", MAX_COINS_CACHE_RETAIN, DEFAULT_COINS_CACHE_RETAIN), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-coinsflushthreads=<n>", strprintf("Number of threads writing large flushes of the UTXO cache to the database (0 to disable, max: %d, default: %d)", MAX_COINSFLUSH_THREADS, DEFAULT_COINSFLUSH_THREADS), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-coinsprefetchthreads=<n>", strprintf("Number of threads looking up the inputs of a block in the UTXO database before connecting it (0 to disable, max: %d, default: %d)", MAX_COINSPREFETCH_THREADS, DEFAULT_COINSPREFETCH_THREADS), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-coinstatsindex", strprintf("Maintain coinstats index used by the gettxoutsetinfo RPC (default: %u)", DEFAULT_COINSTATSINDEX), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-compressblockfiles", strprintf("Compress block and undo files in the background once all their blocks are %d blocks deep. Compressed files are restored when they are written to again or for -reindex (default: %u)", MIN_BLOCKS_TO_KEEP, DEFAULT_COMPRESS_BLOCK_FILES), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-conf=<file>", strprintf("Specify path to read-only configuration file. Relative paths will be prefixed by datadir location. (default: %s)", BITCOIN_CONF_FILENAME), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-datadir=<dir>", "Specify data directory", ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-dbbatchsize", strprintf("Maximum database write batch size in bytes (default: %u)", nDefaultDbBatchSize), ArgsManager::ALLOW_ANY | ArgsManager::DEBUG_ONLY, OptionsCategory::OPTIONS);
     argsman.AddArg("-dbcache=<n>", strprintf("Maximum database cache size <n> MiB (%d to %d, default: %d). In addition, unused mempool memory is shared for this cache (see -maxmempool).", nMinDbCache, nMaxDbCache, nDefaultDbCache), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-includeconf=<file>", "Specify additional configuration file, relative to the -datadir path (only useable from configuration file, not command line)", ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-loadblock=<file>", "Imports blocks from external file on startup", ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-mapblockfiles", strprintf("Read blocks and undo data from block files that are no longer appended to through memory mappings (default: %u)", DEFAULT_MAP_BLOCK_FILES), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-maxmempool=<n>", strprintf("Keep the transaction memory pool below <n> megabytes (default: %u)", DEFAULT_MAX_MEMPOOL_SIZE), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-maxorphantx=<n>", strprintf("Keep at most <n> unconnectable transactions in memory (default: %u)", DEFAULT_MAX_ORPHAN_TRANSACTIONS), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-mempoolexpiry=<n>", strprintf("Do not keep transactions in the mempool longer than <n> hours (default: %u)", DEFAULT_MEMPOOL_EXPIRY), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-minimumchainwork=<hex>", strprintf("Minimum work assumed to exist on a valid chain in hex (default: %s, testnet: %s, signet: %s)", defaultChainParams->GetConsensus().nMinimumChainWork.GetHex(), testnetChainParams->GetConsensus().nMinimumChainWork.GetHex(), signetChainParams->GetConsensus().nMinimumChainWork.GetHex()), ArgsManager::ALLOW_ANY | ArgsManager::DEBUG_ONLY, OptionsCategory::OPTIONS);
     argsman.AddArg("-par=<n>", strprintf("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)",
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-parblocks=<n>", strprintf("During initial block download, let the script verification of up to <n> consecutive blocks overlap. If any of them is invalid, they are connected again one at a time (1 to disable, max: %d, default: %d)",
+        MAX_SCRIPTCHECK_BATCH_BLOCKS, DEFAULT_SCRIPTCHECK_BATCH_BLOCKS), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-persistmempool", strprintf("Whether to save the mempool on shutdown and load on restart (default: %u)", DEFAULT_PERSIST_MEMPOOL), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-pid=<file>", strprintf("Specify pid file. Relative paths will be prefixed by a net-specific datadir location. (default: %s)", BITCOIN_PID_FILENAME), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-prune=<n>", strprintf("Reduce storage requirements by enabling pruning (deleting) of old blocks. This allows the pruneblockchain RPC to be called to delete specific blocks, and enables automatic pruning of old blocks if a target size in MiB is provided. This mode is incompatible with -txindex, -coinstatsindex and -rescan. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >=%u = automatically prune block files to stay under the specified target size in MiB)", MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
-    argsman.AddArg("-reindex", "Rebuild chain state and block index from the blk*.dat files on disk", ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
+    argsman.AddArg("-reindex", strprintf("Rebuild chain state and block index from the blk*.dat files on disk. Up to %u files are read at a time, which may take up to %u MiB of memory", REINDEX_SCAN_AHEAD_FILES + 1, (REINDEX_SCAN_AHEAD_FILES + 1) * 2 * MAX_BLOCKFILE_SIZE >> 20), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-reindex-chainstate", "Rebuild chain state from the currently indexed blocks. When in pruning mode or if blocks on disk might be corrupted, use full -reindex instead.", ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
     argsman.AddArg("-settings=<file>", strprintf("Specify path to dynamic settings data file. Can be disabled with -nosettings. File is written at runtime and not meant to be edited by users (use %s instead for custom settings). Relative paths will be prefixed by datadir location. (default: %s)", BITCOIN_CONF_FILENAME, BITCOIN_SETTINGS_FILENAME), ArgsManager::ALLOW_ANY, OptionsCategory::OPTIONS);
 #if HAVE_SYSTEM
@@ -882,6 +901,8 @@ bool AppInitParameterInteraction(const ArgsManager& args)
 
     fCheckBlockIndex = args.GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     fCheckpointsEnabled = args.GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
+    g_coins_background_flush = args.GetBoolArg("-coinsbackgroundflush", DEFAULT_COINS_BACKGROUND_FLUSH);
+    g_coins_cache_retain = std::clamp<int64_t>(args.GetArg("-coinscacheretain", DEFAULT_COINS_CACHE_RETAIN), 0, MAX_COINS_CACHE_RETAIN);
 
     hashAssumeValid = uint256S(args.GetArg("-assumevalid", chainparams.GetConsensus().defaultAssumeValid.GetHex()));
     if (!hashAssumeValid.IsNull())
@@ -1101,11 +1122,40 @@ bool AppInitMain(NodeContext& node, interfaces::BlockAndHeaderTipInfo* tip_info)
     // Number of script-checking threads <= MAX_SCRIPTCHECK_THREADS
     script_threads = std::min(script_threads, MAX_SCRIPTCHECK_THREADS);
 
-    LogPrintf("Script verification uses %d additional threads\n", script_threads);
+    LogPrintf("Script verification uses %d additional threads, and %d for the mempool\n", script_threads, std::min(script_threads, MAX_MEMPOOL_SCRIPTCHECK_THREADS));
     if (script_threads >= 1) {
         g_parallel_script_checks = true;
         StartScriptCheckWorkerThreads(script_threads);
     }
+    // Headers are checked on their own threads, as the script check threads
+    // are waited for by the validation thread.
+    if (script_threads >= 1) {
+        StartHeaderCheckThreads(std::min(script_threads, MAX_HEADERCHECK_THREADS));
+    }
+    g_script_check_batch_blocks = std::clamp<int64_t>(args.GetArg("-parblocks", DEFAULT_SCRIPTCHECK_BATCH_BLOCKS), 1, MAX_SCRIPTCHECK_BATCH_BLOCKS);
+
+    const int block_prefetch = std::clamp<int64_t>(args.GetArg("-blockprefetch", DEFAULT_BLOCK_PREFETCH), 0, MAX_BLOCK_PREFETCH);
+    if (block_prefetch > 0) {
+        LogPrintf("Block prefetch reads up to %d blocks ahead using %d threads\n", block_prefetch, BLOCK_PREFETCH_THREADS);
+        StartBlockPrefetchThreads(BLOCK_PREFETCH_THREADS, block_prefetch);
+    }
+
+    g_map_block_files = args.GetBoolArg("-mapblockfiles", DEFAULT_MAP_BLOCK_FILES);
+    if (args.GetBoolArg("-blockwritebehind", DEFAULT_BLOCK_WRITE_BEHIND)) {
+        StartBlockWriteThread();
+    }
+
+    const int coins_prefetch_threads = std::clamp<int64_t>(args.GetArg("-coinsprefetchthreads", DEFAULT_COINSPREFETCH_THREADS), 0, MAX_COINSPREFETCH_THREADS);
+    if (coins_prefetch_threads > 0) {
+        LogPrintf("Coins prefetch uses %d threads\n", coins_prefetch_threads);
+        StartCoinsPrefetchThreads(coins_prefetch_threads);
+    }
+
+    const int coins_flush_threads = std::clamp<int64_t>(args.GetArg("-coinsflushthreads", DEFAULT_COINSFLUSH_THREADS), 0, MAX_COINSFLUSH_THREADS);
+    if (coins_flush_threads > 0) {
+        LogPrintf("Coins flush uses %d threads\n", coins_flush_threads);
+        StartCoinsFlushThreads(coins_flush_threads);
+    }
 
     assert(!node.scheduler);
     node.scheduler = std::make_unique<CScheduler>();
@@ -1369,6 +1419,13 @@ bool AppInitMain(NodeContext& node, interfaces::BlockAndHeaderTipInfo* tip_info)
 
                 if (ShutdownRequested()) break;
 
+                if (args.GetBoolArg("-blockindexsnapshot", DEFAULT_BLOCKINDEX_SNAPSHOT)) {
+                    chainman.m_blockman.m_index_snapshot_path = args.GetDataDirNet() / "blocks" / "index.snapshot";
+                } else {
+                    // Don't leave a snapshot behind that would be stale once enabled again.
+                    fs::remove(args.GetDataDirNet() / "blocks" / "index.snapshot");
+                }
+
                 // LoadBlockIndex will load fHavePruned if we've ever removed a
                 // block file from disk.
                 // Note that it also sets fReindex based on the disk flag!
@@ -1421,6 +1478,8 @@ bool AppInitMain(NodeContext& node, interfaces::BlockAndHeaderTipInfo* tip_info)
 
                     // If necessary, upgrade from older database format.
                     // This is a no-op if we cleared the coinsviewdb with -reindex or -reindex-chainstate
+                    // No background coins flush can be pending here or during the
+                    // checks below, as those only start once blocks are connected.
                     if (!chainstate->CoinsDB().Upgrade()) {
                         strLoadError = _("Error upgrading chainstate database");
                         failed_chainstate_init = true;
@@ -1636,6 +1695,10 @@ bool AppInitMain(NodeContext& node, interfaces::BlockAndHeaderTipInfo* tip_info)
         ThreadImport(chainman, vImportFiles, args);
     });
 
+    if (args.GetBoolArg("-compressblockfiles", DEFAULT_COMPRESS_BLOCK_FILES)) {
+        StartBlockFileCompression(chainman);
+    }
+
     // Wait for genesis block to be processed
     {
         WAIT_LOCK(g_genesis_wait_mutex, lock);
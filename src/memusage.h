@@ -5,8 +5,10 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include <flathashmap.h>
 #include <indirectmap.h>
 #include <prevector.h>
+#include <support/allocators/pool.h>
 
 #include <stdlib.h>
 
@@ -167,6 +169,25 @@ static inline size_t DynamicUsage(const std::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z, typename W, typename P, size_t MAX_BLOCK_SIZE_BYTES, size_t ALIGN_BYTES>
+static inline size_t DynamicUsage(const std::unordered_map<X, Y, Z, W, PoolAllocator<P, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>>& m)
+{
+    // Nodes live in the pool's chunks, which are counted in full whether or
+    // not their blocks are in use. The bucket array is counted on its own,
+    // even while it is small enough to be taken from the pool.
+    const auto* resource = m.get_allocator().resource();
+    return resource->AllocatedBytes() +
+           MallocUsage(sizeof(void*) * resource->NumAllocatedChunks()) +
+           MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+template<typename X, typename Y, typename Z, typename W>
+static inline size_t DynamicUsage(const FlatHashMap<X, Y, Z, W>& m)
+{
+    // Allocated chunks are counted in full, including erased and unused slots.
+    return MallocUsage(m.ChunkSize()) * m.chunk_count() + MallocUsage(sizeof(void*) * m.chunk_count()) + MallocUsage(m.BucketSize() * m.bucket_count());
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
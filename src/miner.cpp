@@ -93,6 +93,7 @@ void BlockAssembler::resetBlock()
     nBlockWeight = 4000;
     nBlockSigOpsCost = 400;
     fIncludeWitness = false;
+    fAllPackagesAdded = true;
 
     // These counters do not include coinbase tx
     nBlockTx = 0;
@@ -151,6 +152,105 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int64_t nTime1 = GetTimeMicros();
 
+    FinishBlock(scriptPubKeyIn, pindexPrev);
+    int64_t nTime2 = GetTimeMicros();
+
+    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+
+    return std::move(pblocktemplate);
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, BlockTemplateCache& cache)
+{
+    LOCK2(cs_main, m_mempool.cs);
+    CBlockIndex* pindexPrev = m_chainstate.m_chain.Tip();
+    assert(pindexPrev != nullptr);
+    uint64_t additions_reset;
+    const std::vector<CTxMemPool::txiter>& additions = m_mempool.GetAdditions(additions_reset);
+
+    if (!ExtendCachedBlock(scriptPubKeyIn, cache, pindexPrev, additions_reset, additions)) {
+        pblocktemplate = CreateNewBlock(scriptPubKeyIn);
+    }
+
+    cache.block_template = std::make_unique<CBlockTemplate>(*pblocktemplate);
+    cache.mempool = &m_mempool;
+    cache.prev_hash = pindexPrev->GetBlockHash();
+    cache.script_pub_key = scriptPubKeyIn;
+    cache.max_weight = nBlockMaxWeight;
+    cache.min_fee_rate = blockMinFeeRate;
+    cache.lock_time_cutoff = nLockTimeCutoff;
+    cache.include_witness = fIncludeWitness;
+    cache.additions_reset = additions_reset;
+    cache.additions_seen = additions.size();
+    cache.all_packages_added = fAllPackagesAdded;
+    cache.in_block = inBlock;
+    cache.block_weight = nBlockWeight;
+    cache.block_sigops_cost = nBlockSigOpsCost;
+    cache.fees = nFees;
+
+    return std::move(pblocktemplate);
+}
+
+bool BlockAssembler::ExtendCachedBlock(const CScript& scriptPubKeyIn, const BlockTemplateCache& cache, CBlockIndex* pindexPrev,
+                                       uint64_t additions_reset, const std::vector<CTxMemPool::txiter>& additions)
+{
+    AssertLockHeld(m_mempool.cs);
+    if (!cache.block_template || cache.mempool != &m_mempool || cache.prev_hash != pindexPrev->GetBlockHash() ||
+        cache.script_pub_key != scriptPubKeyIn || cache.max_weight != nBlockMaxWeight || cache.min_fee_rate != blockMinFeeRate ||
+        cache.additions_reset != additions_reset || cache.additions_seen > additions.size()) {
+        return false;
+    }
+    // If a package did not fit, a new transaction may be better than a
+    // transaction already in the template, so the selection has to be redone.
+    if (!cache.all_packages_added) return false;
+
+    int64_t nTimeStart = GetTimeMicros();
+
+    pblocktemplate = std::make_unique<CBlockTemplate>(*cache.block_template);
+    inBlock = cache.in_block;
+    nBlockWeight = cache.block_weight;
+    nBlockSigOpsCost = cache.block_sigops_cost;
+    nFees = cache.fees;
+    nBlockTx = pblocktemplate->block.vtx.size() - 1;
+    nHeight = pindexPrev->nHeight + 1;
+    nLockTimeCutoff = cache.lock_time_cutoff;
+    fIncludeWitness = cache.include_witness;
+    fAllPackagesAdded = true;
+
+    for (auto it = additions.begin() + cache.additions_seen; it != additions.end(); ++it) {
+        const CTxMemPool::txiter iter = *it;
+        // Non-final and premature witness transactions stay that way for
+        // this tip, and so do their descendants.
+        if (!TestPackageTransactions({iter})) continue;
+        for (const CTxMemPoolEntry& parent : iter->GetMemPoolParentsConst()) {
+            // The transaction may pay for a parent that was left out
+            if (!inBlock.count(m_mempool.mapTx.iterator_to(parent))) return false;
+        }
+        if (iter->GetModifiedFee() < blockMinFeeRate.GetFee(iter->GetTxSize())) continue;
+        if (!TestPackage(iter->GetTxSize(), iter->GetSigOpCost())) return false;
+        AddToBlock(iter);
+    }
+
+    if (nBlockTx + 1 == cache.block_template->block.vtx.size()) {
+        // Nothing was added, and the template has been checked before
+        UpdateTime(&pblocktemplate->block, chainparams.GetConsensus(), pindexPrev);
+        LogPrint(BCLog::BENCH, "CreateNewBlock() reused cached template (total %.2fms)\n", 0.001 * (GetTimeMicros() - nTimeStart));
+        return true;
+    }
+
+    int64_t nTime1 = GetTimeMicros();
+    const size_t nTxAdded = pblocktemplate->block.vtx.size() - cache.block_template->block.vtx.size();
+    FinishBlock(scriptPubKeyIn, pindexPrev);
+    int64_t nTime2 = GetTimeMicros();
+
+    LogPrint(BCLog::BENCH, "CreateNewBlock() extended cached template: %.2fms (%u txs), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nTxAdded, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    return true;
+}
+
+void BlockAssembler::FinishBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev)
+{
+    CBlock* const pblock = &pblocktemplate->block;
+
     m_last_block_num_txs = nBlockTx;
     m_last_block_weight = nBlockWeight;
 
@@ -179,11 +279,6 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     if (!TestBlockValidity(state, chainparams, m_chainstate, *pblock, pindexPrev, false, false)) {
         throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, state.ToString()));
     }
-    int64_t nTime2 = GetTimeMicros();
-
-    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
-
-    return std::move(pblocktemplate);
 }
 
 void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
@@ -380,6 +475,7 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
         }
 
         if (!TestPackage(packageSize, packageSigOpsCost)) {
+            fAllPackagesAdded = false;
             if (fUsingModified) {
                 // Since we always look at the best entry in mapModifiedTx,
                 // we must erase failed entries so that we can consider the
@@ -33,6 +33,33 @@ struct CBlockTemplate
     std::vector<unsigned char> vchCoinbaseCommitment;
 };
 
+/**
+ * The last template created by BlockAssembler::CreateNewBlock with this cache
+ * and the assembler state it was left in, so that the next call can append the
+ * transactions that entered the mempool since instead of assembling a new one.
+ */
+struct BlockTemplateCache
+{
+    std::unique_ptr<CBlockTemplate> block_template;
+    const CTxMemPool* mempool{nullptr};
+    uint256 prev_hash;
+    CScript script_pub_key;
+    unsigned int max_weight{0};
+    CFeeRate min_fee_rate;
+    int64_t lock_time_cutoff{0};
+    bool include_witness{false};
+    //! CTxMemPool::GetAdditions() state that the template reflects
+    uint64_t additions_reset{0};
+    size_t additions_seen{0};
+    //! Whether no package was left out for lack of space, so that all new
+    //! transactions can be appended without changing the selection
+    bool all_packages_added{false};
+    CTxMemPool::setEntries in_block;
+    uint64_t block_weight{0};
+    uint64_t block_sigops_cost{0};
+    CAmount fees{0};
+};
+
 // Container for tracking updates to ancestor feerate as we include (parent)
 // transactions in a block
 struct CTxMemPoolModifiedEntry {
@@ -131,6 +158,8 @@ private:
 
     // Configuration parameters for the block size
     bool fIncludeWitness;
+    // Whether no package was left out for lack of space
+    bool fAllPackagesAdded;
     unsigned int nBlockMaxWeight;
     CFeeRate blockMinFeeRate;
 
@@ -160,6 +189,10 @@ public:
 
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn);
+    /** Construct a new block template with coinbase to scriptPubKeyIn, by
+      * appending the transactions added to the mempool since to the template
+      * in cache if it is still current, and update the cache. */
+    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, BlockTemplateCache& cache);
 
     inline static std::optional<int64_t> m_last_block_num_txs{};
     inline static std::optional<int64_t> m_last_block_weight{};
@@ -170,6 +203,12 @@ private:
     void resetBlock();
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
+    /** Add the coinbase and header to the block and check its validity */
+    void FinishBlock(const CScript& scriptPubKeyIn, CBlockIndex* pindexPrev) EXCLUSIVE_LOCKS_REQUIRED(::cs_main);
+    /** Restore the block from cache and append the given mempool additions.
+      * Returns false if the template has to be assembled from scratch. */
+    bool ExtendCachedBlock(const CScript& scriptPubKeyIn, const BlockTemplateCache& cache, CBlockIndex* pindexPrev,
+                           uint64_t additions_reset, const std::vector<CTxMemPool::txiter>& additions) EXCLUSIVE_LOCKS_REQUIRED(::cs_main, m_mempool.cs);
 
     // Methods for how to add transactions to a block.
     /** Add transactions based on feerate including unconfirmed ancestors
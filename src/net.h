@@ -109,6 +109,28 @@ struct CSerializedNetMsg
 
     std::vector<unsigned char> data;
     std::string m_type;
+    /**
+     * Memory to send the payload from instead of data, which stays valid as
+     * long as m_payload_owner is alive. Used to send blocks straight from
+     * memory mapped block files.
+     */
+    Span<const unsigned char> m_payload_ref;
+    std::shared_ptr<const void> m_payload_owner;
+
+    Span<const unsigned char> Payload() const { return m_payload_owner ? m_payload_ref : Span<const unsigned char>{data}; }
+};
+
+/** Bytes queued for sending to a peer, either owned or referenced like CSerializedNetMsg::m_payload_ref */
+struct CSendBuffer
+{
+    explicit CSendBuffer(std::vector<unsigned char>&& data) : m_data(std::move(data)) {}
+    CSendBuffer(Span<const unsigned char> ref, std::shared_ptr<const void> owner) : m_ref(ref), m_owner(std::move(owner)) {}
+
+    std::vector<unsigned char> m_data;
+    Span<const unsigned char> m_ref;
+    std::shared_ptr<const void> m_owner;
+
+    Span<const unsigned char> Bytes() const { return m_owner ? m_ref : Span<const unsigned char>{m_data}; }
 };
 
 /** Different types of connections to a peer. This enum encapsulates the
@@ -408,7 +430,7 @@ public:
     /** Offset inside the first vSendMsg already sent */
     size_t nSendOffset GUARDED_BY(cs_vSend){0};
     uint64_t nSendBytes GUARDED_BY(cs_vSend){0};
-    std::deque<std::vector<unsigned char>> vSendMsg GUARDED_BY(cs_vSend);
+    std::deque<CSendBuffer> vSendMsg GUARDED_BY(cs_vSend);
     Mutex cs_vSend;
     Mutex cs_hSocket;
     Mutex cs_vRecv;
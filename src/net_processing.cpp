@@ -1754,11 +1754,20 @@ void PeerManagerImpl::ProcessGetBlockData(CNode& pfrom, Peer& peer, const CInv&
     } else if (inv.IsMsgWitnessBlk()) {
         // Fast-path: in this case it is possible to serve the block directly from disk,
         // as the network format matches the format on disk
-        std::vector<uint8_t> block_data;
-        if (!ReadRawBlockFromDisk(block_data, pindex, m_chainparams.MessageStart())) {
-            assert(!"cannot load block from disk");
+        Span<const uint8_t> mapped_data;
+        if (auto mapped = MapRawBlockFromDisk(mapped_data, pindex, m_chainparams.MessageStart())) {
+            // Send the block straight from the mapped block file
+            CSerializedNetMsg msg = msgMaker.Make(NetMsgType::BLOCK);
+            msg.m_payload_ref = mapped_data;
+            msg.m_payload_owner = std::move(mapped);
+            m_connman.PushMessage(&pfrom, std::move(msg));
+        } else {
+            std::vector<uint8_t> block_data;
+            if (!ReadRawBlockFromDisk(block_data, pindex, m_chainparams.MessageStart())) {
+                assert(!"cannot load block from disk");
+            }
+            m_connman.PushMessage(&pfrom, msgMaker.Make(NetMsgType::BLOCK, MakeSpan(block_data)));
         }
-        m_connman.PushMessage(&pfrom, msgMaker.Make(NetMsgType::BLOCK, MakeSpan(block_data)));
         // Don't set pblock as we've sent the block
     } else {
         // Send block from disk
@@ -3114,54 +3123,60 @@ void PeerManagerImpl::ProcessMessage(CNode& pfrom, const std::string& msg_type,
         const uint256& txid = ptx->GetHash();
         const uint256& wtxid = ptx->GetWitnessHash();
 
-        LOCK2(cs_main, g_cs_orphans);
+        {
+            LOCK2(cs_main, g_cs_orphans);
+
+            CNodeState* nodestate = State(pfrom.GetId());
+
+            const uint256& hash = nodestate->m_wtxid_relay ? wtxid : txid;
+            pfrom.AddKnownTx(hash);
+            if (nodestate->m_wtxid_relay && txid != wtxid) {
+                // Insert txid into filterInventoryKnown, even for
+                // wtxidrelay peers. This prevents re-adding of
+                // unconfirmed parents to the recently_announced
+                // filter, when a child tx is requested. See
+                // ProcessGetData().
+                pfrom.AddKnownTx(txid);
+            }
 
-        CNodeState* nodestate = State(pfrom.GetId());
-
-        const uint256& hash = nodestate->m_wtxid_relay ? wtxid : txid;
-        pfrom.AddKnownTx(hash);
-        if (nodestate->m_wtxid_relay && txid != wtxid) {
-            // Insert txid into filterInventoryKnown, even for
-            // wtxidrelay peers. This prevents re-adding of
-            // unconfirmed parents to the recently_announced
-            // filter, when a child tx is requested. See
-            // ProcessGetData().
-            pfrom.AddKnownTx(txid);
-        }
-
-        m_txrequest.ReceivedResponse(pfrom.GetId(), txid);
-        if (tx.HasWitness()) m_txrequest.ReceivedResponse(pfrom.GetId(), wtxid);
-
-        // We do the AlreadyHaveTx() check using wtxid, rather than txid - in the
-        // absence of witness malleation, this is strictly better, because the
-        // recent rejects filter may contain the wtxid but rarely contains
-        // the txid of a segwit transaction that has been rejected.
-        // In the presence of witness malleation, it's possible that by only
-        // doing the check with wtxid, we could overlook a transaction which
-        // was confirmed with a different witness, or exists in our mempool
-        // with a different witness, but this has limited downside:
-        // mempool validation does its own lookup of whether we have the txid
-        // already; and an adversary can already relay us old transactions
-        // (older than our recency filter) if trying to DoS us, without any need
-        // for witness malleation.
-        if (AlreadyHaveTx(GenTxid(/* is_wtxid=*/true, wtxid))) {
-            if (pfrom.HasPermission(NetPermissionFlags::ForceRelay)) {
-                // Always relay transactions received from peers with forcerelay
-                // permission, even if they were already in the mempool, allowing
-                // the node to function as a gateway for nodes hidden behind it.
-                if (!m_mempool.exists(tx.GetHash())) {
-                    LogPrintf("Not relaying non-mempool transaction %s from forcerelay peer=%d\n", tx.GetHash().ToString(), pfrom.GetId());
-                } else {
-                    LogPrintf("Force relaying tx %s from peer=%d\n", tx.GetHash().ToString(), pfrom.GetId());
-                    _RelayTransaction(tx.GetHash(), tx.GetWitnessHash());
+            m_txrequest.ReceivedResponse(pfrom.GetId(), txid);
+            if (tx.HasWitness()) m_txrequest.ReceivedResponse(pfrom.GetId(), wtxid);
+
+            // We do the AlreadyHaveTx() check using wtxid, rather than txid - in the
+            // absence of witness malleation, this is strictly better, because the
+            // recent rejects filter may contain the wtxid but rarely contains
+            // the txid of a segwit transaction that has been rejected.
+            // In the presence of witness malleation, it's possible that by only
+            // doing the check with wtxid, we could overlook a transaction which
+            // was confirmed with a different witness, or exists in our mempool
+            // with a different witness, but this has limited downside:
+            // mempool validation does its own lookup of whether we have the txid
+            // already; and an adversary can already relay us old transactions
+            // (older than our recency filter) if trying to DoS us, without any need
+            // for witness malleation.
+            if (AlreadyHaveTx(GenTxid(/* is_wtxid=*/true, wtxid))) {
+                if (pfrom.HasPermission(NetPermissionFlags::ForceRelay)) {
+                    // Always relay transactions received from peers with forcerelay
+                    // permission, even if they were already in the mempool, allowing
+                    // the node to function as a gateway for nodes hidden behind it.
+                    if (!m_mempool.exists(tx.GetHash())) {
+                        LogPrintf("Not relaying non-mempool transaction %s from forcerelay peer=%d\n", tx.GetHash().ToString(), pfrom.GetId());
+                    } else {
+                        LogPrintf("Force relaying tx %s from peer=%d\n", tx.GetHash().ToString(), pfrom.GetId());
+                        _RelayTransaction(tx.GetHash(), tx.GetWitnessHash());
+                    }
                 }
+                return;
             }
-            return;
         }
 
-        const MempoolAcceptResult result = AcceptToMemoryPool(m_chainman.ActiveChainstate(), m_mempool, ptx, false /* bypass_limits */);
+        // Verify the scripts without holding cs_main, so that transactions do
+        // not hold up block processing for long.
+        const MempoolAcceptResult result = AcceptToMemoryPoolPipelined(m_chainman.ActiveChainstate(), m_mempool, ptx);
         const TxValidationState& state = result.m_state;
 
+        LOCK2(cs_main, g_cs_orphans);
+
         if (result.m_result_type == MempoolAcceptResult::ResultType::VALID) {
             m_mempool.check(m_chainman.ActiveChainstate());
             // As this version of the transaction was acceptable, we can forget about any
@@ -8,6 +8,7 @@
 #include <chainparams.h>
 #include <clientversion.h>
 #include <consensus/validation.h>
+#include <crypto/common.h>
 #include <flatfile.h>
 #include <fs.h>
 #include <hash.h>
@@ -17,10 +18,23 @@
 #include <streams.h>
 #include <undo.h>
 #include <util/system.h>
+#include <util/thread.h>
+#include <util/threadpool.h>
 #include <validation.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <optional>
+#include <set>
+#include <thread>
+#include <tuple>
+
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
+std::atomic_bool g_map_block_files{DEFAULT_MAP_BLOCK_FILES};
 bool fHavePruned = false;
 bool fPruneMode = false;
 uint64_t nPruneTarget = 0;
@@ -46,6 +60,324 @@ static FILE* OpenUndoFile(const FlatFilePos& pos, bool fReadOnly = false);
 static FlatFileSeq BlockFileSeq();
 static FlatFileSeq UndoFileSeq();
 
+/** Size of the message start and length preceding each record in the block and undo files */
+static constexpr unsigned int STORAGE_HEADER_BYTES{8};
+
+/**
+ * Write-behind queue for the block and undo files.
+ *
+ * Space in the files is reserved by the caller, so that positions are known
+ * right away, while serializing and writing the data, and flushing the files,
+ * happen in submission order on the block write thread. Reads of data that
+ * is still queued wait for it to be written, and Wait() is the barrier for
+ * callers that need everything on disk. While the thread is not running,
+ * writes are done synchronously by the caller.
+ */
+class BlockWriteQueue
+{
+public:
+    //! Whether the data goes to an undo file, and its position in the file.
+    using Key = std::tuple<bool, int, unsigned int>;
+
+private:
+    struct Write {
+        std::function<bool()> fn;
+        size_t bytes;
+        std::optional<Key> key;
+    };
+
+    Mutex m_mutex;
+    //! Signalled whenever work is queued or completed.
+    std::condition_variable m_cv;
+    std::deque<Write> m_queue GUARDED_BY(m_mutex);
+    //! Positions of queued and in-progress writes.
+    std::set<Key> m_pending GUARDED_BY(m_mutex);
+    size_t m_queued_bytes GUARDED_BY(m_mutex){0};
+    bool m_busy GUARDED_BY(m_mutex){false};
+    bool m_running GUARDED_BY(m_mutex){false};
+    bool m_request_stop GUARDED_BY(m_mutex){false};
+    //! Whether a write on the block write thread failed.
+    std::atomic<bool> m_failed{false};
+    std::thread m_thread;
+
+    void Loop()
+    {
+        WAIT_LOCK(m_mutex, lock);
+        while (true) {
+            m_cv.wait(lock, [&]() EXCLUSIVE_LOCKS_REQUIRED(m_mutex) { return m_request_stop || !m_queue.empty(); });
+            if (m_queue.empty()) {
+                // Only stop once everything has been written.
+                m_running = false;
+                m_cv.notify_all();
+                return;
+            }
+            Write write = std::move(m_queue.front());
+            m_queue.pop_front();
+            m_busy = true;
+            {
+                REVERSE_LOCK(lock);
+                if (!write.fn()) m_failed = true;
+            }
+            m_busy = false;
+            m_queued_bytes -= write.bytes;
+            if (write.key) m_pending.erase(*write.key);
+            m_cv.notify_all();
+        }
+    }
+
+public:
+    ~BlockWriteQueue()
+    {
+        assert(!m_thread.joinable());
+    }
+
+    void Start()
+    {
+        LOCK(m_mutex);
+        assert(!m_thread.joinable());
+        m_running = true;
+        m_request_stop = false;
+        m_thread = std::thread(&util::TraceThread, "blkwrite", [this] { Loop(); });
+    }
+
+    //! Write everything still queued, then join the block write thread.
+    void Stop()
+    {
+        WITH_LOCK(m_mutex, m_request_stop = true);
+        m_cv.notify_all();
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+    /**
+     * Queue fn, which writes bytes of data at key, or flushes a file if key is
+     * not set. Waits while more than MAX_BLOCK_WRITE_QUEUE_BYTES are queued.
+     * Returns false if fn was run synchronously and failed.
+     */
+    bool Enqueue(std::function<bool()> fn, size_t bytes, std::optional<Key> key = std::nullopt)
+    {
+        {
+            WAIT_LOCK(m_mutex, lock);
+            m_cv.wait(lock, [&]() EXCLUSIVE_LOCKS_REQUIRED(m_mutex) { return !m_running || m_queue.empty() || m_queued_bytes + bytes <= MAX_BLOCK_WRITE_QUEUE_BYTES; });
+            if (m_running) {
+                if (key) m_pending.insert(*key);
+                m_queued_bytes += bytes;
+                m_queue.push_back({std::move(fn), bytes, std::move(key)});
+                m_cv.notify_all();
+                return true;
+            }
+        }
+        return fn();
+    }
+
+    //! Wait until the data at key is no longer queued.
+    void WaitFor(const Key& key)
+    {
+        WAIT_LOCK(m_mutex, lock);
+        m_cv.wait(lock, [&]() EXCLUSIVE_LOCKS_REQUIRED(m_mutex) { return m_pending.count(key) == 0; });
+    }
+
+    //! Wait until everything queued so far has been written. Returns false if a write failed.
+    bool Wait()
+    {
+        WAIT_LOCK(m_mutex, lock);
+        m_cv.wait(lock, [&]() EXCLUSIVE_LOCKS_REQUIRED(m_mutex) { return m_queue.empty() && !m_busy; });
+        return !m_failed;
+    }
+};
+
+static BlockWriteQueue g_block_writes;
+
+struct MappedFileEntry {
+    std::shared_ptr<const MappedFlatFile> mapped;
+    uint64_t last_used;
+};
+
+static Mutex g_mapped_files_mutex;
+/** Memory mappings of block and undo files, keyed by file name */
+static std::map<fs::path, MappedFileEntry> g_mapped_files GUARDED_BY(g_mapped_files_mutex);
+static uint64_t g_mapped_files_uses GUARDED_BY(g_mapped_files_mutex){0};
+
+/** An open compressed block or undo file, which one reader at a time may read from. */
+struct OpenCompressedFile {
+    Mutex mutex;
+    const std::unique_ptr<CompressedFlatFile> file PT_GUARDED_BY(mutex);
+
+    explicit OpenCompressedFile(std::unique_ptr<CompressedFlatFile> file_in) : file(std::move(file_in)) {}
+};
+
+struct OpenCompressedFileEntry {
+    std::shared_ptr<OpenCompressedFile> open;
+    uint64_t last_used;
+};
+
+static Mutex g_compressed_files_mutex;
+/** Open compressed block and undo files, keyed by file name, so that their header is only read once */
+static std::map<fs::path, OpenCompressedFileEntry> g_compressed_files GUARDED_BY(g_compressed_files_mutex);
+static uint64_t g_compressed_files_uses GUARDED_BY(g_compressed_files_mutex){0};
+
+/** Drop all mappings and open compressed files, e.g. because files are about to be removed. Readers keep theirs alive. */
+static void DropOpenFiles()
+{
+    WITH_LOCK(g_mapped_files_mutex, g_mapped_files.clear());
+    WITH_LOCK(g_compressed_files_mutex, g_compressed_files.clear());
+}
+
+/**
+ * Get a mapping of the block or undo file with the given number that covers
+ * at least its first end bytes, or nullptr if it should be read with fread.
+ *
+ * Only files that blocks are no longer appended to are mapped, and only up
+ * to their size in the block file info, which may include space reserved for
+ * queued writes (see BlockWriteQueue) but never exceeds the file size. Undo
+ * data may still be appended to these files, in which case they are mapped
+ * again once a read goes past the current mapping.
+ */
+static std::shared_ptr<const MappedFlatFile> MapFile(bool undo, int file, uint64_t end)
+{
+    if (!g_map_block_files) return nullptr;
+    uint64_t size;
+    {
+        LOCK(cs_LastBlockFile);
+        if (file < 0 || file >= nLastBlockFile) return nullptr;
+        size = undo ? vinfoBlockFile[file].nUndoSize : vinfoBlockFile[file].nSize;
+    }
+    if (end > size) return nullptr;
+
+    const FlatFileSeq seq{undo ? UndoFileSeq() : BlockFileSeq()};
+    const fs::path path{seq.FileName(FlatFilePos(file, 0))};
+    LOCK(g_mapped_files_mutex);
+    MappedFileEntry& entry = g_mapped_files[path];
+    entry.last_used = ++g_mapped_files_uses;
+    if (!entry.mapped || entry.mapped->Data().size() < end) {
+        entry.mapped = seq.Map(file, size);
+    }
+    std::shared_ptr<const MappedFlatFile> mapped = entry.mapped;
+    if (!mapped) {
+        g_mapped_files.erase(path);
+    } else if (g_mapped_files.size() > MAX_MAPPED_BLOCK_FILES) {
+        g_mapped_files.erase(std::min_element(g_mapped_files.begin(), g_mapped_files.end(), [](const auto& a, const auto& b) {
+            return a.second.last_used < b.second.last_used;
+        }));
+    }
+    return mapped;
+}
+
+/**
+ * Find the block or undo record at pos, followed by trailer bytes, in a
+ * mapped file. The returned mapping keeps record valid. Returns nullptr if
+ * the file is not mapped or the record does not fit, in which case it should
+ * be read with fread, which also reports any errors.
+ */
+static std::shared_ptr<const MappedFlatFile> MapRecord(bool undo, const FlatFilePos& pos, size_t trailer, Span<const unsigned char>& record)
+{
+    if (pos.nPos < STORAGE_HEADER_BYTES) return nullptr;
+    std::shared_ptr<const MappedFlatFile> mapped = MapFile(undo, pos.nFile, pos.nPos);
+    if (!mapped) return nullptr;
+    const uint64_t end = uint64_t{pos.nPos} + ReadLE32(mapped->Data().data() + pos.nPos - 4) + trailer;
+    if (end > mapped->Data().size()) {
+        mapped = MapFile(undo, pos.nFile, end);
+        if (!mapped) return nullptr;
+    }
+    record = mapped->Data().subspan(pos.nPos, end - trailer - pos.nPos);
+    return mapped;
+}
+
+/** Get the open compressed file at path, or nullptr if it does not exist or is malformed. */
+static std::shared_ptr<OpenCompressedFile> GetCompressedFile(const fs::path& path)
+{
+    LOCK(g_compressed_files_mutex);
+    auto it = g_compressed_files.find(path);
+    if (it == g_compressed_files.end()) {
+        std::unique_ptr<CompressedFlatFile> file = CompressedFlatFile::Open(path);
+        if (!file) return nullptr;
+        it = g_compressed_files.emplace(path, OpenCompressedFileEntry{std::make_shared<OpenCompressedFile>(std::move(file)), 0}).first;
+    }
+    it->second.last_used = ++g_compressed_files_uses;
+    std::shared_ptr<OpenCompressedFile> open = it->second.open;
+    if (g_compressed_files.size() > MAX_OPEN_COMPRESSED_FILES) {
+        g_compressed_files.erase(std::min_element(g_compressed_files.begin(), g_compressed_files.end(), [](const auto& a, const auto& b) {
+            return a.second.last_used < b.second.last_used;
+        }));
+    }
+    return open;
+}
+
+/**
+ * Read the block or undo record at pos, followed by trailer bytes, into buf
+ * if its file has been compressed (see -compressblockfiles). record then
+ * refers to the record within buf, which starts with the record's header.
+ * Returns false if the file has not been compressed or the record cannot be
+ * read from it.
+ *
+ * An original file is only removed after its compressed copy is in place,
+ * and the other way around when restoring it, so the compressed copy is
+ * tried first.
+ */
+static bool ReadCompressedRecord(bool undo, const FlatFilePos& pos, size_t trailer, std::vector<unsigned char>& buf, Span<const unsigned char>& record)
+{
+    if (pos.nPos < STORAGE_HEADER_BYTES) return false;
+    const FlatFileSeq seq{undo ? UndoFileSeq() : BlockFileSeq()};
+    const std::shared_ptr<OpenCompressedFile> open = GetCompressedFile(seq.CompressedFileName(pos));
+    if (!open) return false;
+    LOCK(open->mutex);
+    CompressedFlatFile* const file = open->file.get();
+    buf.resize(STORAGE_HEADER_BYTES);
+    if (!file->Read(pos.nPos - STORAGE_HEADER_BYTES, buf)) return false;
+    const uint32_t size = ReadLE32(buf.data() + 4);
+    if (size > MAX_SIZE) return false;
+    buf.resize(STORAGE_HEADER_BYTES + size + trailer);
+    if (!file->Read(pos.nPos, Span<unsigned char>{buf}.subspan(STORAGE_HEADER_BYTES))) return false;
+    record = Span<const unsigned char>{buf}.subspan(STORAGE_HEADER_BYTES, size);
+    return true;
+}
+
+/**
+ * Bring back the original of a compressed block or undo file before writing
+ * to it, and remove the compressed copy.
+ */
+static bool RestoreCompressedFile(const FlatFileSeq& seq, int file) EXCLUSIVE_LOCKS_REQUIRED(cs_LastBlockFile)
+{
+    const FlatFilePos pos{file, 0};
+    const fs::path compressed_path{seq.CompressedFileName(pos)};
+    if (!fs::exists(compressed_path)) return true;
+    const fs::path path{seq.FileName(pos)};
+    if (!fs::exists(path)) {
+        fs::path tmp_path{path};
+        tmp_path += ".tmp";
+        std::unique_ptr<CompressedFlatFile> compressed = CompressedFlatFile::Open(compressed_path);
+        if (!compressed || !compressed->Restore(tmp_path) || !RenameOver(tmp_path, path)) {
+            return error("%s: failed to restore %s", __func__, path.string());
+        }
+        LogPrintf("Restored %s from its compressed copy\n", path.filename().string());
+    }
+    // Close the compressed copy before removing it, and drop it again afterwards in
+    // case a reader opened it in the meantime, as it may be compressed again later.
+    DropOpenFiles();
+    fs::remove(compressed_path);
+    DropOpenFiles();
+    return true;
+}
+
+bool IsBlockFileCompressed(int file)
+{
+    return fs::exists(BlockFileSeq().CompressedFileName(FlatFilePos(file, 0)));
+}
+
+void StartBlockWriteThread()
+{
+    g_block_writes.Start();
+}
+
+void StopBlockWriteThread()
+{
+    g_block_writes.Stop();
+}
+
+bool WaitForBlockWrites()
+{
+    return g_block_writes.Wait();
+}
+
 bool IsBlockPruned(const CBlockIndex* pblockindex)
 {
     return (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0);
@@ -59,20 +391,23 @@ bool IsBlockPruned(const CBlockIndex* pblockindex)
 // works correctly.
 void CleanupBlockRevFiles()
 {
-    std::map<std::string, fs::path> mapBlockFiles;
+    std::multimap<std::string, fs::path> mapBlockFiles;
 
     // Glob all blk?????.dat and rev?????.dat files from the blocks directory.
     // Remove the rev files immediately and insert the blk file paths into an
     // ordered map keyed by block file index.
     LogPrintf("Removing unusable blk?????.dat and rev?????.dat files for -reindex with -prune\n");
+    DropOpenFiles();
     fs::path blocksdir = gArgs.GetBlocksDirPath();
     for (fs::directory_iterator it(blocksdir); it != fs::directory_iterator(); it++) {
+        const std::string filename = it->path().filename().string();
+        // Compressed copies (see -compressblockfiles) are handled like the originals.
         if (fs::is_regular_file(*it) &&
-            it->path().filename().string().length() == 12 &&
-            it->path().filename().string().substr(8,4) == ".dat")
+            ((filename.length() == 12 && filename.substr(8, 4) == ".dat") ||
+             (filename.length() == 13 && filename.substr(8, 5) == ".cdat")))
         {
             if (it->path().filename().string().substr(0, 3) == "blk") {
-                mapBlockFiles[it->path().filename().string().substr(3, 5)] = it->path();
+                mapBlockFiles.emplace(it->path().filename().string().substr(3, 5), it->path());
             } else if (it->path().filename().string().substr(0, 3) == "rev") {
                 remove(it->path());
             }
@@ -85,6 +420,10 @@ void CleanupBlockRevFiles()
     // start removing block files.
     int nContigCounter = 0;
     for (const std::pair<const std::string, fs::path>& item : mapBlockFiles) {
+        if (atoi(item.first) == nContigCounter - 1) {
+            // The original and the compressed copy of the same file
+            continue;
+        }
         if (atoi(item.first) == nContigCounter) {
             nContigCounter++;
             continue;
@@ -141,6 +480,26 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex)
         return error("%s: no undo data available", __func__);
     }
 
+    g_block_writes.WaitFor({true, pos.nFile, pos.nPos});
+
+    Span<const unsigned char> record;
+    std::vector<unsigned char> buf;
+    const auto mapped = MapRecord(true, pos, sizeof(uint256), record);
+    if (mapped || ReadCompressedRecord(true, pos, sizeof(uint256), buf, record)) {
+        CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+        hasher << pindex->pprev->GetBlockHash();
+        hasher.write(reinterpret_cast<const char*>(record.data()), record.size());
+        if (memcmp(hasher.GetHash().begin(), record.end(), sizeof(uint256)) != 0) {
+            return error("%s: Checksum mismatch", __func__);
+        }
+        try {
+            SpanReader{SER_DISK, CLIENT_VERSION, record} >> blockundo;
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+        return true;
+    }
+
     // Open history file to read
     CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull()) {
@@ -169,18 +528,24 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex)
 static void FlushUndoFile(int block_file, bool finalize = false)
 {
     FlatFilePos undo_pos_old(block_file, vinfoBlockFile[block_file].nUndoSize);
-    if (!UndoFileSeq().Flush(undo_pos_old, finalize)) {
-        AbortNode("Flushing undo file to disk failed. This is likely the result of an I/O error.");
-    }
+    g_block_writes.Enqueue([undo_pos_old, finalize] {
+        if (!UndoFileSeq().Flush(undo_pos_old, finalize)) {
+            return AbortNode("Flushing undo file to disk failed. This is likely the result of an I/O error.");
+        }
+        return true;
+    }, 0);
 }
 
 void FlushBlockFile(bool fFinalize = false, bool finalize_undo = false)
 {
     LOCK(cs_LastBlockFile);
     FlatFilePos block_pos_old(nLastBlockFile, vinfoBlockFile[nLastBlockFile].nSize);
-    if (!BlockFileSeq().Flush(block_pos_old, fFinalize)) {
-        AbortNode("Flushing block file to disk failed. This is likely the result of an I/O error.");
-    }
+    g_block_writes.Enqueue([block_pos_old, fFinalize] {
+        if (!BlockFileSeq().Flush(block_pos_old, fFinalize)) {
+            return AbortNode("Flushing block file to disk failed. This is likely the result of an I/O error.");
+        }
+        return true;
+    }, 0);
     // we do not always flush the undo file, as the chain tip may be lagging behind the incoming blocks,
     // e.g. during IBD or a sync after a node going offline
     if (!fFinalize || finalize_undo) FlushUndoFile(nLastBlockFile, finalize_undo);
@@ -199,10 +564,14 @@ uint64_t CalculateCurrentUsage()
 
 void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
 {
+    g_block_writes.Wait();
+    DropOpenFiles();
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         FlatFilePos pos(*it, 0);
         fs::remove(BlockFileSeq().FileName(pos));
         fs::remove(UndoFileSeq().FileName(pos));
+        fs::remove(BlockFileSeq().CompressedFileName(pos));
+        fs::remove(UndoFileSeq().CompressedFileName(pos));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
     }
 }
@@ -294,6 +663,12 @@ static bool FindUndoPos(BlockValidationState& state, int nFile, FlatFilePos& pos
 
     LOCK(cs_LastBlockFile);
 
+    // Undo data may be added to an old block file after a reorg, after its
+    // undo file has been compressed.
+    if (!RestoreCompressedFile(UndoFileSeq(), nFile)) {
+        return AbortNode(state, "Failed to restore compressed undo file");
+    }
+
     pos.nPos = vinfoBlockFile[nFile].nUndoSize;
     vinfoBlockFile[nFile].nUndoSize += nAddSize;
     setDirtyFileInfo.insert(nFile);
@@ -333,16 +708,29 @@ static bool WriteBlockToDisk(const CBlock& block, FlatFilePos& pos, const CMessa
     return true;
 }
 
-bool WriteUndoDataForBlock(const CBlockUndo& blockundo, BlockValidationState& state, CBlockIndex* pindex, const CChainParams& chainparams)
+bool WriteUndoDataForBlock(CBlockUndo&& blockundo, BlockValidationState& state, CBlockIndex* pindex, const CChainParams& chainparams)
 {
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull()) {
         FlatFilePos _pos;
-        if (!FindUndoPos(state, pindex->nFile, _pos, ::GetSerializeSize(blockundo, CLIENT_VERSION) + 40)) {
+        const unsigned int undo_size = ::GetSerializeSize(blockundo, CLIENT_VERSION);
+        if (!FindUndoPos(state, pindex->nFile, _pos, undo_size + STORAGE_HEADER_BYTES + 32)) {
             return error("ConnectBlock(): FindUndoPos failed");
         }
-        if (!UndoWriteToDisk(blockundo, _pos, pindex->pprev->GetBlockHash(), chainparams.MessageStart())) {
-            return AbortNode(state, "Failed to write undo data");
+        const FlatFilePos header_pos = _pos;
+        _pos.nPos += STORAGE_HEADER_BYTES;
+        CMessageHeader::MessageStartChars message_start;
+        memcpy(message_start, chainparams.MessageStart(), sizeof(message_start));
+        auto pundo = std::make_shared<const CBlockUndo>(std::move(blockundo));
+        const bool written = g_block_writes.Enqueue([pundo, header_pos, undo_pos = _pos, hash_prev = pindex->pprev->GetBlockHash(), message_start] {
+            FlatFilePos pos = header_pos;
+            if (!UndoWriteToDisk(*pundo, pos, hash_prev, message_start) || pos != undo_pos) {
+                return AbortNode("Failed to write undo data");
+            }
+            return true;
+        }, undo_size, BlockWriteQueue::Key{true, _pos.nFile, _pos.nPos});
+        if (!written) {
+            return state.Error("Failed to write undo data");
         }
         // rev files are written in block height order, whereas blk files are written as blocks come in (often out of order)
         // we want to flush the rev (undo) file once we've written the last block, which is indicated by the last height
@@ -366,17 +754,31 @@ bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::P
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
-    }
+    g_block_writes.WaitFor({false, pos.nFile, pos.nPos});
+
+    Span<const unsigned char> record;
+    std::vector<unsigned char> buf;
+    const auto mapped = MapRecord(false, pos, 0, record);
+    if (mapped || ReadCompressedRecord(false, pos, 0, buf, record)) {
+        // Deserialize directly from the mapping or the decompressed record
+        try {
+            SpanReader{SER_DISK, CLIENT_VERSION, record} >> block;
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull()) {
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+        }
 
-    // Read block
-    try {
-        filein >> block;
-    } catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        // Read block
+        try {
+            filein >> block;
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     // Check the header
@@ -412,6 +814,25 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
 
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const FlatFilePos& pos, const CMessageHeader::MessageStartChars& message_start)
 {
+    g_block_writes.WaitFor({false, pos.nFile, pos.nPos});
+
+    Span<const unsigned char> record;
+    std::vector<unsigned char> buf;
+    const auto mapped = MapRecord(false, pos, 0, record);
+    if (mapped || ReadCompressedRecord(false, pos, 0, buf, record)) {
+        if (memcmp(record.data() - STORAGE_HEADER_BYTES, message_start, CMessageHeader::MESSAGE_START_SIZE)) {
+            return error("%s: Block magic mismatch for %s: %s versus expected %s", __func__, pos.ToString(),
+                         HexStr(Span<const unsigned char>(record.data() - STORAGE_HEADER_BYTES, CMessageHeader::MESSAGE_START_SIZE)),
+                         HexStr(message_start));
+        }
+        if (record.size() > MAX_SIZE) {
+            return error("%s: Block data is larger than maximum deserialization size for %s: %s versus %s", __func__, pos.ToString(),
+                         record.size(), MAX_SIZE);
+        }
+        block.assign(record.begin(), record.end());
+        return true;
+    }
+
     FlatFilePos hpos = pos;
     hpos.nPos -= 8; // Seek back 8 bytes for meta header
     CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
@@ -445,6 +866,21 @@ bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const FlatFilePos& pos, c
     return true;
 }
 
+std::shared_ptr<const void> MapRawBlockFromDisk(Span<const uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start)
+{
+    const FlatFilePos pos{WITH_LOCK(cs_main, return pindex->GetBlockPos())};
+    g_block_writes.WaitFor({false, pos.nFile, pos.nPos});
+
+    Span<const unsigned char> record;
+    std::shared_ptr<const MappedFlatFile> mapped = MapRecord(false, pos, 0, record);
+    // Let ReadRawBlockFromDisk report a bad record
+    if (!mapped || memcmp(record.data() - STORAGE_HEADER_BYTES, message_start, CMessageHeader::MESSAGE_START_SIZE) || record.size() > MAX_SIZE) {
+        return nullptr;
+    }
+    block = record;
+    return mapped;
+}
+
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start)
 {
     FlatFilePos block_pos;
@@ -456,6 +892,119 @@ bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex
     return ReadRawBlockFromDisk(block, block_pos, message_start);
 }
 
+static ThreadPool g_block_prefetch_pool{"blkread"};
+static std::atomic<int> g_block_prefetch_lookahead{0};
+
+void StartBlockPrefetchThreads(int threads_num, int lookahead)
+{
+    g_block_prefetch_lookahead = lookahead;
+    g_block_prefetch_pool.Start(threads_num);
+}
+
+void StopBlockPrefetchThreads()
+{
+    g_block_prefetch_pool.Stop();
+    g_block_prefetch_lookahead = 0;
+}
+
+void BlockPrefetcher::Prefetch(const std::vector<const CBlockIndex*>& upcoming, const Consensus::Params& consensus_params)
+{
+    AssertLockHeld(cs_main);
+    if (!g_block_prefetch_pool.IsRunning()) return;
+
+    const size_t lookahead = std::min<size_t>(upcoming.size(), g_block_prefetch_lookahead);
+    LOCK(m_mutex);
+    // Drop reads for blocks which are no longer within the lookahead window.
+    for (auto it = m_pending.begin(); it != m_pending.end();) {
+        const bool wanted = std::any_of(upcoming.begin(), upcoming.begin() + lookahead,
+                                        [&](const CBlockIndex* pindex) { return pindex->GetBlockHash() == it->first; });
+        it = wanted ? std::next(it) : m_pending.erase(it);
+    }
+    for (size_t i = 0; i < lookahead; ++i) {
+        const CBlockIndex* pindex = upcoming[i];
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || m_pending.count(pindex->GetBlockHash())) continue;
+        // Capture the position and hash now, as the workers do not hold cs_main.
+        m_pending.emplace(pindex->GetBlockHash(), g_block_prefetch_pool.Submit(
+            [pos = pindex->GetBlockPos(), hash = pindex->GetBlockHash(), &consensus_params]() -> std::shared_ptr<const CBlock> {
+                auto pblock = std::make_shared<CBlock>();
+                if (!ReadBlockFromDisk(*pblock, pos, consensus_params) || pblock->GetHash() != hash) {
+                    return nullptr;
+                }
+                return pblock;
+            }));
+    }
+}
+
+std::shared_ptr<const CBlock> BlockPrefetcher::Take(const CBlockIndex* pindex)
+{
+    std::future<std::shared_ptr<const CBlock>> pending;
+    {
+        LOCK(m_mutex);
+        auto it = m_pending.find(pindex->GetBlockHash());
+        if (it == m_pending.end()) return nullptr;
+        pending = std::move(it->second);
+        m_pending.erase(it);
+    }
+    try {
+        return pending.get();
+    } catch (const std::future_error&) {
+        // The read was discarded because the prefetch threads were stopped.
+        return nullptr;
+    }
+}
+
+void BlockPrefetcher::Clear()
+{
+    LOCK(m_mutex);
+    m_pending.clear();
+}
+
+size_t BlockPrefetcher::PendingCount() const
+{
+    LOCK(m_mutex);
+    return m_pending.size();
+}
+
+bool ReadBlocksWithUndo(const std::vector<CBlockIndex*>& vpindex, const Consensus::Params& consensus_params, std::vector<std::pair<std::shared_ptr<CBlock>, CBlockUndo>>& out)
+{
+    using BlockWithUndo = std::optional<std::pair<std::shared_ptr<CBlock>, CBlockUndo>>;
+    AssertLockHeld(cs_main);
+    // The block positions are looked up here, as the workers do not hold cs_main.
+    const auto read = [&consensus_params](const CBlockIndex* pindex, const FlatFilePos& pos) -> BlockWithUndo {
+        auto pblock = std::make_shared<CBlock>();
+        CBlockUndo blockundo;
+        if (!ReadBlockFromDisk(*pblock, pos, consensus_params) || pblock->GetHash() != pindex->GetBlockHash() ||
+            !UndoReadFromDisk(blockundo, pindex)) {
+            return std::nullopt;
+        }
+        return std::make_pair(std::move(pblock), std::move(blockundo));
+    };
+
+    std::vector<std::future<BlockWithUndo>> reads;
+    if (g_block_prefetch_pool.IsRunning()) {
+        reads.reserve(vpindex.size());
+        for (const CBlockIndex* pindex : vpindex) {
+            reads.push_back(g_block_prefetch_pool.Submit([&read, pindex, pos = pindex->GetBlockPos()] { return read(pindex, pos); }));
+        }
+    }
+    out.clear();
+    out.reserve(vpindex.size());
+    bool ret = true;
+    for (size_t i = 0; i < vpindex.size(); ++i) {
+        BlockWithUndo result;
+        try {
+            if (!reads.empty()) result = reads[i].get();
+        } catch (const std::future_error&) {
+            // The read was discarded because the prefetch threads were stopped.
+        }
+        if (!result && ret) result = read(vpindex[i], vpindex[i]->GetBlockPos());
+        // Keep waiting for the remaining reads, which refer to read.
+        if (!result) ret = false;
+        if (ret) out.push_back(std::move(*result));
+    }
+    return ret;
+}
+
 /** Store block on disk. If dbp is non-nullptr, the file is known to already reside on disk */
 FlatFilePos SaveBlockToDisk(const CBlock& block, int nHeight, CChain& active_chain, const CChainParams& chainparams, const FlatFilePos* dbp)
 {
@@ -464,19 +1013,118 @@ FlatFilePos SaveBlockToDisk(const CBlock& block, int nHeight, CChain& active_cha
     if (dbp != nullptr) {
         blockPos = *dbp;
     }
-    if (!FindBlockPos(blockPos, nBlockSize + 8, nHeight, active_chain, block.GetBlockTime(), dbp != nullptr)) {
+    if (!FindBlockPos(blockPos, nBlockSize + STORAGE_HEADER_BYTES, nHeight, active_chain, block.GetBlockTime(), dbp != nullptr)) {
         error("%s: FindBlockPos failed", __func__);
         return FlatFilePos();
     }
     if (dbp == nullptr) {
-        if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart())) {
-            AbortNode("Failed to write block");
+        const FlatFilePos header_pos = blockPos;
+        blockPos.nPos += STORAGE_HEADER_BYTES;
+        CMessageHeader::MessageStartChars message_start;
+        memcpy(message_start, chainparams.MessageStart(), sizeof(message_start));
+        // Copying the block only copies references to its transactions.
+        auto pblock = std::make_shared<const CBlock>(block);
+        const bool written = g_block_writes.Enqueue([pblock, header_pos, block_pos = blockPos, message_start] {
+            FlatFilePos pos = header_pos;
+            if (!WriteBlockToDisk(*pblock, pos, message_start) || pos != block_pos) {
+                return AbortNode("Failed to write block");
+            }
+            return true;
+        }, nBlockSize, BlockWriteQueue::Key{false, blockPos.nFile, blockPos.nPos});
+        if (!written) {
             return FlatFilePos();
         }
     }
     return blockPos;
 }
 
+static Mutex g_compress_mutex;
+static std::condition_variable g_compress_cv;
+static bool g_compress_stop GUARDED_BY(g_compress_mutex){false};
+static std::thread g_compress_thread;
+
+/**
+ * Compress the first size bytes of a block or undo file, or remove the
+ * original of a file compressed in an earlier pass. Returns whether a
+ * compressed copy was created.
+ */
+static bool CompressBlockFile(bool undo, int file, uint64_t size)
+{
+    const FlatFileSeq seq{undo ? UndoFileSeq() : BlockFileSeq()};
+    const FlatFilePos pos{file, 0};
+    const fs::path path{seq.FileName(pos)};
+    const fs::path compressed_path{seq.CompressedFileName(pos)};
+    if (size == 0 || !fs::exists(path)) return false;
+
+    if (fs::exists(compressed_path)) {
+        // Readers switched to the compressed copy in the previous pass.
+        WITH_LOCK(cs_LastBlockFile, if (fs::exists(compressed_path)) fs::remove(path));
+        DropOpenFiles();
+        return false;
+    }
+
+    if (!WaitForBlockWrites()) return false;
+    fs::path tmp_path{compressed_path};
+    tmp_path += ".tmp";
+    if (!CompressedFlatFile::Write(path, size, tmp_path)) {
+        fs::remove(tmp_path);
+        return false;
+    }
+    LOCK(cs_LastBlockFile);
+    // Data was added to the file, or the file was pruned, in the meantime.
+    const CBlockFileInfo& info = vinfoBlockFile[file];
+    if ((undo ? info.nUndoSize : info.nSize) != size || !RenameOver(tmp_path, compressed_path)) {
+        fs::remove(tmp_path);
+        return false;
+    }
+    LogPrint(BCLog::VALIDATION, "Compressed %s from %u to %u bytes\n", path.filename().string(), size, fs::file_size(compressed_path));
+    return true;
+}
+
+size_t CompressColdBlockFiles(ChainstateManager& chainman)
+{
+    if (fImporting || fReindex) return 0;
+    const int tip_height = WITH_LOCK(cs_main, return chainman.ActiveChain().Height());
+    size_t compressed = 0;
+    for (int file = 0; !ShutdownRequested() && !WITH_LOCK(g_compress_mutex, return g_compress_stop); ++file) {
+        CBlockFileInfo info;
+        {
+            LOCK(cs_LastBlockFile);
+            // Leave the files that blocks are written to, and the one before, alone.
+            if (file + 1 >= nLastBlockFile) break;
+            info = vinfoBlockFile[file];
+        }
+        // Skip pruned files, and those with blocks that may still be reorganized
+        if (info.nSize == 0 || int64_t{info.nHeightLast} + MIN_BLOCKS_TO_KEEP > tip_height) continue;
+        compressed += CompressBlockFile(/*undo=*/false, file, info.nSize);
+        compressed += CompressBlockFile(/*undo=*/true, file, info.nUndoSize);
+    }
+    return compressed;
+}
+
+void StartBlockFileCompression(ChainstateManager& chainman)
+{
+    assert(!g_compress_thread.joinable());
+    WITH_LOCK(g_compress_mutex, g_compress_stop = false);
+    g_compress_thread = std::thread(&util::TraceThread, "blkcompress", [&chainman] {
+        while (true) {
+            const size_t compressed = CompressColdBlockFiles(chainman);
+            if (compressed > 0) LogPrintf("Compressed %u block and undo files\n", compressed);
+            WAIT_LOCK(g_compress_mutex, lock);
+            if (g_compress_cv.wait_for(lock, BLOCKFILE_COMPRESS_INTERVAL, []() EXCLUSIVE_LOCKS_REQUIRED(g_compress_mutex) { return g_compress_stop; })) {
+                return;
+            }
+        }
+    });
+}
+
+void StopBlockFileCompression()
+{
+    WITH_LOCK(g_compress_mutex, g_compress_stop = true);
+    g_compress_cv.notify_all();
+    if (g_compress_thread.joinable()) g_compress_thread.join();
+}
+
 struct CImportingNow {
     CImportingNow()
     {
@@ -500,24 +1148,58 @@ void ThreadImport(ChainstateManager& chainman, std::vector<fs::path> vImportFile
 
         // -reindex
         if (fReindex) {
-            int nFile = 0;
-            while (true) {
-                FlatFilePos pos(nFile, 0);
-                if (!fs::exists(GetBlockPosFilename(pos))) {
-                    break; // No block files left to reindex
+            // Block files are read, deserialized and checked in parallel, up
+            // to REINDEX_SCAN_AHEAD_FILES files ahead of the one being indexed.
+            ThreadPool pool{"reindex"};
+            const int threads_num = std::min(GetNumCores(), REINDEX_SCAN_AHEAD_FILES + 1);
+            if (threads_num > 1) pool.Start(threads_num);
+            using ScannedBlocks = std::optional<std::vector<std::pair<std::shared_ptr<CBlock>, FlatFilePos>>>;
+            std::deque<std::pair<int, std::future<ScannedBlocks>>> scans;
+            int nNextFile = 0;
+            bool files_left = true;
+            const auto scan_next = [&] {
+                const int nFile = nNextFile;
+                if (!WITH_LOCK(cs_LastBlockFile, return RestoreCompressedFile(BlockFileSeq(), nFile))) {
+                    return false; // This error is logged in RestoreCompressedFile
+                }
+                if (!fs::exists(GetBlockPosFilename(FlatFilePos(nFile, 0)))) {
+                    return false; // No block files left to reindex
                 }
-                FILE* file = OpenBlockFile(pos, true);
-                if (!file) {
-                    break; // This error is logged in OpenBlockFile
+                auto scan = [nFile]() -> ScannedBlocks {
+                    FILE* file = OpenBlockFile(FlatFilePos(nFile, 0), true);
+                    if (!file) {
+                        return std::nullopt; // This error is logged in OpenBlockFile
+                    }
+                    return ScanBlockFile(file, nFile, Params());
+                };
+                if (pool.IsRunning()) {
+                    scans.emplace_back(nFile, pool.Submit(std::move(scan)));
+                } else {
+                    std::promise<ScannedBlocks> result;
+                    result.set_value(scan());
+                    scans.emplace_back(nFile, result.get_future());
+                }
+                ++nNextFile;
+                return true;
+            };
+            while (true) {
+                while (files_left && scans.size() < size_t(std::max(threads_num, 1))) {
+                    files_left = scan_next();
                 }
+                if (scans.empty()) break;
+                auto [nFile, scan] = std::move(scans.front());
+                scans.pop_front();
+                ScannedBlocks blocks = scan.get();
+                if (!blocks) break;
                 LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-                chainman.ActiveChainstate().LoadExternalBlockFile(file, &pos);
+                chainman.ActiveChainstate().LoadScannedBlockFile(*blocks);
                 if (ShutdownRequested()) {
                     LogPrintf("Shutdown requested. Exit %s\n", __func__);
+                    pool.Stop();
                     return;
                 }
-                nFile++;
             }
+            pool.Stop();
             pblocktree->WriteReindexing(false);
             fReindex = false;
             LogPrintf("Reindexing finished\n");
@@ -7,9 +7,16 @@
 
 #include <fs.h>
 #include <protocol.h> // For CMessageHeader::MessageStartChars
+#include <span.h>
+#include <sync.h>
+#include <uint256.h>
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
 #include <vector>
 
 class ArgsManager;
@@ -26,7 +33,36 @@ namespace Consensus {
 struct Params;
 }
 
+extern RecursiveMutex cs_main;
+
 static constexpr bool DEFAULT_STOPAFTERBLOCKIMPORT{false};
+/** Default for -blockprefetch, the number of blocks read ahead of ConnectTip */
+static constexpr int DEFAULT_BLOCK_PREFETCH{16};
+/** Maximum value for -blockprefetch */
+static constexpr int MAX_BLOCK_PREFETCH{128};
+/** Number of threads reading and deserializing prefetched blocks */
+static constexpr int BLOCK_PREFETCH_THREADS{2};
+/**
+ * Number of block files read and checked ahead of the one being indexed for
+ * -reindex, each on its own thread. Deserialized blocks take about twice
+ * their size on disk, so this and the file being indexed hold up to about
+ * 3 * 2 * MAX_BLOCKFILE_SIZE (768 MiB) of blocks.
+ */
+static constexpr int REINDEX_SCAN_AHEAD_FILES{2};
+/** Default for -blockwritebehind, writing block and undo data on a separate thread */
+static constexpr bool DEFAULT_BLOCK_WRITE_BEHIND{true};
+/** Amount of block and undo data that may be waiting for the block write thread */
+static constexpr size_t MAX_BLOCK_WRITE_QUEUE_BYTES{64 << 20};
+/** Default for -mapblockfiles. Only on 64-bit platforms, as each mapping may take up MAX_BLOCKFILE_SIZE of address space */
+static constexpr bool DEFAULT_MAP_BLOCK_FILES{sizeof(void*) >= 8};
+/** Maximum number of block and undo files kept mapped into memory */
+static constexpr size_t MAX_MAPPED_BLOCK_FILES{64};
+/** Maximum number of compressed block and undo files kept open for reading */
+static constexpr size_t MAX_OPEN_COMPRESSED_FILES{8};
+/** Default for -compressblockfiles */
+static constexpr bool DEFAULT_COMPRESS_BLOCK_FILES{false};
+/** Time between passes of the block file compression thread */
+static constexpr std::chrono::minutes BLOCKFILE_COMPRESS_INTERVAL{10};
 
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
@@ -37,6 +73,8 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
+/** Whether blocks and undo data in files that are no longer appended to are read through memory mappings */
+extern std::atomic_bool g_map_block_files;
 /** Pruning-related variables and constants */
 /** True if any block files have ever been pruned. */
 extern bool fHavePruned;
@@ -52,6 +90,8 @@ void CleanupBlockRevFiles();
 
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const FlatFilePos& pos, bool fReadOnly = false);
+/** Whether a block file has been compressed (see -compressblockfiles), in which case OpenBlockFile may fail */
+bool IsBlockFileCompressed(int file);
 /** Translation to a filesystem path */
 fs::path GetBlockPosFilename(const FlatFilePos& pos);
 
@@ -71,12 +111,93 @@ bool ReadBlockFromDisk(CBlock& block, const FlatFilePos& pos, const Consensus::P
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const FlatFilePos& pos, const CMessageHeader::MessageStartChars& message_start);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
+/**
+ * Reference the serialized block in its memory mapped block file, without
+ * copying it. The returned owner keeps block valid. Returns nullptr if the
+ * block file is not mapped (see -mapblockfiles), in which case the block
+ * should be read with ReadRawBlockFromDisk.
+ */
+std::shared_ptr<const void> MapRawBlockFromDisk(Span<const uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
-bool WriteUndoDataForBlock(const CBlockUndo& blockundo, BlockValidationState& state, CBlockIndex* pindex, const CChainParams& chainparams);
+bool WriteUndoDataForBlock(CBlockUndo&& blockundo, BlockValidationState& state, CBlockIndex* pindex, const CChainParams& chainparams);
 
 FlatFilePos SaveBlockToDisk(const CBlock& block, int nHeight, CChain& active_chain, const CChainParams& chainparams, const FlatFilePos* dbp);
 
+/** Start the block write thread, after which block and undo data is written in the background. */
+void StartBlockWriteThread();
+/** Write all queued block and undo data, then stop the block write thread. */
+void StopBlockWriteThread();
+/**
+ * Wait until all block and undo data queued so far, and the file flushes
+ * queued after it, are done. Returns false if writing in the background
+ * failed, in which case the node is already shutting down.
+ */
+bool WaitForBlockWrites();
+
+/**
+ * Bounded lookahead of blocks about to be connected to the active chain.
+ *
+ * While ConnectTip validates one block, the next few blocks on the path to
+ * the most-work chain are read from disk and deserialized on the block
+ * prefetch threads, so that connecting does not stall on disk reads during
+ * IBD and reindex. All methods are no-ops while the prefetch threads are not
+ * running (see StartBlockPrefetchThreads).
+ */
+class BlockPrefetcher
+{
+private:
+    mutable Mutex m_mutex;
+    //! In-flight and completed reads, keyed by block hash. A null result means the read failed.
+    std::map<uint256, std::future<std::shared_ptr<const CBlock>>> m_pending GUARDED_BY(m_mutex);
+
+public:
+    /**
+     * Schedule reads for the first -blockprefetch entries of upcoming, which
+     * lists the blocks to be connected next in ascending height order. Reads
+     * for blocks that are no longer upcoming (e.g. after a reorg or an invalid
+     * block) are dropped.
+     */
+    void Prefetch(const std::vector<const CBlockIndex*>& upcoming, const Consensus::Params& consensus_params) EXCLUSIVE_LOCKS_REQUIRED(::cs_main);
+
+    /**
+     * Hand out the prefetched block for pindex, waiting for the read to
+     * complete if it is still in progress. Returns nullptr if the block was
+     * not scheduled or could not be read, in which case the caller should
+     * fall back to ReadBlockFromDisk.
+     */
+    std::shared_ptr<const CBlock> Take(const CBlockIndex* pindex);
+
+    //! Drop all scheduled reads.
+    void Clear();
+
+    //! Number of scheduled reads not yet taken.
+    size_t PendingCount() const;
+};
+
+/**
+ * Read the blocks and undo data of vpindex into out, in the same order, on the
+ * block prefetch threads when they are running. Used to disconnect several
+ * blocks at once. Returns false if any of them could not be read.
+ */
+bool ReadBlocksWithUndo(const std::vector<CBlockIndex*>& vpindex, const Consensus::Params& consensus_params, std::vector<std::pair<std::shared_ptr<CBlock>, CBlockUndo>>& out) EXCLUSIVE_LOCKS_REQUIRED(::cs_main);
+
+/** Start the block prefetch threads, reading up to lookahead blocks ahead of the tip. */
+void StartBlockPrefetchThreads(int threads_num, int lookahead);
+/** Stop the block prefetch threads. */
+void StopBlockPrefetchThreads();
+
+/**
+ * Compress the block and undo files whose blocks are all at least
+ * MIN_BLOCKS_TO_KEEP deep in the active chain. Originals compressed in an
+ * earlier pass are removed, so that no reader is still switching over.
+ * Returns the number of files compressed.
+ */
+size_t CompressColdBlockFiles(ChainstateManager& chainman);
+/** Start the thread compressing cold block and undo files every BLOCKFILE_COMPRESS_INTERVAL. */
+void StartBlockFileCompression(ChainstateManager& chainman);
+void StopBlockFileCompression();
+
 void ThreadImport(ChainstateManager& chainman, std::vector<fs::path> vImportFiles, const ArgsManager& args);
 
 #endif // BITCOIN_NODE_BLOCKSTORAGE_H
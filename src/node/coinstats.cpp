@@ -97,10 +97,12 @@ static bool GetUTXOStats(CCoinsView* view, BlockManager& blockman, CCoinsStats&
     if (!pindex) {
         {
             LOCK(cs_main);
-            pindex = blockman.LookupBlockIndex(view->GetBestBlock());
+            pindex = blockman.LookupBlockIndex(pcursor->GetBestBlock());
         }
+        // The cursor was opened while a coins flush was being written.
+        if (!pindex) return error("%s: coins database is being written to", __func__);
     }
-    stats.nHeight = Assert(pindex)->nHeight;
+    stats.nHeight = pindex->nHeight;
     stats.hashBlock = pindex->GetBlockHash();
 
     // Use CoinStatsIndex if it is requested and available and a hash_type of Muhash or None was requested
@@ -109,6 +111,13 @@ static bool GetUTXOStats(CCoinsView* view, BlockManager& blockman, CCoinsStats&
         return g_coin_stats_index->LookUpStats(pindex, stats);
     }
 
+    // The caller may have looked up pindex before another flush (possibly a
+    // background one, see -coinsbackgroundflush) started writing to the
+    // database, so make sure the cursor's snapshot is of that block.
+    if (pcursor->GetBestBlock() != pindex->GetBlockHash()) {
+        return error("%s: coins database is not at block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+
     PrepareHash(hash_obj, stats);
 
     uint256 prevkey;
@@ -0,0 +1 @@
+#define BUILD_GIT_COMMIT "376e281ccc46-dirty"
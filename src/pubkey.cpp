@@ -194,6 +194,24 @@ bool XOnlyPubKey::VerifySchnorr(const uint256& msg, Span<const unsigned char> si
     return secp256k1_schnorrsig_verify(secp256k1_context_verify, sigbytes.data(), msg.begin(), &pubkey);
 }
 
+void SchnorrSignatureBatch::Add(const XOnlyPubKey& pubkey, const uint256& msg, Span<const unsigned char> sigbytes)
+{
+    assert(sigbytes.size() == 64);
+    Entry& entry = m_entries.emplace_back();
+    entry.pubkey = pubkey;
+    entry.msg = msg;
+    std::copy(sigbytes.begin(), sigbytes.end(), entry.sig.begin());
+}
+
+bool SchnorrSignatureBatch::Verify(size_t begin, size_t end) const
+{
+    assert(begin <= end && end <= m_entries.size());
+    for (size_t i = begin; i < end; ++i) {
+        if (!m_entries[i].pubkey.VerifySchnorr(m_entries[i].msg, m_entries[i].sig)) return false;
+    }
+    return true;
+}
+
 static const CHashWriter HASHER_TAPTWEAK = TaggedHash("TapTweak");
 
 uint256 XOnlyPubKey::ComputeTapTweakHash(const uint256* merkle_root) const
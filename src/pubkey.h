@@ -12,6 +12,7 @@
 #include <span.h>
 #include <uint256.h>
 
+#include <array>
 #include <cstring>
 #include <optional>
 #include <vector>
@@ -279,6 +280,38 @@ public:
     bool operator<(const XOnlyPubKey& other) const { return m_keydata < other.m_keydata; }
 };
 
+/** A set of Schnorr signatures that are verified together.
+ *
+ * Signatures are collected with Add() and checked with Verify(), which only
+ * tells whether all of them are valid; to find an invalid one, verify smaller
+ * ranges. libsecp256k1 does not offer batch verification yet, so for now they
+ * are verified one after another; once it does, only Verify() has to change.
+ */
+class SchnorrSignatureBatch
+{
+private:
+    struct Entry {
+        XOnlyPubKey pubkey;
+        uint256 msg;
+        std::array<unsigned char, 64> sig;
+    };
+    std::vector<Entry> m_entries;
+
+public:
+    /** Add a signature to the batch. sigbytes must be exactly 64 bytes. */
+    void Add(const XOnlyPubKey& pubkey, const uint256& msg, Span<const unsigned char> sigbytes);
+
+    /** Verify the signatures at positions [begin, end). True if the range is empty. */
+    bool Verify(size_t begin, size_t end) const;
+
+    /** Verify all signatures added so far. True if the batch is empty. */
+    bool Verify() const { return Verify(0, m_entries.size()); }
+
+    size_t size() const { return m_entries.size(); }
+    bool empty() const { return m_entries.empty(); }
+    void clear() { m_entries.clear(); }
+};
+
 struct CExtPubKey {
     unsigned char nDepth;
     unsigned char vchFingerprint[4];
@@ -1161,6 +1161,8 @@ static RPCHelpMan gettxoutsetinfo()
     BlockManager* blockman;
     {
         LOCK(::cs_main);
+        // A background coins flush may start once cs_main is released, but
+        // GetUTXOStats checks that its cursor is of the block looked up here.
         coins_view = &active_chainstate.CoinsDB();
         blockman = &active_chainstate.m_blockman;
         pindex = blockman->LookupBlockIndex(coins_view->GetBestBlock());
@@ -2395,6 +2397,8 @@ static RPCHelpMan scantxoutset()
             ChainstateManager& chainman = EnsureChainman(node);
             LOCK(cs_main);
             CChainState& active_chainstate = chainman.ActiveChainstate();
+            // Flushing waits for any background coins flush, and none can
+            // start before the cursor's snapshot is taken.
             active_chainstate.ForceFlushStateToDisk();
             pcursor = active_chainstate.CoinsDB().Cursor();
             CHECK_NONFATAL(pcursor);
@@ -2576,6 +2580,7 @@ UniValue CreateUTXOSnapshot(NodeContext& node, CChainState& chainstate, CAutoFil
 
     {
         // We need to lock cs_main to ensure that the coinsdb isn't written to
+        // (including by a background coins flush, which the flush waits for)
         // between (i) flushing coins cache to disk (coinsdb), (ii) getting stats
         // based upon the coinsdb, and (iii) constructing a cursor to the
         // coinsdb for use below this block.
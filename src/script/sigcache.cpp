@@ -124,3 +124,27 @@ bool CachingTransactionSignatureChecker::VerifySchnorrSignature(Span<const unsig
     if (store) signatureCache.Set(entry);
     return true;
 }
+
+void DeferredSchnorrSignatures::Add(const XOnlyPubKey& pubkey, const uint256& sighash, Span<const unsigned char> sig, const uint256* cache_entry)
+{
+    m_batch.Add(pubkey, sighash, sig);
+    if (cache_entry) m_cache_entries.push_back(*cache_entry);
+}
+
+bool DeferredSchnorrSignatures::VerifyAndCache()
+{
+    if (!m_batch.Verify()) return false;
+    for (const uint256& entry : m_cache_entries) {
+        signatureCache.Set(entry);
+    }
+    return true;
+}
+
+bool BatchingTransactionSignatureChecker::VerifySchnorrSignature(Span<const unsigned char> sig, const XOnlyPubKey& pubkey, const uint256& sighash) const
+{
+    uint256 entry;
+    signatureCache.ComputeEntrySchnorr(entry, sighash, sig, pubkey);
+    if (signatureCache.Get(entry, !m_store)) return true;
+    m_deferred.Add(pubkey, sighash, sig, m_store ? &entry : nullptr);
+    return true;
+}
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_SIGCACHE_H
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
+#include <pubkey.h>
 #include <script/interpreter.h>
 #include <span.h>
 #include <util/hasher.h>
@@ -33,6 +34,55 @@ public:
     bool VerifySchnorrSignature(Span<const unsigned char> sig, const XOnlyPubKey& pubkey, const uint256& sighash) const override;
 };
 
+/**
+ * Schnorr signatures whose verification was deferred by
+ * BatchingTransactionSignatureChecker, together with the signature cache
+ * entries to add once they are known to be valid.
+ */
+class DeferredSchnorrSignatures
+{
+private:
+    SchnorrSignatureBatch m_batch;
+    //! Signature cache entries to add if the batch is valid
+    std::vector<uint256> m_cache_entries;
+
+public:
+    /** Defer a signature. If cache_entry is set, it is stored in the signature cache by VerifyAndCache(). */
+    void Add(const XOnlyPubKey& pubkey, const uint256& sighash, Span<const unsigned char> sig, const uint256* cache_entry);
+
+    /** Verify the signatures at positions [begin, end), without caching them. */
+    bool Verify(size_t begin, size_t end) const { return m_batch.Verify(begin, end); }
+
+    /** Verify all signatures, and add them to the signature cache if they are all valid. */
+    bool VerifyAndCache();
+
+    /** Number of signatures deferred so far. */
+    size_t size() const { return m_batch.size(); }
+};
+
+/**
+ * Signature checker that defers the Schnorr signatures that are not in the
+ * signature cache to a DeferredSchnorrSignatures, instead of verifying them
+ * right away.
+ *
+ * Every invalid non-empty Schnorr signature makes the script fail, so
+ * assuming them valid while evaluating the script cannot turn a failing
+ * script into a passing one. The script is only valid if the deferred
+ * signatures are valid too. ECDSA signatures may legitimately fail in a valid
+ * script and are verified immediately.
+ */
+class BatchingTransactionSignatureChecker : public CachingTransactionSignatureChecker
+{
+private:
+    bool m_store;
+    DeferredSchnorrSignatures& m_deferred;
+
+public:
+    BatchingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, bool storeIn, PrecomputedTransactionData& txdataIn, DeferredSchnorrSignatures& deferredIn) : CachingTransactionSignatureChecker(txToIn, nInIn, amountIn, storeIn, txdataIn), m_store(storeIn), m_deferred(deferredIn) {}
+
+    bool VerifySchnorrSignature(Span<const unsigned char> sig, const XOnlyPubKey& pubkey, const uint256& sighash) const override;
+};
+
 void InitSignatureCache();
 
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
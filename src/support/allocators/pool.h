@@ -0,0 +1,204 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Memory resource handing out small blocks carved from large chunks.
+ *
+ * Blocks of up to MAX_BLOCK_SIZE_BYTES are rounded up to a multiple of
+ * ALIGN_BYTES and taken from a free list per rounded size, or from the current
+ * chunk when that list is empty. Chunks start at MIN_CHUNK_SIZE_BYTES and
+ * double in size up to a maximum. Deallocated blocks go back onto their free
+ * list; chunks are only returned to the system when the resource is destroyed,
+ * which makes releasing a whole container a handful of frees instead of one
+ * per element. Larger or over-aligned requests are passed to ::operator new.
+ *
+ * This is meant for node based containers, which allocate many equally sized
+ * nodes, and is not thread safe.
+ */
+template <std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+class PoolResource
+{
+    static_assert(ALIGN_BYTES > 0 && (ALIGN_BYTES & (ALIGN_BYTES - 1)) == 0, "ALIGN_BYTES must be a power of two");
+    static_assert(ALIGN_BYTES >= sizeof(void*) && ALIGN_BYTES % alignof(void*) == 0, "free list nodes must fit in a block");
+    static_assert(MAX_BLOCK_SIZE_BYTES % ALIGN_BYTES == 0, "MAX_BLOCK_SIZE_BYTES must be a multiple of ALIGN_BYTES");
+
+    //! Free blocks store a pointer to the next free block of the same size.
+    struct ListNode {
+        ListNode* m_next;
+    };
+
+    const std::size_t m_max_chunk_size_bytes;
+    std::vector<void*> m_allocated_chunks;
+    std::size_t m_allocated_bytes{0};
+    //! Free list heads, indexed by block size in units of ALIGN_BYTES.
+    std::array<ListNode*, MAX_BLOCK_SIZE_BYTES / ALIGN_BYTES + 1> m_free_lists{};
+    //! Unused tail of the most recently allocated chunk.
+    std::byte* m_available_memory_it{nullptr};
+    std::byte* m_available_memory_end{nullptr};
+
+    static constexpr std::size_t NumAlignUnits(std::size_t bytes)
+    {
+        return bytes == 0 ? 1 : (bytes + ALIGN_BYTES - 1) / ALIGN_BYTES;
+    }
+
+    static constexpr bool IsPooled(std::size_t bytes, std::size_t alignment)
+    {
+        return bytes <= MAX_BLOCK_SIZE_BYTES && alignment <= ALIGN_BYTES;
+    }
+
+    static void PushFree(void* p, ListNode*& head)
+    {
+        head = ::new (p) ListNode{head};
+    }
+
+    void AllocateChunk()
+    {
+        // Keep the rest of the old chunk around as a free block; it is smaller
+        // than the request that did not fit, so it has a free list of its own.
+        if (m_available_memory_it != m_available_memory_end) {
+            const std::size_t remaining = m_available_memory_end - m_available_memory_it;
+            PushFree(m_available_memory_it, m_free_lists[remaining / ALIGN_BYTES]);
+        }
+        // Start small so that short-lived containers stay cheap, and double
+        // the chunk size up to the configured maximum as the pool grows.
+        const std::size_t chunk_bytes{std::min(m_max_chunk_size_bytes, MIN_CHUNK_SIZE_BYTES << std::min<std::size_t>(m_allocated_chunks.size(), 16))};
+        void* chunk = ::operator new(chunk_bytes, std::align_val_t{ALIGN_BYTES});
+        m_allocated_chunks.push_back(chunk);
+        m_allocated_bytes += chunk_bytes;
+        m_available_memory_it = static_cast<std::byte*>(chunk);
+        m_available_memory_end = m_available_memory_it + chunk_bytes;
+    }
+
+public:
+    //! Size of the first chunk; a multiple of any ALIGN_BYTES used in practice.
+    static constexpr std::size_t MIN_CHUNK_SIZE_BYTES{std::max<std::size_t>(16 << 10, MAX_BLOCK_SIZE_BYTES)};
+    static constexpr std::size_t DEFAULT_MAX_CHUNK_SIZE_BYTES{256 << 10};
+
+    explicit PoolResource(std::size_t max_chunk_size_bytes = DEFAULT_MAX_CHUNK_SIZE_BYTES)
+        : m_max_chunk_size_bytes{NumAlignUnits(std::max(max_chunk_size_bytes, MIN_CHUNK_SIZE_BYTES)) * ALIGN_BYTES}
+    {
+    }
+
+    PoolResource(const PoolResource&) = delete;
+    PoolResource& operator=(const PoolResource&) = delete;
+
+    ~PoolResource()
+    {
+        for (void* chunk : m_allocated_chunks) {
+            ::operator delete(chunk, std::align_val_t{ALIGN_BYTES});
+        }
+    }
+
+    void* Allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (!IsPooled(bytes, alignment)) {
+            return ::operator new(bytes, std::align_val_t{alignment});
+        }
+        const std::size_t units{NumAlignUnits(bytes)};
+        if (ListNode* node = m_free_lists[units]) {
+            m_free_lists[units] = node->m_next;
+            return node;
+        }
+        const std::size_t round_bytes{units * ALIGN_BYTES};
+        if (round_bytes > static_cast<std::size_t>(m_available_memory_end - m_available_memory_it)) {
+            AllocateChunk();
+        }
+        return std::exchange(m_available_memory_it, m_available_memory_it + round_bytes);
+    }
+
+    void Deallocate(void* p, std::size_t bytes, std::size_t alignment) noexcept
+    {
+        if (!IsPooled(bytes, alignment)) {
+            ::operator delete(p, std::align_val_t{alignment});
+            return;
+        }
+        PushFree(p, m_free_lists[NumAlignUnits(bytes)]);
+    }
+
+    std::size_t NumAllocatedChunks() const { return m_allocated_chunks.size(); }
+    //! Total size of all chunks, in use or not.
+    std::size_t AllocatedBytes() const { return m_allocated_bytes; }
+};
+
+/**
+ * Allocator drawing from a shared PoolResource.
+ *
+ * Copies and rebound copies of an allocator share its resource, which stays
+ * alive as long as any container allocating from it. A default constructed
+ * allocator creates a fresh resource.
+ */
+template <class T, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES = alignof(T)>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+    typedef PoolResource<MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> ResourceType;
+
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES> other;
+    };
+
+    PoolAllocator() : m_resource{std::make_shared<ResourceType>()} {}
+    explicit PoolAllocator(std::shared_ptr<ResourceType> resource) noexcept : m_resource{std::move(resource)} {}
+
+    // Moving an allocator must leave the source usable, so copy the resource pointer.
+    PoolAllocator(const PoolAllocator& other) noexcept = default;
+    PoolAllocator& operator=(const PoolAllocator& other) noexcept = default;
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& other) noexcept : m_resource{other.shared_resource()}
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+        return static_cast<T*>(m_resource->Allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        m_resource->Deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    ResourceType* resource() const noexcept { return m_resource.get(); }
+    const std::shared_ptr<ResourceType>& shared_resource() const noexcept { return m_resource; }
+
+private:
+    std::shared_ptr<ResourceType> m_resource;
+};
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator==(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a,
+                const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b) noexcept
+{
+    return a.resource() == b.resource();
+}
+
+template <class T1, class T2, std::size_t MAX_BLOCK_SIZE_BYTES, std::size_t ALIGN_BYTES>
+bool operator!=(const PoolAllocator<T1, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& a,
+                const PoolAllocator<T2, MAX_BLOCK_SIZE_BYTES, ALIGN_BYTES>& b) noexcept
+{
+    return !(a == b);
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
@@ -0,0 +1,234 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chain.h>
+#include <chainparams.h>
+#include <node/blockstorage.h>
+#include <primitives/block.h>
+#include <test/util/setup_common.h>
+#include <undo.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockstorage_tests, TestChain100Setup)
+
+BOOST_AUTO_TEST_CASE(block_prefetcher)
+{
+    const Consensus::Params& consensus_params = Params().GetConsensus();
+    const CChain& chain = m_node.chainman->ActiveChain();
+    BlockPrefetcher prefetcher;
+
+    auto upcoming = [&](int from, int to) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+        std::vector<const CBlockIndex*> ret;
+        for (int height = from; height < to; ++height) ret.push_back(chain[height]);
+        return ret;
+    };
+
+    // Without running prefetch threads nothing is scheduled.
+    WITH_LOCK(cs_main, prefetcher.Prefetch(upcoming(10, 20), consensus_params));
+    BOOST_CHECK_EQUAL(prefetcher.PendingCount(), 0U);
+
+    StartBlockPrefetchThreads(/*threads_num=*/2, /*lookahead=*/4);
+
+    // Only the lookahead window is scheduled.
+    WITH_LOCK(cs_main, prefetcher.Prefetch(upcoming(10, 20), consensus_params));
+    BOOST_CHECK_EQUAL(prefetcher.PendingCount(), 4U);
+
+    const CBlockIndex* pindex = WITH_LOCK(cs_main, return chain[10]);
+    std::shared_ptr<const CBlock> pblock = prefetcher.Take(pindex);
+    BOOST_REQUIRE(pblock);
+    BOOST_CHECK(pblock->GetHash() == pindex->GetBlockHash());
+    BOOST_CHECK_EQUAL(prefetcher.PendingCount(), 3U);
+
+    // A block outside the window was never scheduled.
+    BOOST_CHECK(!prefetcher.Take(WITH_LOCK(cs_main, return chain[15])));
+
+    // Moving the window drops reads which are no longer upcoming.
+    WITH_LOCK(cs_main, prefetcher.Prefetch(upcoming(12, 20), consensus_params));
+    BOOST_CHECK_EQUAL(prefetcher.PendingCount(), 4U);
+    BOOST_CHECK(!prefetcher.Take(WITH_LOCK(cs_main, return chain[11])));
+    for (int height = 12; height < 16; ++height) {
+        pindex = WITH_LOCK(cs_main, return chain[height]);
+        pblock = prefetcher.Take(pindex);
+        BOOST_REQUIRE(pblock);
+        BOOST_CHECK(pblock->GetHash() == pindex->GetBlockHash());
+    }
+    BOOST_CHECK_EQUAL(prefetcher.PendingCount(), 0U);
+
+    WITH_LOCK(cs_main, prefetcher.Prefetch(upcoming(50, 60), consensus_params));
+    prefetcher.Clear();
+    BOOST_CHECK_EQUAL(prefetcher.PendingCount(), 0U);
+
+    StopBlockPrefetchThreads();
+}
+
+BOOST_AUTO_TEST_CASE(block_index_pool)
+{
+    LOCK(cs_main);
+    BlockManager& blockman = m_node.chainman->m_blockman;
+    const auto* resource = blockman.m_block_index.get_allocator().resource();
+    BOOST_CHECK(resource->NumAllocatedChunks() > 0);
+
+    // Entries are constructed in the pool of the map nodes.
+    std::vector<CBlockIndex*> entries;
+    for (int i = 0; i < 10; ++i) {
+        const uint256 hash = InsecureRand256();
+        CBlockIndex* pindex = blockman.InsertBlockIndex(hash);
+        BOOST_REQUIRE(pindex);
+        BOOST_CHECK(pindex->GetBlockHash() == hash);
+        BOOST_CHECK(blockman.LookupBlockIndex(hash) == pindex);
+        BOOST_CHECK(blockman.InsertBlockIndex(hash) == pindex);
+        entries.push_back(pindex);
+    }
+    for (CBlockIndex* pindex : entries) {
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(pindex) % alignof(CBlockIndex), 0U);
+        BOOST_CHECK_EQUAL(pindex->nHeight, 0);
+        BOOST_CHECK(pindex->pprev == nullptr);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_write_behind)
+{
+    StartBlockWriteThread();
+
+    // Blocks written in the background can be read back right away.
+    for (int i = 0; i < 5; ++i) {
+        const CBlock block = CreateAndProcessBlock({}, CScript() << OP_TRUE);
+        const CBlockIndex* pindex = WITH_LOCK(cs_main, return m_node.chainman->m_blockman.LookupBlockIndex(block.GetHash()));
+        BOOST_REQUIRE(pindex);
+        CBlock read;
+        BOOST_CHECK(ReadBlockFromDisk(read, pindex, Params().GetConsensus()));
+        BOOST_CHECK(read.GetHash() == block.GetHash());
+        CBlockUndo blockundo;
+        BOOST_CHECK(WITH_LOCK(cs_main, return UndoReadFromDisk(blockundo, pindex)));
+        BOOST_CHECK_EQUAL(blockundo.vtxundo.size(), 0U);
+    }
+    BOOST_CHECK(WaitForBlockWrites());
+
+    StopBlockWriteThread();
+
+    // Without the thread, writes are synchronous again.
+    CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    BOOST_CHECK(WaitForBlockWrites());
+}
+
+BOOST_AUTO_TEST_CASE(mapped_block_files)
+{
+    const Consensus::Params& consensus_params = Params().GetConsensus();
+    const CChain& chain = m_node.chainman->ActiveChain();
+
+    // With small block files, the first file is full after a few hundred blocks.
+    gArgs.ForceSetArg("-fastprune", "1");
+    while (WITH_LOCK(cs_main, return chain.Tip()->GetBlockPos().nFile) == 0) {
+        CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    }
+    gArgs.ForceSetArg("-fastprune", "0");
+
+    // Blocks and undo data of the first file are read from the mapping, and
+    // match what is read with fread.
+    LOCK(cs_main);
+    for (int height = 1; height <= chain.Height(); height += 10) {
+        const CBlockIndex* pindex = chain[height];
+        CBlock block, block_fread;
+        std::vector<uint8_t> raw, raw_fread;
+        CBlockUndo blockundo, blockundo_fread;
+        g_map_block_files = true;
+        BOOST_CHECK(ReadBlockFromDisk(block, pindex, consensus_params));
+        BOOST_CHECK(ReadRawBlockFromDisk(raw, pindex, Params().MessageStart()));
+        BOOST_CHECK(UndoReadFromDisk(blockundo, pindex));
+        g_map_block_files = false;
+        BOOST_CHECK(ReadBlockFromDisk(block_fread, pindex, consensus_params));
+        BOOST_CHECK(ReadRawBlockFromDisk(raw_fread, pindex, Params().MessageStart()));
+        BOOST_CHECK(UndoReadFromDisk(blockundo_fread, pindex));
+        BOOST_CHECK(block.GetHash() == pindex->GetBlockHash());
+        BOOST_CHECK(block_fread.GetHash() == pindex->GetBlockHash());
+        BOOST_CHECK(raw == raw_fread);
+        BOOST_CHECK(SerializeHash(blockundo) == SerializeHash(blockundo_fread));
+
+        // Blocks can be referenced in the mapping without copying them.
+        Span<const uint8_t> mapped_raw;
+        BOOST_CHECK(!MapRawBlockFromDisk(mapped_raw, pindex, Params().MessageStart()));
+        g_map_block_files = true;
+        const auto mapped = MapRawBlockFromDisk(mapped_raw, pindex, Params().MessageStart());
+        BOOST_REQUIRE(mapped);
+        BOOST_CHECK(std::equal(mapped_raw.begin(), mapped_raw.end(), raw.begin(), raw.end()));
+    }
+    // The file blocks are appended to is not mapped.
+    Span<const uint8_t> mapped_raw;
+    BOOST_CHECK(!MapRawBlockFromDisk(mapped_raw, chain.Tip(), Params().MessageStart()));
+    g_map_block_files = DEFAULT_MAP_BLOCK_FILES;
+}
+
+BOOST_AUTO_TEST_CASE(compressed_block_files)
+{
+    const Consensus::Params& consensus_params = Params().GetConsensus();
+    const CChain& chain = m_node.chainman->ActiveChain();
+
+    // Fill a few small block files, and bury their blocks MIN_BLOCKS_TO_KEEP deep.
+    gArgs.ForceSetArg("-fastprune", "1");
+    while (WITH_LOCK(cs_main, return chain.Tip()->GetBlockPos().nFile) < 2) {
+        CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    }
+    const int first_file_height = WITH_LOCK(cs_main, return chain.Height());
+    for (int i = 0; i < MIN_BLOCKS_TO_KEEP; ++i) {
+        CreateAndProcessBlock({}, CScript() << OP_TRUE);
+    }
+    gArgs.ForceSetArg("-fastprune", "0");
+
+    const auto check_reads = [&] {
+        LOCK(cs_main);
+        for (int height = 1; height < first_file_height; height += 7) {
+            const CBlockIndex* pindex = chain[height];
+            if (pindex->GetBlockPos().nFile != 0) break;
+            CBlock block;
+            std::vector<uint8_t> raw;
+            CBlockUndo blockundo;
+            BOOST_CHECK(ReadBlockFromDisk(block, pindex, consensus_params));
+            BOOST_CHECK(block.GetHash() == pindex->GetBlockHash());
+            BOOST_CHECK(ReadRawBlockFromDisk(raw, pindex, Params().MessageStart()));
+            BOOST_CHECK(Hash(MakeSpan(raw).first(80)) == pindex->GetBlockHash());
+            BOOST_CHECK(UndoReadFromDisk(blockundo, pindex));
+        }
+    };
+
+    // The first pass compresses, the second removes the originals.
+    g_map_block_files = false;
+    const fs::path block_path{gArgs.GetBlocksDirPath() / "blk00000.dat"};
+    BOOST_CHECK(!IsBlockFileCompressed(0));
+    BOOST_CHECK_GE(CompressColdBlockFiles(*m_node.chainman), 2U);
+    BOOST_CHECK(IsBlockFileCompressed(0));
+    BOOST_CHECK(fs::exists(block_path));
+    check_reads();
+    BOOST_CHECK_EQUAL(CompressColdBlockFiles(*m_node.chainman), 0U);
+    BOOST_CHECK(!fs::exists(block_path));
+    BOOST_CHECK(!fs::exists(gArgs.GetBlocksDirPath() / "rev00000.dat"));
+    check_reads();
+    // The file blocks are written to is left alone.
+    const int last_file = WITH_LOCK(cs_main, return chain.Tip()->GetBlockPos().nFile);
+    BOOST_CHECK(!IsBlockFileCompressed(last_file));
+    g_map_block_files = DEFAULT_MAP_BLOCK_FILES;
+    check_reads();
+}
+
+BOOST_AUTO_TEST_CASE(scan_block_file)
+{
+    const CChain& chain = m_node.chainman->ActiveChain();
+    FILE* file = OpenBlockFile(FlatFilePos(0, 0), true);
+    BOOST_REQUIRE(file);
+    const auto blocks = ScanBlockFile(file, 0, Params());
+
+    // All blocks are found in file order, at their positions, and checked.
+    LOCK(cs_main);
+    BOOST_REQUIRE_EQUAL(blocks.size(), size_t(chain.Height() + 1));
+    for (size_t height = 0; height < blocks.size(); ++height) {
+        const auto& [block, pos] = blocks[height];
+        const CBlockIndex* pindex = chain[height];
+        BOOST_CHECK(block->GetHash() == pindex->GetBlockHash());
+        BOOST_CHECK(pos == pindex->GetBlockPos());
+        BOOST_CHECK(block->fChecked);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -220,11 +220,15 @@ BOOST_AUTO_TEST_CASE(test_CheckQueue_Catches_Failure)
                 vChecks.emplace_back(remaining == 1);
             control.Add(vChecks);
         }
-        bool success = control.Wait();
+        FailingCheck failed{false};
+        bool success = control.Wait(&failed);
         if (i > 0) {
             BOOST_REQUIRE(!success);
+            // The check that failed is handed back
+            BOOST_REQUIRE(failed.fails);
         } else if (i == 0) {
             BOOST_REQUIRE(success);
+            BOOST_REQUIRE(!failed.fails);
         }
     }
     fail_queue->StopWorkerThreads();
@@ -356,6 +360,30 @@ BOOST_AUTO_TEST_CASE(test_CheckQueue_FrozenCleanup)
 }
 
 
+/** Test that checks are all run whether there are no workers to give them to,
+ *  one, or many that have to steal from each other, and across restarts. */
+BOOST_AUTO_TEST_CASE(test_CheckQueue_Thread_Counts)
+{
+    auto queue = std::make_unique<Correct_Queue>(QUEUE_BATCH_SIZE);
+    for (const int threads : {0, 1, 16, SCRIPT_CHECK_THREADS}) {
+        queue->StartWorkerThreads(threads);
+        for (const size_t count : {1, 7, 5000}) {
+            FakeCheckCheckCompletion::n_calls = 0;
+            CCheckQueueControl<FakeCheckCheckCompletion> control(queue.get());
+            // One large batch, spread over all workers, then many small ones.
+            std::vector<FakeCheckCheckCompletion> vChecks(count);
+            control.Add(vChecks);
+            for (size_t i = 0; i < count; ++i) {
+                vChecks.resize(1);
+                control.Add(vChecks);
+            }
+            BOOST_REQUIRE(control.Wait());
+            BOOST_REQUIRE_EQUAL(FakeCheckCheckCompletion::n_calls, 2 * count);
+        }
+        queue->StopWorkerThreads();
+    }
+}
+
 /** Test that CCheckQueueControl is threadsafe */
 BOOST_AUTO_TEST_CASE(test_CheckQueueControl_Locks)
 {
@@ -217,7 +217,12 @@ void SimulationTest(CCoinsView* base, bool fake_best_block)
             if (stack.size() > 1 && InsecureRandBool() == 0) {
                 unsigned int flushIndex = InsecureRandRange(stack.size() - 1);
                 if (fake_best_block) stack[flushIndex]->SetBestBlock(InsecureRand256());
-                BOOST_CHECK(stack[flushIndex]->Flush());
+                if (InsecureRandBool()) {
+                    BOOST_CHECK(stack[flushIndex]->Flush());
+                } else {
+                    // Keep a random part of the cache.
+                    BOOST_CHECK(stack[flushIndex]->PartialFlush(InsecureRandRange(stack[flushIndex]->DynamicMemoryUsage() + 1)));
+                }
             }
         }
         if (InsecureRandRange(100) == 0) {
@@ -679,6 +684,41 @@ BOOST_AUTO_TEST_CASE(ccoins_access)
     CheckAccessCoin(VALUE1, VALUE2, VALUE2, DIRTY|FRESH, DIRTY|FRESH);
 }
 
+static void CheckEmplaceFetchedCoin(CAmount cache_value, CAmount fetched_value, CAmount expected_value, char cache_flags, char expected_flags)
+{
+    SingleEntryCacheTest test(ABSENT, cache_value, cache_flags);
+    Coin coin;
+    SetCoinsValue(fetched_value, coin);
+    BOOST_CHECK_EQUAL(test.cache.EmplaceFetchedCoin(OUTPOINT, std::move(coin)), cache_flags == NO_ENTRY);
+    test.cache.SelfTest();
+
+    CAmount result_value;
+    char result_flags;
+    GetCoinsMapEntry(test.cache.map(), result_value, result_flags);
+    BOOST_CHECK_EQUAL(result_value, expected_value);
+    BOOST_CHECK_EQUAL(result_flags, expected_flags);
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_emplace_fetched)
+{
+    /* Check EmplaceFetchedCoin behavior, inserting a coin looked up in the
+     * base view on another thread, and checking that an existing cache entry
+     * always wins over the fetched value.
+     *
+     *                       Cache   Fetched Result  Cache        Result
+     *                       Value   Value   Value   Flags        Flags
+     */
+    CheckEmplaceFetchedCoin(ABSENT, VALUE1, VALUE1, NO_ENTRY   , 0          );
+    CheckEmplaceFetchedCoin(SPENT , VALUE1, SPENT , 0          , 0          );
+    CheckEmplaceFetchedCoin(SPENT , VALUE1, SPENT , FRESH      , FRESH      );
+    CheckEmplaceFetchedCoin(SPENT , VALUE1, SPENT , DIRTY      , DIRTY      );
+    CheckEmplaceFetchedCoin(SPENT , VALUE1, SPENT , DIRTY|FRESH, DIRTY|FRESH);
+    CheckEmplaceFetchedCoin(VALUE2, VALUE1, VALUE2, 0          , 0          );
+    CheckEmplaceFetchedCoin(VALUE2, VALUE1, VALUE2, FRESH      , FRESH      );
+    CheckEmplaceFetchedCoin(VALUE2, VALUE1, VALUE2, DIRTY      , DIRTY      );
+    CheckEmplaceFetchedCoin(VALUE2, VALUE1, VALUE2, DIRTY|FRESH, DIRTY|FRESH);
+}
+
 static void CheckSpendCoins(CAmount base_value, CAmount cache_value, CAmount expected_value, char cache_flags, char expected_flags)
 {
     SingleEntryCacheTest test(base_value, cache_value, cache_flags);
@@ -878,4 +918,168 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+BOOST_AUTO_TEST_CASE(ccoins_partial_flush)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    auto make_coin = [](int height) {
+        Coin coin;
+        coin.nHeight = height;
+        coin.out.nValue = InsecureRandRange(1000) + 1;
+        coin.out.scriptPubKey.assign(uint32_t{56}, 1);
+        return coin;
+    };
+
+    // Coins added before the best block changes, of which two are used again afterwards.
+    std::vector<COutPoint> old_coins;
+    for (int i = 0; i < 8; ++i) {
+        old_coins.emplace_back(InsecureRand256(), i);
+        cache.AddCoin(old_coins.back(), make_coin(1), false);
+    }
+    cache.SetBestBlock(InsecureRand256());
+    std::vector<COutPoint> new_coins;
+    for (int i = 0; i < 12; ++i) {
+        new_coins.emplace_back(InsecureRand256(), i);
+        cache.AddCoin(new_coins.back(), make_coin(2), false);
+    }
+    cache.AccessCoin(old_coins[0]);
+    cache.AccessCoin(old_coins[1]);
+    BOOST_CHECK(cache.SpendCoin(new_coins[0]));
+    cache.SetBestBlock(InsecureRand256());
+
+    // Room for the coins used since the first best block change, but not for all of them.
+    BOOST_CHECK(cache.PartialFlush(cache.DynamicMemoryUsage() * 3 / 4));
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 13U);
+    for (const auto& [outpoint, entry] : cache.map()) {
+        BOOST_CHECK_EQUAL(entry.flags, 0);
+        BOOST_CHECK(!entry.coin.IsSpent());
+    }
+    BOOST_CHECK(cache.HaveCoinInCache(old_coins[0]));
+    BOOST_CHECK(cache.HaveCoinInCache(old_coins[1]));
+    for (size_t i = 2; i < old_coins.size(); ++i) {
+        BOOST_CHECK(!cache.HaveCoinInCache(old_coins[i]));
+    }
+    BOOST_CHECK(!cache.HaveCoinInCache(new_coins[0]));
+
+    // Everything was written, whether it was kept or not.
+    Coin coin;
+    for (const COutPoint& outpoint : old_coins) {
+        BOOST_CHECK(base.GetCoin(outpoint, coin));
+    }
+    for (size_t i = 1; i < new_coins.size(); ++i) {
+        BOOST_CHECK(base.GetCoin(new_coins[i], coin));
+    }
+    BOOST_CHECK(!base.GetCoin(new_coins[0], coin));
+    BOOST_CHECK_EQUAL(base.GetBestBlock(), cache.GetBestBlock());
+
+    // Kept coins are clean, so spending one of them must reach the base.
+    BOOST_CHECK(cache.SpendCoin(new_coins[1]));
+    BOOST_CHECK(cache.PartialFlush(0));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    BOOST_CHECK(!base.GetCoin(new_coins[1], coin) || coin.IsSpent());
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_sharded_flush)
+{
+    // Enough entries for BatchWrite to split the flush across the flush threads.
+    constexpr int num_coins{20000};
+    StartCoinsFlushThreads(/*threads_num=*/4);
+
+    CCoinsViewDB db{"test", /*nCacheSize*/ 1 << 23, /*fMemory*/ true, /*fWipe*/ false};
+    std::vector<COutPoint> outpoints;
+    {
+        CCoinsViewCache cache{&db};
+        for (int i = 0; i < num_coins; ++i) {
+            outpoints.emplace_back(InsecureRand256(), InsecureRandRange(4));
+            Coin coin;
+            coin.out.nValue = i + 1;
+            coin.nHeight = 1;
+            cache.AddCoin(outpoints.back(), std::move(coin), /*possible_overwrite=*/false);
+        }
+        cache.SetBestBlock(InsecureRand256());
+        BOOST_CHECK(cache.Flush());
+    }
+    for (int i = 0; i < num_coins; ++i) {
+        Coin coin;
+        BOOST_REQUIRE(db.GetCoin(outpoints[i], coin));
+        BOOST_CHECK_EQUAL(coin.out.nValue, i + 1);
+    }
+
+    // Spend every other coin and touch the rest, so that only spent entries are dirty.
+    const uint256 best_block{InsecureRand256()};
+    {
+        CCoinsViewCache cache{&db};
+        for (int i = 0; i < num_coins; ++i) {
+            if (i % 2) {
+                BOOST_CHECK(cache.SpendCoin(outpoints[i]));
+            } else {
+                BOOST_CHECK(cache.HaveCoin(outpoints[i]));
+            }
+        }
+        cache.SetBestBlock(best_block);
+        BOOST_CHECK(cache.Flush());
+    }
+    for (int i = 0; i < num_coins; ++i) {
+        BOOST_CHECK_EQUAL(db.HaveCoin(outpoints[i]), i % 2 == 0);
+    }
+    // The flush completed, so the database is consistent with the new tip.
+    BOOST_CHECK(db.GetBestBlock() == best_block);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+
+    StopCoinsFlushThreads();
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_background_flush)
+{
+    CCoinsViewDB db{"test", /*nCacheSize*/ 1 << 23, /*fMemory*/ true, /*fWipe*/ false};
+    CCoinsViewBackgroundFlush flushview{db};
+    CCoinsViewCache cache{&flushview};
+
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 100; ++i) {
+        outpoints.emplace_back(InsecureRand256(), 0);
+        Coin coin;
+        coin.out.nValue = i + 1;
+        coin.nHeight = 1;
+        cache.AddCoin(outpoints.back(), std::move(coin), /*possible_overwrite=*/false);
+    }
+    const uint256 first_block{InsecureRand256()};
+    cache.SetBestBlock(first_block);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!flushview.HasPendingWrite());
+
+    // Spend a coin and flush in the background.
+    flushview.SetBackground(true);
+    BOOST_CHECK(cache.SpendCoin(outpoints[0]));
+    const uint256 second_block{InsecureRand256()};
+    cache.SetBestBlock(second_block);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(flushview.HasPendingWrite());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+
+    // Lookups through the emptied cache see the flushed state, whether or not it is on disk yet.
+    BOOST_CHECK(cache.GetBestBlock() == second_block);
+    BOOST_CHECK(!cache.HaveCoin(outpoints[0]));
+    BOOST_CHECK_EQUAL(cache.AccessCoin(outpoints[1]).out.nValue, 2);
+    BOOST_CHECK_THROW(flushview.Cursor(), std::logic_error);
+
+    // A further flush waits for the pending one before writing.
+    BOOST_CHECK(cache.SpendCoin(outpoints[1]));
+    cache.SetBestBlock(first_block);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(flushview.Sync());
+    BOOST_CHECK(!flushview.HasPendingWrite());
+
+    BOOST_CHECK(db.GetBestBlock() == first_block);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    BOOST_CHECK(db.Cursor()->GetBestBlock() == first_block);
+    BOOST_CHECK(!db.HaveCoin(outpoints[0]));
+    BOOST_CHECK(!db.HaveCoin(outpoints[1]));
+    for (size_t i = 2; i < outpoints.size(); ++i) {
+        BOOST_CHECK(db.HaveCoin(outpoints[i]));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
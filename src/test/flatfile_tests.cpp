@@ -6,6 +6,7 @@
 #include <flatfile.h>
 #include <streams.h>
 #include <test/util/setup_common.h>
+#include <util/lzcompress.h>
 #include <util/system.h>
 
 #include <boost/test/unit_test.hpp>
@@ -123,4 +124,124 @@ BOOST_AUTO_TEST_CASE(flatfile_flush)
     BOOST_CHECK_EQUAL(fs::file_size(seq.FileName(FlatFilePos(0, 1))), 1U);
 }
 
+BOOST_AUTO_TEST_CASE(flatfile_map)
+{
+    const auto data_dir = m_args.GetDataDirBase();
+    FlatFileSeq seq(data_dir, "a", 100);
+
+    const std::string line("A purely peer-to-peer version of electronic cash");
+    {
+        CAutoFile file(seq.Open(FlatFilePos(0, 0)), SER_DISK, CLIENT_VERSION);
+        file << line;
+    }
+    const size_t size = GetSerializeSize(line, CLIENT_VERSION);
+
+    // Mapping past the end of the file, or nothing, fails.
+    BOOST_CHECK(!seq.Map(0, size + 1));
+    BOOST_CHECK(!seq.Map(0, 0));
+    BOOST_CHECK(!seq.Map(1, size));
+
+    const auto mapped = seq.Map(0, size);
+#ifndef WIN32
+    BOOST_REQUIRE(mapped);
+    BOOST_CHECK_EQUAL(mapped->Data().size(), size);
+    std::string text;
+    SpanReader reader(SER_DISK, CLIENT_VERSION, mapped->Data());
+    reader >> text;
+    BOOST_CHECK_EQUAL(text, line);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> text, std::ios_base::failure);
+#else
+    BOOST_CHECK(!mapped);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(lz_roundtrip)
+{
+    // Repetitive data, including overlapping and long matches, and random data
+    std::vector<uint8_t> data(100000);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i < 30000 ? 'a' : i < 60000 ? (i / 7) % 13 : InsecureRandBits(8);
+    }
+    for (const size_t size : {size_t{0}, size_t{3}, size_t{17}, size_t{30000}, data.size()}) {
+        const Span<const uint8_t> in{data.data(), size};
+        const std::vector<uint8_t> compressed = lz::Compress(in);
+        std::vector<uint8_t> out(size);
+        BOOST_CHECK(lz::Decompress(compressed, out));
+        BOOST_CHECK(std::equal(out.begin(), out.end(), in.begin(), in.end()));
+        if (size == 30000) BOOST_CHECK_LT(compressed.size(), 200U);
+        // A wrong size, or truncated input, is detected.
+        if (size > 0) {
+            std::vector<uint8_t> short_out(size - 1);
+            BOOST_CHECK(!lz::Decompress(compressed, short_out));
+            BOOST_CHECK(!lz::Decompress(Span<const uint8_t>{compressed}.first(compressed.size() / 2), out));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(flatfile_compressed)
+{
+    const auto data_dir = m_args.GetDataDirBase();
+    FlatFileSeq seq(data_dir, "a", 100);
+    const FlatFilePos pos(0, 0);
+    const fs::path path{seq.FileName(pos)};
+    const fs::path compressed_path{seq.CompressedFileName(pos)};
+    BOOST_CHECK_EQUAL(compressed_path.filename().string(), "a00000.cdat");
+
+    // Three frames: compressible, random (stored as is), and a partial one.
+    std::vector<unsigned char> data(2 * CompressedFlatFile::FRAME_SIZE + 1000);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i < CompressedFlatFile::FRAME_SIZE ? i % 100 : InsecureRandBits(8);
+    }
+    {
+        CAutoFile file(seq.Open(pos), SER_DISK, CLIENT_VERSION);
+        file.write((const char*)data.data(), data.size());
+        // Trailing bytes past the given size are not included.
+        file << uint32_t{0xffffffff};
+    }
+    BOOST_CHECK(!CompressedFlatFile::Write(path, fs::file_size(path) + 1, compressed_path));
+    BOOST_CHECK(CompressedFlatFile::Write(path, data.size(), compressed_path));
+    BOOST_CHECK_LT(fs::file_size(compressed_path), data.size() - CompressedFlatFile::FRAME_SIZE / 2);
+
+    auto compressed = CompressedFlatFile::Open(compressed_path);
+    BOOST_REQUIRE(compressed);
+    BOOST_CHECK_EQUAL(compressed->Size(), data.size());
+    // Reads within a frame, across frame boundaries, and past the end
+    for (const auto& [offset, len] : std::vector<std::pair<uint64_t, size_t>>{
+             {0, 10}, {12345, 1000}, {CompressedFlatFile::FRAME_SIZE - 5, 10},
+             {100, 2 * CompressedFlatFile::FRAME_SIZE}, {data.size() - 10, 10}}) {
+        std::vector<unsigned char> out(len);
+        BOOST_CHECK(compressed->Read(offset, out));
+        BOOST_CHECK(std::equal(out.begin(), out.end(), data.begin() + offset));
+    }
+    std::vector<unsigned char> out(11);
+    BOOST_CHECK(!compressed->Read(data.size() - 10, out));
+
+    fs::remove(path);
+    BOOST_CHECK(compressed->Restore(path));
+    BOOST_CHECK_EQUAL(fs::file_size(path), data.size());
+    {
+        std::vector<unsigned char> restored(data.size());
+        CAutoFile file(seq.Open(pos, true), SER_DISK, CLIENT_VERSION);
+        file.read((char*)restored.data(), restored.size());
+        BOOST_CHECK(restored == data);
+    }
+
+    // Missing and malformed files are not opened.
+    BOOST_CHECK(!CompressedFlatFile::Open(seq.CompressedFileName(FlatFilePos(1, 0))));
+    BOOST_CHECK(!CompressedFlatFile::Open(path));
+    const unsigned char magic[]{'f', 'f', 'z', 1};
+    for (const auto& [size, frame_ends] : std::vector<std::pair<uint64_t, std::vector<uint64_t>>>{
+             // The frame count must not wrap around
+             {std::numeric_limits<uint64_t>::max(), {}},
+             // Frames are not empty, nor larger than the original
+             {10, {0}}, {10, {11}}, {CompressedFlatFile::FRAME_SIZE + 10, {5, 5}}}) {
+        {
+            CAutoFile file(fsbridge::fopen(compressed_path, "wb"), SER_DISK, CLIENT_VERSION);
+            file << magic << size << frame_ends;
+        }
+        BOOST_CHECK(!CompressedFlatFile::Open(compressed_path));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
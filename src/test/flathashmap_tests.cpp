@@ -0,0 +1,153 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <coins.h>
+#include <flathashmap.h>
+#include <memusage.h>
+#include <test/util/setup_common.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <map>
+#include <string>
+
+BOOST_FIXTURE_TEST_SUITE(flathashmap_tests, BasicTestingSetup)
+
+namespace {
+//! Hash with many collisions and equal low bits, to exercise long probe sequences.
+struct CollidingHasher {
+    size_t operator()(uint64_t key) const { return (key % 13) << 4; }
+};
+
+template <typename Map>
+void CheckSame(const Map& map, const std::map<uint64_t, std::string>& expected)
+{
+    BOOST_CHECK_EQUAL(map.size(), expected.size());
+    size_t visited{0};
+    for (const auto& [key, value] : map) {
+        const auto it = expected.find(key);
+        BOOST_REQUIRE(it != expected.end());
+        BOOST_CHECK_EQUAL(value, it->second);
+        ++visited;
+    }
+    BOOST_CHECK_EQUAL(visited, expected.size());
+    for (const auto& [key, value] : expected) {
+        const auto it = map.find(key);
+        BOOST_REQUIRE(it != map.end());
+        BOOST_CHECK_EQUAL(it->second, value);
+    }
+}
+} // namespace
+
+BOOST_AUTO_TEST_CASE(flathashmap_random_ops)
+{
+    FlatHashMap<uint64_t, std::string, CollidingHasher> map;
+    std::map<uint64_t, std::string> expected;
+
+    for (int i = 0; i < 20000; ++i) {
+        const uint64_t key{InsecureRandRange(500)};
+        switch (InsecureRandRange(3)) {
+        case 0:
+        case 1: {
+            const std::string value{std::to_string(InsecureRand32())};
+            const auto [it, inserted] = map.emplace(key, value);
+            BOOST_CHECK_EQUAL(inserted, expected.emplace(key, value).second);
+            BOOST_CHECK_EQUAL(it->first, key);
+            BOOST_CHECK_EQUAL(it->second, expected.at(key));
+            break;
+        }
+        case 2:
+            BOOST_CHECK_EQUAL(map.erase(key), expected.erase(key));
+            BOOST_CHECK(map.find(key) == map.end());
+            break;
+        }
+    }
+    CheckSame(map, expected);
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_erase_while_iterating)
+{
+    FlatHashMap<uint64_t, std::string, CollidingHasher> map;
+    std::map<uint64_t, std::string> expected;
+    for (uint64_t key = 0; key < 1000; ++key) {
+        map.emplace(key, std::to_string(key));
+        expected.emplace(key, std::to_string(key));
+    }
+
+    // Erase every odd key with the it = erase(it) idiom.
+    for (auto it = map.begin(); it != map.end();) {
+        if (it->first % 2) {
+            expected.erase(it->first);
+            it = map.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    CheckSame(map, expected);
+
+    // Erase the rest with the erase(it++) idiom.
+    size_t erased{0};
+    for (auto it = map.begin(); it != map.end();) {
+        map.erase(it++);
+        ++erased;
+    }
+    BOOST_CHECK_EQUAL(erased, expected.size());
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_reference_stability)
+{
+    FlatHashMap<uint64_t, std::string, CollidingHasher> map;
+    const std::string* first{&map.emplace(1, "one").first->second};
+    for (uint64_t key = 2; key < 5000; ++key) {
+        map.emplace(key, std::to_string(key));
+        if (key % 3 == 0) map.erase(key - 1);
+    }
+    // Growing the table and reusing erased slots did not move the first value.
+    BOOST_CHECK_EQUAL(&map.find(1)->second, first);
+    BOOST_CHECK_EQUAL(*first, "one");
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_move_and_clear)
+{
+    FlatHashMap<uint64_t, std::string> map;
+    for (uint64_t key = 0; key < 300; ++key) {
+        map.emplace(key, std::to_string(key));
+    }
+    const size_t usage{memusage::DynamicUsage(map)};
+    BOOST_CHECK(usage >= memusage::MallocUsage(map.ChunkSize()) * ((300 + map.CHUNK_SIZE - 1) / map.CHUNK_SIZE));
+
+    FlatHashMap<uint64_t, std::string> moved{std::move(map)};
+    BOOST_CHECK_EQUAL(moved.size(), 300U);
+    BOOST_CHECK_EQUAL(moved.find(42)->second, "42");
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+    BOOST_CHECK(map.find(42) == map.end());
+    BOOST_CHECK(map.emplace(42, "reused").second);
+
+    // Clearing releases value storage but keeps the lookup table, like std::unordered_map.
+    const size_t buckets{moved.bucket_count()};
+    moved.clear();
+    BOOST_CHECK(moved.empty());
+    BOOST_CHECK_EQUAL(moved.chunk_count(), 0U);
+    BOOST_CHECK_EQUAL(moved.bucket_count(), buckets);
+    BOOST_CHECK(memusage::DynamicUsage(moved) < usage);
+    BOOST_CHECK(moved.find(42) == moved.end());
+}
+
+BOOST_AUTO_TEST_CASE(flathashmap_coins_usage)
+{
+    // The flat layout needs less memory per coin than the node based map.
+    FlatHashMap<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> flat;
+    std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> nodes;
+    for (uint32_t n = 0; n < 10000; ++n) {
+        const COutPoint outpoint{InsecureRand256(), n};
+        flat.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::tuple<>());
+        nodes.emplace(std::piecewise_construct, std::forward_as_tuple(outpoint), std::tuple<>());
+    }
+    BOOST_CHECK_LT(memusage::DynamicUsage(flat), memusage::DynamicUsage(nodes));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
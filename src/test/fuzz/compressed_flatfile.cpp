@@ -0,0 +1,92 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <flatfile.h>
+#include <fs.h>
+#include <test/fuzz/FuzzedDataProvider.h>
+#include <test/fuzz/fuzz.h>
+#include <test/fuzz/util.h>
+#include <test/util/setup_common.h>
+#include <util/system.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+namespace {
+void WriteWholeFile(const fs::path& path, const std::vector<unsigned char>& data)
+{
+    FILE* file = fsbridge::fopen(path, "wb");
+    assert(file);
+    assert(fwrite(data.data(), 1, data.size(), file) == data.size());
+    assert(fclose(file) == 0);
+}
+
+std::vector<unsigned char> ReadWholeFile(const fs::path& path)
+{
+    std::vector<unsigned char> data(fs::file_size(path));
+    FILE* file = fsbridge::fopen(path, "rb");
+    assert(file);
+    assert(fread(data.data(), 1, data.size(), file) == data.size());
+    fclose(file);
+    return data;
+}
+} // namespace
+
+void initialize_compressed_flatfile()
+{
+    static const auto testing_setup = MakeNoLogFileContext<>();
+}
+
+FUZZ_TARGET_INIT(compressed_flatfile, initialize_compressed_flatfile)
+{
+    FuzzedDataProvider fuzzed_data_provider(buffer.data(), buffer.size());
+    const fs::path original_path = gArgs.GetDataDirNet() / "fuzzed_original.dat";
+    const fs::path compressed_path = gArgs.GetDataDirNet() / "fuzzed_compressed.dat";
+    const fs::path restored_path = gArgs.GetDataDirNet() / "fuzzed_restored.dat";
+
+    // Either compress a file, which may span several frames by repeating a
+    // fuzzed pattern, and possibly corrupt the result, or take arbitrary bytes.
+    std::vector<unsigned char> original;
+    bool valid = fuzzed_data_provider.ConsumeBool();
+    if (valid) {
+        const std::vector<unsigned char> pattern = ConsumeRandomLengthByteVector(fuzzed_data_provider, 1024);
+        if (!pattern.empty()) {
+            original.resize(fuzzed_data_provider.ConsumeIntegralInRange<size_t>(0, 3 * CompressedFlatFile::FRAME_SIZE));
+            for (size_t i = 0; i < original.size(); ++i) {
+                original[i] = pattern[i % pattern.size()] ^ (i / pattern.size());
+            }
+        }
+        WriteWholeFile(original_path, original);
+        assert(CompressedFlatFile::Write(original_path, original.size(), compressed_path));
+        std::vector<unsigned char> compressed = ReadWholeFile(compressed_path);
+        for (int i = 0; i < 10 && !compressed.empty() && fuzzed_data_provider.ConsumeBool(); ++i) {
+            compressed[fuzzed_data_provider.ConsumeIntegralInRange<size_t>(0, compressed.size() - 1)] ^= fuzzed_data_provider.ConsumeIntegralInRange<unsigned char>(1, 255);
+            valid = false;
+        }
+        if (!valid) WriteWholeFile(compressed_path, compressed);
+    } else {
+        WriteWholeFile(compressed_path, ConsumeRandomLengthByteVector(fuzzed_data_provider));
+    }
+
+    std::unique_ptr<CompressedFlatFile> file = CompressedFlatFile::Open(compressed_path);
+    assert(file || !valid);
+    if (!file) return;
+    assert(!valid || file->Size() == original.size());
+    for (int i = 0; i < 100 && fuzzed_data_provider.ConsumeBool(); ++i) {
+        const uint64_t pos = fuzzed_data_provider.ConsumeIntegralInRange<uint64_t>(0, file->Size());
+        std::vector<unsigned char> out(fuzzed_data_provider.ConsumeIntegralInRange<uint64_t>(0, std::min<uint64_t>(file->Size() - pos, 2 * CompressedFlatFile::FRAME_SIZE)));
+        const bool read = file->Read(pos, out);
+        assert(read || !valid);
+        assert(!valid || std::equal(out.begin(), out.end(), original.begin() + pos));
+    }
+    if (fuzzed_data_provider.ConsumeBool()) {
+        const bool restored = file->Restore(restored_path);
+        assert(restored || !valid);
+        assert(!valid || ReadWholeFile(restored_path) == original);
+    }
+}
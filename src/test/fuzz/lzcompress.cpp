@@ -0,0 +1,32 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <test/fuzz/FuzzedDataProvider.h>
+#include <test/fuzz/fuzz.h>
+#include <test/fuzz/util.h>
+#include <util/lzcompress.h>
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+FUZZ_TARGET(lzcompress)
+{
+    FuzzedDataProvider fuzzed_data_provider(buffer.data(), buffer.size());
+    {
+        std::vector<uint8_t> out(fuzzed_data_provider.ConsumeIntegralInRange<size_t>(0, 1 << 16));
+        const std::vector<uint8_t> data = ConsumeRandomLengthByteVector(fuzzed_data_provider);
+        (void)lz::Decompress(data, out);
+    }
+    const std::vector<uint8_t> data = fuzzed_data_provider.ConsumeRemainingBytes<uint8_t>();
+    const std::vector<uint8_t> compressed = lz::Compress(data);
+    std::vector<uint8_t> decompressed(data.size());
+    assert(lz::Decompress(compressed, decompressed));
+    assert(decompressed == data);
+    if (!data.empty()) {
+        // Decompressing to any other size fails.
+        decompressed.pop_back();
+        assert(!lz::Decompress(compressed, decompressed));
+    }
+}
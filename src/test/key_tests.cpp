@@ -344,4 +344,41 @@ BOOST_AUTO_TEST_CASE(bip340_test_vectors)
     }
 }
 
+BOOST_AUTO_TEST_CASE(schnorr_signature_batch)
+{
+    SchnorrSignatureBatch batch;
+    BOOST_CHECK(batch.Verify());
+
+    std::vector<std::vector<unsigned char>> sigs;
+    for (int i = 0; i < 10; ++i) {
+        CKey key;
+        key.MakeNewKey(true);
+        const uint256 msg = InsecureRand256();
+        const uint256 aux = InsecureRand256();
+        unsigned char sig64[64];
+        BOOST_CHECK(key.SignSchnorr(msg, sig64, nullptr, &aux));
+        batch.Add(XOnlyPubKey(key.GetPubKey()), msg, sig64);
+        sigs.emplace_back(sig64, sig64 + 64);
+    }
+    BOOST_CHECK_EQUAL(batch.size(), 10U);
+    BOOST_CHECK(batch.Verify());
+
+    // A single invalid signature anywhere makes the whole batch fail.
+    CKey key;
+    key.MakeNewKey(true);
+    batch.Add(XOnlyPubKey(key.GetPubKey()), InsecureRand256(), sigs[3]);
+    BOOST_CHECK(!batch.Verify());
+
+    // Ranges that leave it out still pass, so it can be located.
+    BOOST_CHECK(batch.Verify(0, 10));
+    BOOST_CHECK(batch.Verify(3, 4));
+    BOOST_CHECK(batch.Verify(7, 7));
+    BOOST_CHECK(!batch.Verify(9, 11));
+    BOOST_CHECK(!batch.Verify(10, 11));
+
+    batch.clear();
+    BOOST_CHECK(batch.empty());
+    BOOST_CHECK(batch.Verify());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
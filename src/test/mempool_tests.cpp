@@ -108,6 +108,161 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     BOOST_CHECK_EQUAL(testPool.size(), 0U);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    TestMemPoolEntryHelper entry;
+    // Parent transaction with three children and three grand-children
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(3);
+    for (int i = 0; i < 3; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[3];
+    CMutableTransaction txGrandChild[3];
+    for (int i = 0; i < 3; i++) {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+        txGrandChild[i].vin.resize(1);
+        txGrandChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txGrandChild[i].vin[0].prevout = COutPoint(txChild[i].GetHash(), 0);
+        txGrandChild[i].vout.resize(1);
+        txGrandChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txGrandChild[i].vout[0].nValue = 11000LL;
+    }
+    // Unrelated transaction
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txOther.vout[0].nValue = 10000LL;
+
+    CTxMemPool testPool;
+    LOCK2(cs_main, testPool.cs);
+
+    // Children are added before their parent joins them into one cluster
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txParent.GetHash()), 0U);
+    testPool.addUnchecked(entry.FromTx(txOther));
+    testPool.addUnchecked(entry.FromTx(txParent));
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txParent.GetHash()), 1U);
+    for (int i = 0; i < 3; i++) {
+        testPool.addUnchecked(entry.FromTx(txChild[i]));
+        testPool.addUnchecked(entry.FromTx(txGrandChild[i]));
+    }
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txParent.GetHash()), 7U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txGrandChild[2].GetHash()), 7U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txOther.GetHash()), 1U);
+
+    // Removing a child with its descendants leaves the rest connected
+    testPool.removeRecursive(CTransaction(txChild[0]), REMOVAL_REASON_DUMMY);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txParent.GetHash()), 5U);
+
+    // Confirming the parent splits the cluster
+    testPool.removeForBlock({MakeTransactionRef(txParent)}, 1);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txChild[1].GetHash()), 2U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txGrandChild[2].GetHash()), 2U);
+    BOOST_CHECK_EQUAL(testPool.mapTx.find(txChild[1].GetHash())->GetCountWithAncestors(), 1U);
+
+    // A transaction spending from both joins them again
+    CMutableTransaction txJoin;
+    txJoin.vin.resize(2);
+    txJoin.vin[0].prevout = COutPoint(txGrandChild[1].GetHash(), 0);
+    txJoin.vin[1].prevout = COutPoint(txGrandChild[2].GetHash(), 0);
+    txJoin.vout.resize(1);
+    txJoin.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txJoin.vout[0].nValue = 20000LL;
+    testPool.addUnchecked(entry.FromTx(txJoin));
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txChild[1].GetHash()), 5U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txOther.GetHash()), 1U);
+
+    // Confirming a whole cluster leaves the others alone
+    testPool.removeForBlock({MakeTransactionRef(txChild[1]), MakeTransactionRef(txChild[2]), MakeTransactionRef(txGrandChild[1]),
+                             MakeTransactionRef(txGrandChild[2]), MakeTransactionRef(txJoin)}, 2);
+    BOOST_CHECK_EQUAL(testPool.size(), 1U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txOther.GetHash()), 1U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txJoin.GetHash()), 0U);
+
+    // Replacing the join may leave the rest disconnected. A block confirming
+    // part of it splits it first, so that what it confirms is a whole cluster.
+    for (int i = 0; i < 3; i++) {
+        testPool.addUnchecked(entry.FromTx(txChild[i]));
+        testPool.addUnchecked(entry.FromTx(txGrandChild[i]));
+    }
+    txJoin.vin.resize(3);
+    txJoin.vin[2].prevout = COutPoint(txGrandChild[0].GetHash(), 0);
+    testPool.addUnchecked(entry.FromTx(txJoin));
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txChild[0].GetHash()), 7U);
+    testPool.removeRecursive(CTransaction(txJoin), REMOVAL_REASON_DUMMY);
+    BOOST_CHECK_EQUAL(testPool.GetDirtyClusterCount(), 1U);
+    testPool.removeForBlock({MakeTransactionRef(txChild[0]), MakeTransactionRef(txGrandChild[0])}, 3);
+    BOOST_CHECK_EQUAL(testPool.GetDirtyClusterCount(), 0U);
+    BOOST_CHECK_EQUAL(testPool.size(), 5U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txChild[1].GetHash()), 2U);
+    BOOST_CHECK_EQUAL(testPool.GetClusterSize(txGrandChild[2].GetHash()), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolEntryLinksTest)
+{
+    TestMemPoolEntryHelper entry;
+    // Parent transaction with three children
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(3);
+    for (int i = 0; i < 3; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[3];
+    for (int i = 0; i < 3; i++) {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+    }
+
+    CTxMemPool testPool;
+    LOCK2(cs_main, testPool.cs);
+
+    testPool.addUnchecked(entry.FromTx(txParent));
+    const CTxMemPoolEntry& parent = *testPool.mapTx.find(txParent.GetHash());
+    // Up to two children are stored inline
+    for (int i = 0; i < 2; i++) {
+        testPool.addUnchecked(entry.FromTx(txChild[i]));
+        BOOST_CHECK_EQUAL(parent.GetMemPoolChildrenConst().DynamicMemoryUsage(), 0U);
+    }
+    testPool.addUnchecked(entry.FromTx(txChild[2]));
+    BOOST_CHECK(parent.GetMemPoolChildrenConst().DynamicMemoryUsage() > 0);
+
+    // Children are ordered by txid, and link back to the parent
+    const CTxMemPoolEntry::Children& children = parent.GetMemPoolChildrenConst();
+    BOOST_CHECK_EQUAL(children.size(), 3U);
+    BOOST_CHECK(std::is_sorted(children.begin(), children.end(), [](const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) {
+        return a.GetTx().GetHash() < b.GetTx().GetHash();
+    }));
+    for (const CTxMemPoolEntry& child : children) {
+        BOOST_CHECK_EQUAL(child.GetMemPoolParentsConst().size(), 1U);
+        BOOST_CHECK(&*child.GetMemPoolParentsConst().begin() == &parent);
+    }
+
+    // Links are moved inline again once they fit
+    testPool.removeRecursive(CTransaction(txChild[1]), REMOVAL_REASON_DUMMY);
+    BOOST_CHECK_EQUAL(children.size(), 2U);
+    BOOST_CHECK_EQUAL(children.DynamicMemoryUsage(), 0U);
+
+    testPool.removeRecursive(CTransaction(txParent), REMOVAL_REASON_DUMMY);
+    BOOST_CHECK_EQUAL(testPool.size(), 0U);
+}
+
 template<typename name>
 static void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder) EXCLUSIVE_LOCKS_REQUIRED(pool.cs)
 {
@@ -537,7 +692,10 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
         pool.addUnchecked(entry.Fee(1000LL).FromTx(tx5));
     pool.addUnchecked(entry.Fee(9000LL).FromTx(tx7));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should maximize mempool size by only removing 5/7
+    // should maximize mempool size by only removing 5/7. The cluster of tx4 and tx6
+    // takes about 300 bytes for its map entry and buckets, entry vector and dirty mark, which
+    // do not shrink with it, so trimming to half would remove tx6 as well.
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 5);
     BOOST_CHECK(pool.exists(tx4.GetHash()));
     BOOST_CHECK(!pool.exists(tx5.GetHash()));
     BOOST_CHECK(pool.exists(tx6.GetHash()));
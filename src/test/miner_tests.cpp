@@ -527,4 +527,61 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_cached, TestChain100Setup)
+{
+    const CScript script = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    auto sorted_txids = [](const CBlockTemplate& block_template) {
+        std::vector<uint256> txids;
+        for (size_t i = 1; i < block_template.block.vtx.size(); ++i) txids.push_back(block_template.block.vtx[i]->GetHash());
+        std::sort(txids.begin(), txids.end());
+        return txids;
+    };
+    auto assembler = [&] { return BlockAssembler(m_node.chainman->ActiveChainstate(), *m_node.mempool, Params()); };
+
+    // Let the second coinbase mature
+    CreateAndProcessBlock({}, script);
+
+    BlockTemplateCache cache;
+    const CTransactionRef tx1 = MakeTransactionRef(CreateValidMempoolTransaction(m_coinbase_txns[0], 0, 1, coinbaseKey, script, 49 * COIN));
+    std::unique_ptr<CBlockTemplate> block_template = assembler().CreateNewBlock(script, cache);
+    BOOST_REQUIRE_EQUAL(block_template->block.vtx.size(), 2U);
+    BOOST_CHECK(cache.all_packages_added);
+    BOOST_CHECK_EQUAL(cache.additions_seen, 1U);
+
+    // Without mempool changes the cached template is returned
+    const uint256 merkle_root = block_template->block.hashMerkleRoot;
+    block_template = assembler().CreateNewBlock(script, cache);
+    BOOST_CHECK(block_template->block.hashMerkleRoot == merkle_root);
+
+    // New transactions, including a child of a transaction in the template,
+    // are appended in the order they entered the mempool, even though a fresh
+    // template puts the higher fee rate tx2 first.
+    const CTransactionRef tx2 = MakeTransactionRef(CreateValidMempoolTransaction(m_coinbase_txns[1], 0, 2, coinbaseKey, script, 48 * COIN));
+    const CTransactionRef tx3 = MakeTransactionRef(CreateValidMempoolTransaction(tx1, 0, 102, coinbaseKey, script, 48 * COIN));
+    block_template = assembler().CreateNewBlock(script, cache);
+    BOOST_REQUIRE_EQUAL(block_template->block.vtx.size(), 4U);
+    BOOST_CHECK(block_template->block.vtx[1]->GetHash() == tx1->GetHash());
+    BOOST_CHECK(block_template->block.vtx[2]->GetHash() == tx2->GetHash());
+    BOOST_CHECK(block_template->block.vtx[3]->GetHash() == tx3->GetHash());
+    BOOST_CHECK_EQUAL(cache.additions_seen, 3U);
+
+    std::unique_ptr<CBlockTemplate> fresh_template = assembler().CreateNewBlock(script);
+    BOOST_CHECK(fresh_template->block.vtx[1]->GetHash() == tx2->GetHash());
+    BOOST_CHECK(sorted_txids(*block_template) == sorted_txids(*fresh_template));
+    BOOST_CHECK_EQUAL(block_template->block.vtx[0]->GetValueOut(), fresh_template->block.vtx[0]->GetValueOut());
+
+    // Removing a transaction invalidates the cached template
+    WITH_LOCK(m_node.mempool->cs, m_node.mempool->removeRecursive(*tx1, MemPoolRemovalReason::CONFLICT));
+    block_template = assembler().CreateNewBlock(script, cache);
+    BOOST_REQUIRE_EQUAL(block_template->block.vtx.size(), 2U);
+    BOOST_CHECK(block_template->block.vtx[1]->GetHash() == tx2->GetHash());
+    BOOST_CHECK_EQUAL(cache.additions_seen, 0U);
+
+    // So does a new tip
+    CreateAndProcessBlock({}, script);
+    block_template = assembler().CreateNewBlock(script, cache);
+    BOOST_CHECK(block_template->block.hashPrevBlock == m_node.chainman->ActiveChain().Tip()->GetBlockHash());
+    BOOST_CHECK_EQUAL(block_template->block.vtx.size(), 2U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
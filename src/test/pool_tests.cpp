@@ -0,0 +1,98 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <memusage.h>
+#include <support/allocators/pool.h>
+#include <test/util/setup_common.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+
+BOOST_FIXTURE_TEST_SUITE(pool_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(pool_resource_reuse)
+{
+    PoolResource<64, 8> resource;
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 0U);
+
+    // Sizes are rounded up to the alignment, so 17..24 bytes share a free list.
+    void* a = resource.Allocate(17, 8);
+    void* b = resource.Allocate(24, 8);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1U);
+    BOOST_CHECK_EQUAL(static_cast<std::byte*>(b) - static_cast<std::byte*>(a), 24);
+    resource.Deallocate(a, 17, 8);
+    BOOST_CHECK_EQUAL(resource.Allocate(20, 8), a);
+    resource.Deallocate(b, 24, 8);
+
+    // Other sizes are not served from that list.
+    void* c = resource.Allocate(32, 8);
+    BOOST_CHECK(c != b);
+    BOOST_CHECK_EQUAL(resource.Allocate(24, 8), b);
+
+    // Large and over-aligned requests bypass the pool.
+    const size_t chunk_bytes{resource.AllocatedBytes()};
+    void* large = resource.Allocate(65, 8);
+    void* aligned = resource.Allocate(8, 16);
+    BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(aligned) % 16, 0U);
+    BOOST_CHECK_EQUAL(resource.AllocatedBytes(), chunk_bytes);
+    resource.Deallocate(large, 65, 8);
+    resource.Deallocate(aligned, 8, 16);
+}
+
+BOOST_AUTO_TEST_CASE(pool_resource_chunk_growth)
+{
+    PoolResource<64, 8> resource{PoolResource<64, 8>::MIN_CHUNK_SIZE_BYTES * 4};
+    std::set<void*> blocks;
+    size_t bytes{0};
+    while (resource.NumAllocatedChunks() < 5) {
+        BOOST_CHECK(blocks.insert(resource.Allocate(64, 8)).second);
+        bytes += 64;
+    }
+    // Chunks double in size until they reach the maximum.
+    const size_t min_chunk{PoolResource<64, 8>::MIN_CHUNK_SIZE_BYTES};
+    BOOST_CHECK_EQUAL(resource.AllocatedBytes(), min_chunk * (1 + 2 + 4 + 4 + 4));
+    BOOST_CHECK(bytes <= resource.AllocatedBytes());
+    for (void* p : blocks) {
+        resource.Deallocate(p, 64, 8);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_unordered_map)
+{
+    using Map = std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, PoolAllocator<std::pair<const uint64_t, uint64_t>, 64, 8>>;
+    Map map;
+    for (uint64_t i = 0; i < 10000; ++i) {
+        map.emplace(i, i * 2);
+    }
+    for (uint64_t i = 0; i < 10000; i += 2) {
+        map.erase(i);
+    }
+    for (uint64_t i = 0; i < 10000; ++i) {
+        const auto it = map.find(i);
+        BOOST_CHECK_EQUAL(it != map.end(), i % 2 == 1);
+        if (it != map.end()) BOOST_CHECK_EQUAL(it->second, i * 2);
+    }
+    const auto* resource = map.get_allocator().resource();
+    BOOST_CHECK(memusage::DynamicUsage(map) >= resource->AllocatedBytes());
+
+    // Reinserting reuses the freed nodes instead of growing the pool.
+    const size_t pool_bytes{resource->AllocatedBytes()};
+    for (uint64_t i = 0; i < 10000; i += 2) {
+        map.emplace(i, i);
+    }
+    BOOST_CHECK_EQUAL(resource->AllocatedBytes(), pool_bytes);
+
+    // A moved-to map keeps the resource alive, and the source stays usable.
+    Map moved{std::move(map)};
+    BOOST_CHECK_EQUAL(moved.get_allocator().resource(), resource);
+    BOOST_CHECK_EQUAL(moved.size(), 10000U);
+    map.clear();
+    map.emplace(1, 1);
+    BOOST_CHECK_EQUAL(map.at(1), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
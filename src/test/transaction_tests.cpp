@@ -16,6 +16,7 @@
 #include <policy/settings.h>
 #include <script/script.h>
 #include <script/script_error.h>
+#include <script/sigcache.h>
 #include <script/sign.h>
 #include <script/signingprovider.h>
 #include <script/standard.h>
@@ -556,6 +557,82 @@ BOOST_AUTO_TEST_CASE(test_big_witness_transaction)
     scriptcheckqueue.StopWorkerThreads();
 }
 
+BOOST_AUTO_TEST_CASE(script_check_batch)
+{
+    // Spend ten taproot outputs through their key paths.
+    const unsigned int num_inputs = 10;
+    std::vector<CKey> keys(num_inputs);
+    std::vector<CTxOut> spent_outputs;
+    CMutableTransaction mtx;
+    mtx.nVersion = 2;
+    for (unsigned int i = 0; i < num_inputs; ++i) {
+        keys[i].MakeNewKey(true);
+        spent_outputs.emplace_back(1000, CScript() << OP_1 << ToByteVector(XOnlyPubKey(keys[i].GetPubKey())));
+        mtx.vin.emplace_back(COutPoint(InsecureRand256(), i));
+    }
+    mtx.vout.emplace_back(9000, CScript() << OP_TRUE);
+    const CTransaction unsigned_tx(mtx);
+    PrecomputedTransactionData sign_data;
+    sign_data.Init(unsigned_tx, std::vector<CTxOut>(spent_outputs), /* force */ true);
+    ScriptExecutionData execdata;
+    execdata.m_annex_init = true;
+    execdata.m_annex_present = false;
+    for (unsigned int i = 0; i < num_inputs; ++i) {
+        uint256 hash;
+        BOOST_CHECK(SignatureHashSchnorr(hash, execdata, unsigned_tx, i, SIGHASH_DEFAULT, SigVersion::TAPROOT, sign_data, MissingDataBehavior::FAIL));
+        std::vector<unsigned char> sig(64);
+        BOOST_CHECK(keys[i].SignSchnorr(hash, sig));
+        mtx.vin[i].scriptWitness.stack = {sig};
+    }
+
+    // Run the checks of all inputs as one batch of the script check queue, and return the failing one with its error.
+    const auto run_batch = [&](const CMutableTransaction& mtx) {
+        const CTransaction tx(mtx);
+        PrecomputedTransactionData txdata;
+        txdata.Init(tx, std::vector<CTxOut>(spent_outputs));
+        std::vector<CScriptCheck> checks;
+        for (unsigned int i = 0; i < num_inputs; ++i) {
+            checks.emplace_back(spent_outputs[i], tx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_TAPROOT, false, &txdata);
+        }
+        const size_t failed = RunCheckBatch(checks);
+        return std::make_pair(failed, failed < checks.size() ? checks[failed].GetScriptError() : SCRIPT_ERR_OK);
+    };
+
+    BOOST_CHECK(run_batch(mtx) == std::make_pair(size_t{num_inputs}, SCRIPT_ERR_OK));
+
+    CMutableTransaction bad_sig{mtx};
+    bad_sig.vin[3].scriptWitness.stack[0][40] ^= 1;
+    BOOST_CHECK(run_batch(bad_sig) == std::make_pair(size_t{3}, SCRIPT_ERR_SCHNORR_SIG));
+
+    // With the Schnorr signatures deferred, the invalid one only shows up when they are verified.
+    {
+        const CTransaction tx(bad_sig);
+        PrecomputedTransactionData txdata;
+        txdata.Init(tx, std::vector<CTxOut>(spent_outputs));
+        DeferredSchnorrSignatures deferred;
+        for (unsigned int i = 0; i < num_inputs; ++i) {
+            const BatchingTransactionSignatureChecker checker(&tx, i, spent_outputs[i].nValue, false, txdata, deferred);
+            BOOST_CHECK(VerifyScript(tx.vin[i].scriptSig, spent_outputs[i].scriptPubKey, &tx.vin[i].scriptWitness, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_TAPROOT, checker));
+        }
+        BOOST_CHECK_EQUAL(deferred.size(), num_inputs);
+        BOOST_CHECK(deferred.Verify(0, 3));
+        BOOST_CHECK(!deferred.Verify(3, 4));
+        BOOST_CHECK(deferred.Verify(4, num_inputs));
+        BOOST_CHECK(!deferred.VerifyAndCache());
+    }
+
+    // A script that fails while evaluating it.
+    CMutableTransaction bad_script{mtx};
+    bad_script.vin[6].scriptWitness.stack.clear();
+    BOOST_CHECK(run_batch(bad_script) == std::make_pair(size_t{6}, SCRIPT_ERR_WITNESS_PROGRAM_WITNESS_EMPTY));
+    bad_script.vin[6].scriptWitness.stack = {std::vector<unsigned char>(63)};
+    BOOST_CHECK(run_batch(bad_script) == std::make_pair(size_t{6}, SCRIPT_ERR_SCHNORR_SIG_SIZE));
+
+    // The invalid signature of an earlier input comes first.
+    bad_script.vin[3].scriptWitness.stack = bad_sig.vin[3].scriptWitness.stack;
+    BOOST_CHECK(run_batch(bad_script) == std::make_pair(size_t{3}, SCRIPT_ERR_SCHNORR_SIG));
+}
+
 SignatureData CombineSignatures(const CMutableTransaction& input1, const CMutableTransaction& input2, const CTransactionRef tx)
 {
     SignatureData sigdata;
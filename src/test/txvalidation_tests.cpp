@@ -8,6 +8,8 @@
 #include <policy/policy.h>
 #include <primitives/transaction.h>
 #include <script/script.h>
+#include <script/sign.h>
+#include <script/signingprovider.h>
 #include <script/standard.h>
 #include <test/util/setup_common.h>
 #include <validation.h>
@@ -51,6 +53,152 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK(result.m_state.GetResult() == TxValidationResult::TX_CONSENSUS);
 }
 
+/**
+ * Ensure that the scripts of transactions with many inputs, which are checked
+ * on the script check threads, are accepted or rejected just like others.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_many_inputs, TestChain100Setup)
+{
+    BOOST_REQUIRE(g_parallel_script_checks);
+    const CScript script = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    FillableSigningProvider keystore;
+    BOOST_REQUIRE(keystore.AddKey(coinbaseKey));
+
+    // Split a coinbase output into many, and confirm them
+    CMutableTransaction fanout;
+    fanout.vin.emplace_back(COutPoint(m_coinbase_txns[0]->GetHash(), 0));
+    for (int i = 0; i < 40; ++i) {
+        fanout.vout.emplace_back(1 * COIN, script);
+    }
+    BOOST_REQUIRE(SignSignature(keystore, *m_coinbase_txns[0], fanout, 0, SIGHASH_ALL));
+    CreateAndProcessBlock({fanout}, script);
+
+    CMutableTransaction spend;
+    for (uint32_t i = 0; i < fanout.vout.size(); ++i) {
+        spend.vin.emplace_back(COutPoint(fanout.GetHash(), i));
+    }
+    spend.vout.emplace_back(39 * COIN, script);
+    for (unsigned int i = 0; i < spend.vin.size(); ++i) {
+        BOOST_REQUIRE(SignSignature(keystore, CTransaction(fanout), spend, i, SIGHASH_ALL));
+    }
+
+    LOCK(cs_main);
+    // Break the signature of one input
+    CMutableTransaction invalid{spend};
+    invalid.vin[23].scriptSig = spend.vin[22].scriptSig;
+    const MempoolAcceptResult invalid_result = AcceptToMemoryPool(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(invalid), /* bypass_limits */ false);
+    BOOST_CHECK(invalid_result.m_result_type == MempoolAcceptResult::ResultType::INVALID);
+    BOOST_CHECK_EQUAL(invalid_result.m_state.GetRejectReason(), "mandatory-script-verify-flag-failed (Signature must be zero for failed CHECK(MULTI)SIG operation)");
+    BOOST_CHECK(invalid_result.m_state.GetResult() == TxValidationResult::TX_CONSENSUS);
+
+    const MempoolAcceptResult result = AcceptToMemoryPool(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(spend), /* bypass_limits */ false);
+    BOOST_CHECK(result.m_result_type == MempoolAcceptResult::ResultType::VALID);
+    BOOST_CHECK(m_node.mempool->exists(spend.GetHash()));
+}
+
+/**
+ * Ensure that a transaction with many inputs whose witnesses were stripped
+ * is told apart from one that is invalid.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_witness_stripped, TestChain100Setup)
+{
+    BOOST_REQUIRE(g_parallel_script_checks);
+    const CScript coinbase_script = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    const CScript script = GetScriptForDestination(WitnessV0KeyHash(coinbaseKey.GetPubKey()));
+    FillableSigningProvider keystore;
+    BOOST_REQUIRE(keystore.AddKey(coinbaseKey));
+
+    CMutableTransaction fanout;
+    fanout.vin.emplace_back(COutPoint(m_coinbase_txns[0]->GetHash(), 0));
+    for (int i = 0; i < 20; ++i) {
+        fanout.vout.emplace_back(1 * COIN, script);
+    }
+    BOOST_REQUIRE(SignSignature(keystore, *m_coinbase_txns[0], fanout, 0, SIGHASH_ALL));
+    CreateAndProcessBlock({fanout}, coinbase_script);
+
+    CMutableTransaction spend;
+    for (uint32_t i = 0; i < fanout.vout.size(); ++i) {
+        spend.vin.emplace_back(COutPoint(fanout.GetHash(), i));
+    }
+    spend.vout.emplace_back(19 * COIN, script);
+    for (unsigned int i = 0; i < spend.vin.size(); ++i) {
+        BOOST_REQUIRE(SignSignature(keystore, CTransaction(fanout), spend, i, SIGHASH_ALL));
+    }
+
+    LOCK(cs_main);
+    // Without any witness, the transaction may be fine
+    CMutableTransaction stripped{spend};
+    for (CTxIn& txin : stripped.vin) {
+        txin.scriptWitness.SetNull();
+    }
+    const MempoolAcceptResult stripped_result = AcceptToMemoryPool(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(stripped), /* bypass_limits */ false);
+    BOOST_CHECK(stripped_result.m_result_type == MempoolAcceptResult::ResultType::INVALID);
+    BOOST_CHECK(stripped_result.m_state.GetResult() == TxValidationResult::TX_WITNESS_STRIPPED);
+
+    // With the witness of only one input missing, it is invalid
+    CMutableTransaction missing{spend};
+    missing.vin[7].scriptWitness.SetNull();
+    const MempoolAcceptResult missing_result = AcceptToMemoryPool(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(missing), /* bypass_limits */ false);
+    BOOST_CHECK(missing_result.m_result_type == MempoolAcceptResult::ResultType::INVALID);
+    BOOST_CHECK_EQUAL(missing_result.m_state.GetRejectReason(), "non-mandatory-script-verify-flag (Witness program hash mismatch)");
+    BOOST_CHECK(missing_result.m_state.GetResult() == TxValidationResult::TX_NOT_STANDARD);
+
+    const MempoolAcceptResult result = AcceptToMemoryPool(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(spend), /* bypass_limits */ false);
+    BOOST_CHECK(result.m_result_type == MempoolAcceptResult::ResultType::VALID);
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_pipelined, TestChain100Setup)
+{
+    const CScript script = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    FillableSigningProvider keystore;
+    BOOST_REQUIRE(keystore.AddKey(coinbaseKey));
+
+    // Split a coinbase output into enough to take the pipelined path, and confirm them
+    CMutableTransaction fanout;
+    fanout.vin.emplace_back(COutPoint(m_coinbase_txns[0]->GetHash(), 0));
+    for (unsigned int i = 0; i < MIN_PIPELINED_ACCEPT_INPUTS; ++i) {
+        fanout.vout.emplace_back(1 * COIN, script);
+    }
+    BOOST_REQUIRE(SignSignature(keystore, *m_coinbase_txns[0], fanout, 0, SIGHASH_ALL));
+    CreateAndProcessBlock({fanout}, script);
+
+    CMutableTransaction spend;
+    for (uint32_t i = 0; i < fanout.vout.size(); ++i) {
+        spend.vin.emplace_back(COutPoint(fanout.GetHash(), i));
+    }
+    spend.vout.emplace_back(MIN_PIPELINED_ACCEPT_INPUTS * COIN - 10000, script);
+    for (unsigned int i = 0; i < spend.vin.size(); ++i) {
+        BOOST_REQUIRE(SignSignature(keystore, CTransaction(fanout), spend, i, SIGHASH_ALL));
+    }
+
+    // Use the signature of another input
+    CMutableTransaction invalid{spend};
+    invalid.vin[1].scriptSig = spend.vin[0].scriptSig;
+    const MempoolAcceptResult invalid_result = AcceptToMemoryPoolPipelined(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(invalid));
+    BOOST_CHECK(invalid_result.m_result_type == MempoolAcceptResult::ResultType::INVALID);
+    BOOST_CHECK_EQUAL(invalid_result.m_state.GetRejectReason(), "mandatory-script-verify-flag-failed (Signature must be zero for failed CHECK(MULTI)SIG operation)");
+    BOOST_CHECK(invalid_result.m_state.GetResult() == TxValidationResult::TX_CONSENSUS);
+    BOOST_CHECK(!m_node.mempool->exists(invalid.GetHash()));
+
+    const MempoolAcceptResult result = AcceptToMemoryPoolPipelined(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(spend));
+    BOOST_CHECK(result.m_result_type == MempoolAcceptResult::ResultType::VALID);
+    BOOST_CHECK(m_node.mempool->exists(spend.GetHash()));
+
+    // Rejected by the checks before script verification
+    const MempoolAcceptResult again_result = AcceptToMemoryPoolPipelined(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(spend));
+    BOOST_CHECK(again_result.m_result_type == MempoolAcceptResult::ResultType::INVALID);
+    BOOST_CHECK_EQUAL(again_result.m_state.GetRejectReason(), "txn-already-in-mempool");
+
+    // A transaction with a single input goes through AcceptToMemoryPool()
+    const auto small = CreateValidMempoolTransaction(/* input_transaction */ m_coinbase_txns[1], /* vout */ 0,
+                                                     /* input_height */ 0, /* input_signing_key */ coinbaseKey,
+                                                     /* output_destination */ script,
+                                                     /* output_amount */ CAmount(49 * COIN), /* submit */ false);
+    const MempoolAcceptResult small_result = AcceptToMemoryPoolPipelined(m_node.chainman->ActiveChainstate(), *m_node.mempool, MakeTransactionRef(small));
+    BOOST_CHECK(small_result.m_result_type == MempoolAcceptResult::ResultType::VALID);
+    BOOST_CHECK(m_node.mempool->exists(small.GetHash()));
+}
+
 // Create placeholder transactions that have no meaning.
 inline CTransactionRef create_placeholder_tx(size_t num_inputs, size_t num_outputs)
 {
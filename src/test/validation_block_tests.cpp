@@ -4,6 +4,7 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <arith_uint256.h>
 #include <chainparams.h>
 #include <consensus/merkle.h>
 #include <consensus/validation.h>
@@ -16,6 +17,7 @@
 #include <util/time.h>
 #include <validation.h>
 #include <validationinterface.h>
+#include <versionbits.h>
 
 #include <thread>
 
@@ -321,6 +323,88 @@ BOOST_AUTO_TEST_CASE(mempool_locks_reorg)
     }
 }
 
+/**
+ * Test that blocks connected as one batch during initial block download are
+ * only applied once all their script checks passed.
+ *
+ * A chain whose third block fails script verification is submitted in one go;
+ * only the two blocks before it may be connected, and validation interface
+ * subscribers must not hear about any of the others. A valid chain then
+ * connects in full.
+ */
+BOOST_AUTO_TEST_CASE(batched_script_checks)
+{
+    bool ignored;
+    CChainState& chainstate = m_node.chainman->ActiveChainstate();
+    BOOST_REQUIRE(Assert(m_node.chainman)->ProcessNewBlock(Params(), std::make_shared<CBlock>(Params().GenesisBlock()), true, &ignored));
+    auto last_mined = GoodBlock(Params().GenesisBlock().GetHash());
+    BOOST_REQUIRE(Assert(m_node.chainman)->ProcessNewBlock(Params(), last_mined, true, &ignored));
+    const COutPoint spendable{last_mined->vtx[0]->GetHash(), 1};
+    const CTxOut spendable_out{last_mined->vtx[0]->vout[1]};
+    for (int j = COINBASE_MATURITY; j > 0; --j) {
+        last_mined = GoodBlock(last_mined->GetHash());
+        BOOST_REQUIRE(Assert(m_node.chainman)->ProcessNewBlock(Params(), last_mined, true, &ignored));
+    }
+    BOOST_REQUIRE(chainstate.IsInitialBlockDownload());
+    BOOST_REQUIRE(g_parallel_script_checks && g_script_check_batch_blocks > 2);
+
+    const auto BuildSpendingChain = [&](const uint256& root, const std::vector<uint8_t>& witness_elem) {
+        CMutableTransaction mtx;
+        mtx.vin.push_back(CTxIn{spendable, CScript{}});
+        mtx.vin[0].scriptWitness.stack.push_back(witness_elem);
+        mtx.vout.push_back(spendable_out);
+        mtx.vout[0].nValue -= 1000;
+        std::vector<std::shared_ptr<const CBlock>> chain;
+        uint256 prev_hash{root};
+        for (int i = 0; i < 6; ++i) {
+            auto pblock = Block(prev_hash);
+            if (i == 2) pblock->vtx.push_back(MakeTransactionRef(mtx));
+            chain.push_back(FinalizeBlock(pblock));
+            prev_hash = chain.back()->GetHash();
+        }
+        return chain;
+    };
+    // Store all blocks first, so that they are connected by a single ActivateBestChain call.
+    const auto AcceptAndActivate = [&](const std::vector<std::shared_ptr<const CBlock>>& chain) {
+        {
+            LOCK(cs_main);
+            for (const auto& pblock : chain) {
+                BlockValidationState state;
+                BOOST_REQUIRE(chainstate.AcceptBlock(pblock, state, nullptr, true, nullptr, nullptr));
+            }
+        }
+        BlockValidationState state;
+        BOOST_CHECK(chainstate.ActivateBestChain(state));
+        SyncWithValidationInterfaceQueue();
+    };
+
+    auto sub = std::make_shared<TestSubscriber>(last_mined->GetHash());
+    RegisterSharedValidationInterface(sub);
+
+    // The witness does not match the P2WSH program, which only script verification notices.
+    const auto bad_chain = BuildSpendingChain(last_mined->GetHash(), std::vector<uint8_t>{uint8_t{OP_FALSE}});
+    AcceptAndActivate(bad_chain);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(m_node.chainman->ActiveChain().Tip()->GetBlockHash(), bad_chain[1]->GetHash());
+        BOOST_CHECK(m_node.chainman->m_blockman.LookupBlockIndex(bad_chain[2]->GetHash())->nStatus & BLOCK_FAILED_VALID);
+        BOOST_CHECK(chainstate.CoinsTip().HaveCoin(spendable));
+    }
+    BOOST_CHECK_EQUAL(sub->m_expected_tip, bad_chain[1]->GetHash());
+
+    const auto good_chain = BuildSpendingChain(bad_chain[1]->GetHash(), WITNESS_STACK_ELEM_OP_TRUE);
+    AcceptAndActivate(good_chain);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(m_node.chainman->ActiveChain().Tip()->GetBlockHash(), good_chain.back()->GetHash());
+        BOOST_CHECK(m_node.chainman->ActiveChain().Tip()->IsValid(BLOCK_VALID_SCRIPTS));
+        BOOST_CHECK(!chainstate.CoinsTip().HaveCoin(spendable));
+    }
+    BOOST_CHECK_EQUAL(sub->m_expected_tip, good_chain.back()->GetHash());
+
+    UnregisterSharedValidationInterface(sub);
+}
+
 BOOST_AUTO_TEST_CASE(witness_commitment_index)
 {
     CScript pubKey;
@@ -354,4 +438,75 @@ BOOST_AUTO_TEST_CASE(witness_commitment_index)
 
     BOOST_CHECK_EQUAL(GetWitnessCommitmentIndex(pblock), 2);
 }
+
+BOOST_AUTO_TEST_CASE(process_new_block_headers)
+{
+    const Consensus::Params& consensus = Params().GetConsensus();
+    const CBlock& genesis = Params().GenesisBlock();
+    const auto mine = [&](CBlockHeader& header, bool valid) {
+        header.nNonce = 0;
+        while (CheckProofOfWork(header.GetHash(), header.nBits, consensus) != valid) ++header.nNonce;
+    };
+    const auto make_headers = [&](const uint256& root, uint32_t time, size_t count) {
+        std::vector<CBlockHeader> headers(count);
+        for (size_t i = 0; i < count; ++i) {
+            headers[i].nVersion = VERSIONBITS_TOP_BITS;
+            headers[i].hashPrevBlock = i == 0 ? root : headers[i - 1].GetHash();
+            headers[i].nTime = time + i + 1;
+            headers[i].nBits = genesis.nBits;
+            mine(headers[i], true);
+        }
+        return headers;
+    };
+    const auto process = [&](const std::vector<CBlockHeader>& headers, const CBlockIndex** ppindex = nullptr) {
+        BlockValidationState state;
+        m_node.chainman->ProcessNewBlockHeaders(headers, state, Params(), ppindex);
+        return state.GetRejectReason();
+    };
+    const auto known = [&](const CBlockHeader& header) {
+        return WITH_LOCK(cs_main, return m_node.chainman->m_blockman.LookupBlockIndex(header.GetHash()) != nullptr);
+    };
+
+    // Enough headers to be split across the header check threads
+    StartHeaderCheckThreads(2);
+    const auto headers = make_headers(genesis.GetHash(), genesis.nTime, 2000);
+    const CBlockIndex* pindex = nullptr;
+    BOOST_CHECK_EQUAL(process(headers, &pindex), "");
+    BOOST_REQUIRE(pindex);
+    BOOST_CHECK(pindex->GetBlockHash() == headers.back().GetHash());
+    BOOST_CHECK_EQUAL(pindex->nHeight, 2000);
+    // Known headers are accepted again.
+    BOOST_CHECK_EQUAL(process(std::vector<CBlockHeader>(headers.begin() + 1000, headers.end())), "");
+
+    // The headers before the first invalid one are stored.
+    const auto check_invalid = [&](std::vector<CBlockHeader> more, size_t invalid, const std::string& reason) {
+        for (size_t i = invalid + 1; i < more.size(); ++i) {
+            more[i].hashPrevBlock = more[i - 1].GetHash();
+            mine(more[i], true);
+        }
+        BOOST_CHECK_EQUAL(process(more), reason);
+        BOOST_CHECK(known(more[invalid - 1]));
+        BOOST_CHECK(!known(more[invalid]));
+        BOOST_CHECK(!known(more.back()));
+    };
+    auto more = make_headers(headers.back().GetHash(), headers.back().nTime, 600);
+    more[300].nTime = genesis.nTime;
+    mine(more[300], true);
+    check_invalid(more, 300, "time-too-old");
+
+    more = make_headers(headers.back().GetHash(), headers.back().nTime + 1000, 600);
+    mine(more[400], false);
+    check_invalid(more, 400, "high-hash");
+
+    more = make_headers(headers.back().GetHash(), headers.back().nTime + 2000, 600);
+    more[500].nBits = UintToArith256(consensus.powLimit).GetCompact() - 1;
+    mine(more[500], true);
+    check_invalid(more, 500, "bad-diffbits");
+
+    more = make_headers(headers.back().GetHash(), headers.back().nTime + 3000, 600);
+    more[200].hashPrevBlock = InsecureRand256();
+    mine(more[200], true);
+    check_invalid(more, 200, "prev-blk-not-found");
+    StopHeaderCheckThreads();
+}
 BOOST_AUTO_TEST_SUITE_END()
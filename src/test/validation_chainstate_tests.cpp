@@ -5,6 +5,10 @@
 #include <random.h>
 #include <uint256.h>
 #include <consensus/validation.h>
+#include <node/blockstorage.h>
+#include <node/coinstats.h>
+#include <script/standard.h>
+#include <txmempool.h>
 #include <sync.h>
 #include <test/util/setup_common.h>
 #include <validation.h>
@@ -72,4 +76,55 @@ BOOST_AUTO_TEST_CASE(validation_chainstate_resize_caches)
     WITH_LOCK(::cs_main, manager.Unload());
 }
 
+//! Test that a reorg of several blocks, which are disconnected together,
+//! restores the UTXO set and returns disconnected transactions to the mempool.
+BOOST_FIXTURE_TEST_CASE(validation_chainstate_reorg, TestChain100Setup)
+{
+    CChainState& chainstate = m_node.chainman->ActiveChainstate();
+    const CScript script = GetScriptForDestination(PKHash(coinbaseKey.GetPubKey()));
+    const auto utxo_hash = [&] {
+        chainstate.ForceFlushStateToDisk();
+        CCoinsStats stats{CoinStatsHashType::HASH_SERIALIZED};
+        BOOST_REQUIRE(GetUTXOStats(&chainstate.CoinsDB(), chainstate.m_blockman, stats, [] {}));
+        return stats.hashSerialized;
+    };
+    CBlockIndex* fork = WITH_LOCK(cs_main, return chainstate.m_chain.Tip());
+
+    // Build the chain we reorg to, and put it aside.
+    for (int i = 0; i < 7; ++i) {
+        CreateAndProcessBlock({}, script);
+    }
+    CBlockIndex* best_tip = WITH_LOCK(cs_main, return chainstate.m_chain.Tip());
+    const uint256 best_utxo_hash = utxo_hash();
+    CBlockIndex* best_first = WITH_LOCK(cs_main, return best_tip->GetAncestor(fork->nHeight + 1));
+    BlockValidationState state;
+    BOOST_REQUIRE(chainstate.InvalidateBlock(state, best_first));
+
+    // Build a shorter chain with transactions, where outputs created in one
+    // block are spent in the next.
+    std::vector<CTransactionRef> txs;
+    CTransactionRef prev = m_coinbase_txns[0];
+    for (int i = 0; i < 5; ++i) {
+        CMutableTransaction tx = CreateValidMempoolTransaction(prev, 0, i == 0 ? 1 : 0, coinbaseKey, script, 49 * COIN - i * 1000, /*submit=*/false);
+        CreateAndProcessBlock({tx}, script);
+        txs.push_back(MakeTransactionRef(tx));
+        prev = txs.back();
+    }
+    BOOST_CHECK_EQUAL(WITH_LOCK(cs_main, return chainstate.m_chain.Height()), fork->nHeight + 5);
+
+    // Reorg to the longer chain, reading the disconnected blocks in parallel.
+    StartBlockPrefetchThreads(2, DEFAULT_BLOCK_PREFETCH);
+    {
+        LOCK(cs_main);
+        chainstate.ResetBlockFailureFlags(best_first);
+    }
+    BOOST_REQUIRE(chainstate.ActivateBestChain(state));
+    StopBlockPrefetchThreads();
+    BOOST_CHECK_EQUAL(WITH_LOCK(cs_main, return chainstate.m_chain.Tip()), best_tip);
+    BOOST_CHECK(utxo_hash() == best_utxo_hash);
+    for (const auto& tx : txs) {
+        BOOST_CHECK(m_node.mempool->exists(tx->GetHash()));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
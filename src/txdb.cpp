@@ -11,10 +11,18 @@
 #include <shutdown.h>
 #include <uint256.h>
 #include <util/system.h>
+#include <util/thread.h>
+#include <util/threadpool.h>
 #include <util/translation.h>
 #include <util/vector.h>
 
+#include <deque>
+#include <exception>
+#include <future>
+#include <limits>
+#include <stdexcept>
 #include <stdint.h>
+#include <unordered_map>
 
 static constexpr uint8_t DB_COIN{'C'};
 static constexpr uint8_t DB_COINS{'c'};
@@ -80,7 +88,105 @@ std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
     return vhashHeadBlocks;
 }
 
+static ThreadPool g_coins_flush_pool{"coinsflush"};
+
+void StartCoinsFlushThreads(int threads_num)
+{
+    g_coins_flush_pool.Start(threads_num);
+}
+
+void StopCoinsFlushThreads()
+{
+    g_coins_flush_pool.Stop();
+}
+
+/** Minimum number of cache entries for a flush to be split across the coins flush threads */
+static constexpr size_t MIN_SHARDED_FLUSH_ENTRIES{16384};
+
+static Mutex g_crash_simulate_mutex;
+static FastRandomContext g_crash_simulate_rng GUARDED_BY(g_crash_simulate_mutex);
+
+static void MaybeSimulateCrash(int crash_simulate)
+{
+    if (crash_simulate) {
+        if (WITH_LOCK(g_crash_simulate_mutex, return g_crash_simulate_rng.randrange(crash_simulate)) == 0) {
+            LogPrintf("Simulating a crash. Goodbye.\n");
+            _Exit(0);
+        }
+    }
+}
+
+/**
+ * Serialize and write the dirty entries of mapCoins on the coins flush
+ * threads, returning the number of entries written. Entries are partitioned
+ * by the first byte of their txid, which follows the key prefix in the
+ * database, so every thread writes its own contiguous key range. Partial
+ * batches from different threads may be committed in any order: the head
+ * blocks marker must have been committed beforehand, so that an interrupted
+ * flush is replayed from the old tip on restart.
+ */
+static size_t WriteCoinsSharded(CDBWrapper& db, const CCoinsMap& mapCoins, size_t batch_size, int crash_simulate)
+{
+    const size_t shard_count = g_coins_flush_pool.WorkersCount();
+    std::vector<std::vector<const CCoinsMap::value_type*>> shards(shard_count);
+    for (const auto& entry : mapCoins) {
+        if (!(entry.second.flags & CCoinsCacheEntry::DIRTY)) continue;
+        shards[(size_t{*entry.first.hash.begin()} * shard_count) >> 8].push_back(&entry);
+    }
+
+    std::vector<std::future<void>> writes;
+    for (const auto& shard : shards) {
+        writes.push_back(g_coins_flush_pool.Submit([&db, &shard, batch_size, crash_simulate]() {
+            CDBBatch batch(db);
+            for (const CCoinsMap::value_type* entry : shard) {
+                CoinEntry key(&entry->first);
+                if (entry->second.coin.IsSpent()) {
+                    batch.Erase(key);
+                } else {
+                    batch.Write(key, entry->second.coin);
+                }
+                if (batch.SizeEstimate() > batch_size) {
+                    LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+                    db.WriteBatch(batch);
+                    batch.Clear();
+                    MaybeSimulateCrash(crash_simulate);
+                }
+            }
+            if (batch.SizeEstimate() > 0) {
+                db.WriteBatch(batch);
+            }
+        }));
+    }
+
+    // Wait for every shard before reporting an error, as the tasks refer to mapCoins.
+    std::exception_ptr error;
+    for (auto& write : writes) {
+        try {
+            write.get();
+        } catch (const std::future_error&) {
+            error = std::make_exception_ptr(std::runtime_error("Coins flush interrupted"));
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    if (error) std::rethrow_exception(error);
+
+    size_t changed = 0;
+    for (const auto& shard : shards) {
+        changed += shard.size();
+    }
+    return changed;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    return WriteCoinsMap(mapCoins, hashBlock, /*erase=*/true);
+}
+
+bool CCoinsViewDB::WriteCoins(CCoinsMap& mapCoins, const uint256& hashBlock) {
+    return WriteCoinsMap(mapCoins, hashBlock, /*erase=*/false);
+}
+
+bool CCoinsViewDB::WriteCoinsMap(CCoinsMap& mapCoins, const uint256& hashBlock, bool erase) {
     CDBBatch batch(*m_db);
     size_t count = 0;
     size_t changed = 0;
@@ -105,28 +211,31 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     batch.Erase(DB_BEST_BLOCK);
     batch.Write(DB_HEAD_BLOCKS, Vector(hashBlock, old_tip));
 
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            CoinEntry entry(&it->first);
-            if (it->second.coin.IsSpent())
-                batch.Erase(entry);
-            else
-                batch.Write(entry, it->second.coin);
-            changed++;
-        }
-        count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
-        if (batch.SizeEstimate() > batch_size) {
-            LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
-            m_db->WriteBatch(batch);
-            batch.Clear();
-            if (crash_simulate) {
-                static FastRandomContext rng;
-                if (rng.randrange(crash_simulate) == 0) {
-                    LogPrintf("Simulating a crash. Goodbye.\n");
-                    _Exit(0);
-                }
+    if (g_coins_flush_pool.IsRunning() && mapCoins.size() >= MIN_SHARDED_FLUSH_ENTRIES) {
+        // Commit the marker on its own before any coins, as the shards are
+        // written concurrently and in no particular order.
+        m_db->WriteBatch(batch);
+        batch.Clear();
+        changed = WriteCoinsSharded(*m_db, mapCoins, batch_size, crash_simulate);
+        count = mapCoins.size();
+        if (erase) mapCoins.clear();
+    } else {
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                CoinEntry entry(&it->first);
+                if (it->second.coin.IsSpent())
+                    batch.Erase(entry);
+                else
+                    batch.Write(entry, it->second.coin);
+                changed++;
+            }
+            count++;
+            it = erase ? mapCoins.erase(it) : std::next(it);
+            if (batch.SizeEstimate() > batch_size) {
+                LogPrint(BCLog::COINDB, "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+                m_db->WriteBatch(batch);
+                batch.Clear();
+                MaybeSimulateCrash(crash_simulate);
             }
         }
     }
@@ -141,6 +250,81 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return ret;
 }
 
+CCoinsViewBackgroundFlush::CCoinsViewBackgroundFlush(CCoinsViewDB& db) : CCoinsViewBacked(&db), m_db(db) {}
+
+CCoinsViewBackgroundFlush::~CCoinsViewBackgroundFlush()
+{
+    Sync();
+}
+
+bool CCoinsViewBackgroundFlush::GetCoin(const COutPoint& outpoint, Coin& coin) const
+{
+    if (m_frozen) {
+        const CCoinsMap& frozen = *m_frozen;
+        CCoinsMap::const_iterator it = frozen.find(outpoint);
+        if (it != frozen.end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    return m_db.GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewBackgroundFlush::HaveCoin(const COutPoint& outpoint) const
+{
+    if (m_frozen) {
+        const CCoinsMap& frozen = *m_frozen;
+        CCoinsMap::const_iterator it = frozen.find(outpoint);
+        if (it != frozen.end()) return !it->second.coin.IsSpent();
+    }
+    return m_db.HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewBackgroundFlush::GetBestBlock() const
+{
+    // While a write is in progress the database is marked as being in transition.
+    if (HasPendingWrite()) return m_frozen_best_block;
+    return m_db.GetBestBlock();
+}
+
+bool CCoinsViewBackgroundFlush::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    if (!Sync()) return false;
+    if (!m_background) return m_db.BatchWrite(mapCoins, hashBlock);
+
+    // Take over the entries without copying them; the caller clears what is left of mapCoins.
+    m_frozen = std::make_unique<CCoinsMap>(std::move(mapCoins));
+    m_frozen_best_block = hashBlock;
+    m_write_ok = false;
+    m_writing = true;
+    m_writer = std::thread(&util::TraceThread, "coinsbgflush", [this] {
+        try {
+            m_write_ok = m_db.WriteCoins(*m_frozen, m_frozen_best_block);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: Failed to write coins in the background: %s\n", __func__, e.what());
+        }
+        m_writing = false;
+    });
+    return true;
+}
+
+std::unique_ptr<CCoinsViewCursor> CCoinsViewBackgroundFlush::Cursor() const
+{
+    if (HasPendingWrite()) {
+        throw std::logic_error("Coin database cursor not supported during a background flush.");
+    }
+    return m_db.Cursor();
+}
+
+bool CCoinsViewBackgroundFlush::Sync()
+{
+    if (!HasPendingWrite()) return true;
+    m_writer.join();
+    m_frozen.reset();
+    m_frozen_best_block.SetNull();
+    return m_write_ok;
+}
+
 size_t CCoinsViewDB::EstimateSize() const
 {
     return m_db->EstimateSize(DB_COIN, uint8_t(DB_COIN + 1));
@@ -194,11 +378,19 @@ private:
 
 std::unique_ptr<CCoinsViewCursor> CCoinsViewDB::Cursor() const
 {
-    auto i = std::make_unique<CCoinsViewDBCursor>(
-        const_cast<CDBWrapper&>(*m_db).NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
+    std::unique_ptr<CDBIterator> pcursor{const_cast<CDBWrapper&>(*m_db).NewIterator()};
+    // Read the best block from the same snapshot as the coins, so that it is
+    // null if the snapshot was taken while a flush was being written.
+    uint256 hashBestChain;
+    uint8_t key;
+    pcursor->Seek(DB_BEST_BLOCK);
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key != DB_BEST_BLOCK || !pcursor->GetValue(hashBestChain)) {
+        hashBestChain.SetNull();
+    }
+    auto i = std::make_unique<CCoinsViewDBCursor>(pcursor.release(), hashBestChain);
     i->pcursor->Seek(DB_COIN);
     // Cache key of first record
     if (i->pcursor->Valid()) {
@@ -271,46 +463,287 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+/** Number of block index records decoded together by one thread */
+static constexpr size_t BLOCKINDEX_LOAD_CHUNK_SIZE{4096};
+
+namespace {
+//! Block index records read from the database, and what decoding them produced.
+struct BlockIndexChunk {
+    std::vector<CDataStream> values;
+    std::vector<CDiskBlockIndex> indexes;
+    std::vector<uint256> hashes;
+    //! Why decoding failed, empty on success.
+    std::string error;
+};
+} // namespace
+
+/** Deserialize the records of a chunk and check their proof of work. Touches no shared state. */
+static void DecodeBlockIndexChunk(BlockIndexChunk& chunk, const Consensus::Params& consensusParams)
+{
+    chunk.indexes.resize(chunk.values.size());
+    chunk.hashes.reserve(chunk.values.size());
+    for (size_t i = 0; i < chunk.values.size(); ++i) {
+        CDiskBlockIndex& diskindex = chunk.indexes[i];
+        try {
+            chunk.values[i] >> diskindex;
+        } catch (const std::exception&) {
+            chunk.error = "failed to read value";
+            return;
+        }
+        chunk.hashes.push_back(diskindex.GetBlockHash());
+        if (!CheckProofOfWork(chunk.hashes.back(), diskindex.nBits, consensusParams)) {
+            chunk.error = strprintf("CheckProofOfWork failed: %s", diskindex.ToString());
+            return;
+        }
+    }
+    chunk.values.clear();
+}
+
+/**
+ * Read the block index records in chunks, decode and check them on the given
+ * pool (or right away if it is not running) and insert them in database order.
+ */
+static bool LoadBlockIndexRecords(CDBIterator& cursor, ThreadPool& pool, const Consensus::Params& consensusParams, const std::function<CBlockIndex*(const uint256&)>& insertBlockIndex)
+{
+    std::deque<std::future<std::shared_ptr<BlockIndexChunk>>> decoding;
+    const size_t max_decoding = 2 * pool.WorkersCount();
+
+    const auto insert_chunk = [&](const BlockIndexChunk& chunk) {
+        if (!chunk.error.empty()) return error("LoadBlockIndexGuts: %s", chunk.error);
+        for (size_t i = 0; i < chunk.indexes.size(); ++i) {
+            const CDiskBlockIndex& diskindex = chunk.indexes[i];
+            // Construct block index object
+            CBlockIndex* pindexNew = insertBlockIndex(chunk.hashes[i]);
+            pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+        }
+        return true;
+    };
+    const auto insert_oldest = [&]() {
+        std::shared_ptr<BlockIndexChunk> chunk;
+        try {
+            chunk = decoding.front().get();
+        } catch (const std::future_error&) {
+            return error("LoadBlockIndexGuts: decoding interrupted");
+        }
+        decoding.pop_front();
+        return insert_chunk(*chunk);
+    };
+    const auto submit = [&](std::shared_ptr<BlockIndexChunk> chunk) {
+        if (!pool.IsRunning()) {
+            DecodeBlockIndexChunk(*chunk, consensusParams);
+            return insert_chunk(*chunk);
+        }
+        decoding.push_back(pool.Submit([chunk, &consensusParams]() {
+            DecodeBlockIndexChunk(*chunk, consensusParams);
+            return chunk;
+        }));
+        return decoding.size() < max_decoding || insert_oldest();
+    };
+
+    auto chunk = std::make_shared<BlockIndexChunk>();
+    while (cursor.Valid()) {
+        if (ShutdownRequested()) return false;
+        std::pair<uint8_t, uint256> key;
+        if (!cursor.GetKey(key) || key.first != DB_BLOCK_INDEX) break;
+        if (!cursor.GetValueStream(chunk->values.emplace_back(SER_DISK, CLIENT_VERSION))) {
+            return error("%s: failed to read value", __func__);
+        }
+        if (chunk->values.size() == BLOCKINDEX_LOAD_CHUNK_SIZE) {
+            if (!submit(std::move(chunk))) return false;
+            chunk = std::make_shared<BlockIndexChunk>();
+        }
+        cursor.Next();
+    }
+    if (!chunk->values.empty() && !submit(std::move(chunk))) return false;
+    while (!decoding.empty()) {
+        if (!insert_oldest()) return false;
+    }
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
 
     pcursor->Seek(std::make_pair(DB_BLOCK_INDEX, uint256()));
 
-    // Load m_block_index
-    while (pcursor->Valid()) {
-        if (ShutdownRequested()) return false;
-        std::pair<uint8_t, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
+    // Load m_block_index. Records are decoded and their proof of work checked
+    // in parallel, but inserted on this thread, in order.
+    ThreadPool pool{"loadidx"};
+    const int threads_num = std::min(GetNumCores(), MAX_BLOCKINDEX_LOAD_THREADS);
+    if (threads_num > 1) pool.Start(threads_num);
+    bool ret;
+    try {
+        ret = LoadBlockIndexRecords(*pcursor, pool, consensusParams, insertBlockIndex);
+    } catch (...) {
+        pool.Stop();
+        throw;
+    }
+    pool.Stop();
+    return ret;
+}
+
+/** Version of the block index snapshot file format */
+static constexpr uint64_t BLOCKINDEX_SNAPSHOT_VERSION{1};
+/** Parent position of entries without a parent in the block index snapshot */
+static constexpr uint32_t BLOCKINDEX_SNAPSHOT_NO_PREV{std::numeric_limits<uint32_t>::max()};
+
+/*
+ * A block index snapshot file consists of the format version, the genesis
+ * block hash and the number of entries, followed by the entries in database
+ * order. Every entry is its block hash, the position of its parent entry and
+ * the entry as it would be written to the database.
+ */
+
+bool CBlockTreeDB::WriteBlockIndexSnapshot(const fs::path& path, const std::vector<const CBlockIndex*>& entries, const uint256& genesis_hash)
+{
+    std::unordered_map<const CBlockIndex*, uint32_t> positions;
+    positions.reserve(entries.size());
+    for (const CBlockIndex* pindex : entries) {
+        positions.emplace(pindex, positions.size());
+    }
+
+    const fs::path path_new = fs::path(path.string() + ".new");
+    try {
+        CAutoFile file(fsbridge::fopen(path_new, "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            return error("%s: failed to open %s", __func__, path_new.string());
+        }
+        file << BLOCKINDEX_SNAPSHOT_VERSION << genesis_hash << uint64_t{entries.size()};
+        for (const CBlockIndex* pindex : entries) {
+            const uint32_t prev = pindex->pprev ? positions.at(pindex->pprev) : BLOCKINDEX_SNAPSHOT_NO_PREV;
+            file << pindex->GetBlockHash() << prev << CDiskBlockIndex(pindex);
+        }
+        if (!FileCommit(file.Get())) {
+            return error("%s: failed to commit %s", __func__, path_new.string());
+        }
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
+    if (!RenameOver(path_new, path)) {
+        return error("%s: failed to rename %s", __func__, path_new.string());
+    }
+    return true;
+}
+
+bool CBlockTreeDB::LoadBlockIndexSnapshot(const std::vector<unsigned char>& data, const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+{
+    try {
+        VectorReader stream(SER_DISK, CLIENT_VERSION, data, 0);
+        uint64_t version;
+        uint256 genesis_hash;
+        uint64_t count;
+        stream >> version;
+        if (version != BLOCKINDEX_SNAPSHOT_VERSION) return error("%s: unknown version %d", __func__, version);
+        stream >> genesis_hash >> count;
+        if (genesis_hash != consensusParams.hashGenesisBlock) return error("%s: wrong genesis block", __func__);
+        // Every entry takes more than 64 bytes; don't trust count any further.
+        if (count > data.size() / 64) return error("%s: invalid entry count", __func__);
+
+        std::vector<CBlockIndex*> entries;
+        std::vector<std::pair<uint32_t, uint256>> parents;
+        entries.reserve(count);
+        parents.reserve(count);
+        for (uint64_t i = 0; i < count; ++i) {
+            uint256 hash;
+            uint32_t prev;
             CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, consensusParams))
-                    return error("%s: CheckProofOfWork failed: %s", __func__, pindexNew->ToString());
-
-                pcursor->Next();
-            } else {
-                return error("%s: failed to read value", __func__);
+            stream >> hash >> prev >> diskindex;
+            // Construct block index object
+            CBlockIndex* pindexNew = insertBlockIndex(hash);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+            entries.push_back(pindexNew);
+            parents.emplace_back(prev, diskindex.hashPrev);
+        }
+        if (!stream.empty()) return error("%s: unexpected data after the last entry", __func__);
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const auto& [prev, hash_prev] = parents[i];
+            if (prev == BLOCKINDEX_SNAPSHOT_NO_PREV) {
+                if (!hash_prev.IsNull()) return error("%s: missing parent of %s", __func__, entries[i]->GetBlockHash().ToString());
+                continue;
             }
-        } else {
-            break;
+            if (prev >= entries.size() || entries[prev]->GetBlockHash() != hash_prev) {
+                return error("%s: wrong parent of %s", __func__, entries[i]->GetBlockHash().ToString());
+            }
+            entries[i]->pprev = entries[prev];
         }
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
     }
+    return true;
+}
 
+bool CBlockTreeDB::CheckBlockIndexSnapshot(const std::vector<unsigned char>& data, const Consensus::Params& consensusParams)
+{
+    try {
+        VectorReader stream(SER_DISK, CLIENT_VERSION, data, 0);
+        uint64_t version;
+        uint256 genesis_hash;
+        uint64_t count;
+        stream >> version >> genesis_hash >> count;
+
+        std::unique_ptr<CDBIterator> pcursor(NewIterator());
+        pcursor->Seek(std::make_pair(DB_BLOCK_INDEX, uint256()));
+        for (uint64_t i = 0; i < count; ++i) {
+            uint256 hash;
+            uint32_t prev;
+            CDiskBlockIndex expected;
+            stream >> hash >> prev >> expected;
+
+            std::pair<uint8_t, uint256> key;
+            CDiskBlockIndex diskindex;
+            if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_BLOCK_INDEX || key.second != hash) {
+                return error("%s: %s is not in the database in that place", __func__, hash.ToString());
+            }
+            if (!pcursor->GetValue(diskindex)) {
+                return error("%s: failed to read value", __func__);
+            }
+            // Compare what was loaded; the serialization of an entry also
+            // depends on the version of the client that wrote it.
+            if (diskindex.GetBlockHash() != hash ||
+                diskindex.hashPrev != expected.hashPrev ||
+                diskindex.nHeight != expected.nHeight ||
+                diskindex.nStatus != expected.nStatus ||
+                diskindex.nTx != expected.nTx ||
+                diskindex.nFile != expected.nFile ||
+                diskindex.nDataPos != expected.nDataPos ||
+                diskindex.nUndoPos != expected.nUndoPos) {
+                return error("%s: %s differs from the database", __func__, hash.ToString());
+            }
+            if (!CheckProofOfWork(hash, diskindex.nBits, consensusParams)) {
+                return error("%s: CheckProofOfWork failed: %s", __func__, diskindex.ToString());
+            }
+            pcursor->Next();
+        }
+        std::pair<uint8_t, uint256> key;
+        if (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
+            return error("%s: %s is missing from the snapshot", __func__, key.second.ToString());
+        }
+    } catch (const std::exception& e) {
+        return error("%s: %s", __func__, e.what());
+    }
     return true;
 }
 
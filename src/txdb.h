@@ -11,8 +11,10 @@
 #include <chain.h>
 #include <primitives/block.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -39,6 +41,14 @@ static const int64_t max_filter_index_cache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
 
+//! -coinsflushthreads default (threads writing the coins cache to the database, 0 = disabled)
+static const int DEFAULT_COINSFLUSH_THREADS = 4;
+//! Maximum number of threads writing the coins cache to the database
+static const int MAX_COINSFLUSH_THREADS = 32;
+
+//! Maximum number of threads decoding and checking block index records at startup
+static const int MAX_BLOCKINDEX_LOAD_THREADS = 8;
+
 // Actually declared in validation.cpp; can't include because of circular dependency.
 extern RecursiveMutex cs_main;
 
@@ -60,6 +70,8 @@ public:
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
+    //! Like BatchWrite, but leaves the entries of mapCoins in place, so that others may read from it concurrently.
+    bool WriteCoins(CCoinsMap& mapCoins, const uint256& hashBlock);
     std::unique_ptr<CCoinsViewCursor> Cursor() const override;
 
     //! Attempt to update from an older database format. Returns whether an error occurred.
@@ -68,8 +80,64 @@ public:
 
     //! Dynamically alter the underlying leveldb cache size.
     void ResizeCache(size_t new_cache_size) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
+private:
+    bool WriteCoinsMap(CCoinsMap& mapCoins, const uint256& hashBlock, bool erase);
+};
+
+/**
+ * CCoinsView layer on top of the coin database which can write cache flushes
+ * on a background thread (see -coinsbackgroundflush).
+ *
+ * In background mode, BatchWrite takes over the flushed entries as a frozen
+ * snapshot and returns immediately. Until the write has completed, lookups
+ * are answered from the snapshot before falling back to the database, so a
+ * cache on top of this view can continue validating from an empty state.
+ * The snapshot is never modified while it is being written, which allows
+ * GetCoin and HaveCoin to be called from several threads at once; all other
+ * calls must be serialized by the caller (in practice, by holding cs_main).
+ */
+class CCoinsViewBackgroundFlush final : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB& m_db;
+    bool m_background{false};
+
+    std::unique_ptr<CCoinsMap> m_frozen;
+    uint256 m_frozen_best_block;
+    std::thread m_writer;
+    std::atomic<bool> m_writing{false};
+    bool m_write_ok{true};
+
+public:
+    explicit CCoinsViewBackgroundFlush(CCoinsViewDB& db);
+    ~CCoinsViewBackgroundFlush();
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const override;
+    bool HaveCoin(const COutPoint& outpoint) const override;
+    uint256 GetBestBlock() const override;
+    //! Waits for any previous background write, then writes mapCoins either in the background or synchronously.
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) override;
+    std::unique_ptr<CCoinsViewCursor> Cursor() const override;
+
+    //! Select whether the following calls to BatchWrite return before the write has completed.
+    void SetBackground(bool background) { m_background = background; }
+
+    //! Whether a background write was started and has not been waited for with Sync yet.
+    bool HasPendingWrite() const { return m_writer.joinable(); }
+
+    //! Whether a background write is still in progress.
+    bool IsWriting() const { return m_writing; }
+
+    //! Wait for a pending background write, drop its snapshot and return whether it succeeded.
+    bool Sync();
 };
 
+/** Run threads serializing and writing coins cache flushes to the coins database */
+void StartCoinsFlushThreads(int threads_num);
+/** Stop all of the coins flush threads */
+void StopCoinsFlushThreads();
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
@@ -84,6 +152,24 @@ public:
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+
+    /**
+     * Write entries, which must be sorted by block hash like the database
+     * keys, to a flat snapshot file at path, replacing any existing one.
+     */
+    static bool WriteBlockIndexSnapshot(const fs::path& path, const std::vector<const CBlockIndex*>& entries, const uint256& genesis_hash);
+    /**
+     * Load the block index from the snapshot file contents in data, in one
+     * pass and without hashing or looking up parents. Unlike
+     * LoadBlockIndexGuts it doesn't check proof of work; call
+     * CheckBlockIndexSnapshot with the same data for that.
+     */
+    static bool LoadBlockIndexSnapshot(const std::vector<unsigned char>& data, const Consensus::Params& consensusParams, std::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    /**
+     * Check that the snapshot file contents in data have the same entries as
+     * the database, and that their proof of work is valid.
+     */
+    bool CheckBlockIndexSnapshot(const std::vector<unsigned char>& data, const Consensus::Params& consensusParams);
 };
 
 #endif // BITCOIN_TXDB_H
@@ -21,6 +21,34 @@
 #include <cmath>
 #include <optional>
 
+/** Order links by the txid of the entries, like CompareIteratorByHash */
+static bool CompareLinkByHash(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)
+{
+    return a->GetTx().GetHash() < b->GetTx().GetHash();
+}
+
+std::pair<CTxMemPoolEntryLinks::const_iterator, bool> CTxMemPoolEntryLinks::insert(const CTxMemPoolEntry& entry)
+{
+    auto it = std::lower_bound(m_links.begin(), m_links.end(), &entry, CompareLinkByHash);
+    if (it != m_links.end() && !CompareLinkByHash(&entry, *it)) return {const_iterator(it), false};
+    return {const_iterator(m_links.insert(it, &entry)), true};
+}
+
+size_t CTxMemPoolEntryLinks::erase(const CTxMemPoolEntry& entry)
+{
+    auto it = std::lower_bound(m_links.begin(), m_links.end(), &entry, CompareLinkByHash);
+    if (it == m_links.end() || CompareLinkByHash(&entry, *it)) return 0;
+    m_links.erase(it);
+    // Erasing does not release memory, so move the links back inline once they fit
+    if (m_links.size() <= INLINE_LINKS && m_links.capacity() > INLINE_LINKS) m_links.shrink_to_fit();
+    return 1;
+}
+
+size_t CTxMemPoolEntryLinks::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(m_links);
+}
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp)
@@ -61,8 +89,8 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    CTxMemPoolEntry::Children stageEntries, descendants;
-    stageEntries = updateIt->GetMemPoolChildrenConst();
+    const CTxMemPoolEntry::Children& children = updateIt->GetMemPoolChildrenConst();
+    CTxMemPoolEntry::EntrySet stageEntries(children.begin(), children.end()), descendants;
 
     while (!stageEntries.empty()) {
         const CTxMemPoolEntry& descendant = *stageEntries.begin();
@@ -109,6 +137,8 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
 void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
 {
     AssertLockHeld(cs);
+    // Re-added transactions may have descendants that were added before them
+    ResetAdditions();
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
@@ -144,6 +174,9 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
                 if (!visited(childIter) && !setAlreadyIncluded.count(childHash)) {
                     UpdateChild(it, childIter, true);
                     UpdateParent(childIter, it, true);
+                    if (it->m_cluster_id == 0 || childIter->m_cluster_id != it->m_cluster_id) {
+                        MergeClusters({GetCluster(it), GetCluster(childIter)});
+                    }
                 }
             }
         } // release epoch guard for UpdateForDescendants
@@ -153,7 +186,7 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
-    CTxMemPoolEntry::Parents staged_ancestors;
+    CTxMemPoolEntry::EntrySet staged_ancestors;
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -174,7 +207,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        staged_ancestors = it->GetMemPoolParentsConst();
+        const CTxMemPoolEntry::Parents& parents = it->GetMemPoolParentsConst();
+        staged_ancestors.insert(parents.begin(), parents.end());
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
@@ -355,6 +389,12 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+void CTxMemPool::ResetAdditions()
+{
+    m_additions.clear();
+    ++m_additions_reset;
+}
+
 void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, setEntries &setAncestors, bool validFeeEstimate)
 {
     // Add to memory pool without checking anything.
@@ -396,6 +436,14 @@ void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, setEntries &setAnces
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
 
+    // Join the clusters of the parents, which this tx connects. Without
+    // parents it is a cluster of its own.
+    std::set<uint64_t> parent_clusters;
+    for (const CTxMemPoolEntry& parent : newit->GetMemPoolParentsConst()) {
+        parent_clusters.insert(GetCluster(mapTx.iterator_to(parent)));
+    }
+    if (!parent_clusters.empty()) AddToCluster(MergeClusters(parent_clusters), newit);
+
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
     m_total_fee += entry.GetFee();
@@ -405,6 +453,7 @@ void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, setEntries &setAnces
 
     vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
+    m_additions.push_back(newit);
 }
 
 void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
@@ -439,9 +488,11 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     totalTxSize -= it->GetTxSize();
     m_total_fee -= it->GetFee();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(it->GetMemPoolParentsConst()) + memusage::DynamicUsage(it->GetMemPoolChildrenConst());
+    cachedInnerUsage -= it->GetMemPoolParentsConst().DynamicMemoryUsage() + it->GetMemPoolChildrenConst().DynamicMemoryUsage();
+    RemoveFromCluster(it);
     mapTx.erase(it);
     nTransactionsUpdated++;
+    ResetAdditions();
     if (minerPolicyEstimator) {minerPolicyEstimator->removeTx(hash, false);}
 }
 
@@ -579,14 +630,16 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
     }
     // Before the txs in the new block have been removed from the mempool, update policy estimates
     if (minerPolicyEstimator) {minerPolicyEstimator->processBlock(nBlockHeight, entries);}
+    // Remove all confirmed transactions at once, so that clusters confirmed
+    // entirely are recognized as such. Their in-mempool ancestors are in the
+    // block too, and no other transaction conflicts with them.
+    setEntries stage;
+    for (const CTxMemPoolEntry* entry : entries) {
+        stage.insert(mapTx.iterator_to(*entry));
+    }
+    RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
     for (const auto& tx : vtx)
     {
-        txiter it = mapTx.find(tx->GetHash());
-        if (it != mapTx.end()) {
-            setEntries stage;
-            stage.insert(it);
-            RemoveStaged(stage, true, MemPoolRemovalReason::BLOCK);
-        }
         removeConflicts(*tx);
         ClearPrioritisation(tx->GetHash());
     }
@@ -605,6 +658,9 @@ void CTxMemPool::_clear()
     blockSinceLastRollingFeeBump = false;
     rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
+    ResetAdditions();
+    m_clusters.clear();
+    m_dirty_clusters.clear();
 }
 
 void CTxMemPool::clear()
@@ -647,9 +703,9 @@ void CTxMemPool::check(CChainState& active_chainstate) const
         check_total_fee += it->GetFee();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        innerUsage += memusage::DynamicUsage(it->GetMemPoolParentsConst()) + memusage::DynamicUsage(it->GetMemPoolChildrenConst());
+        innerUsage += it->GetMemPoolParentsConst().DynamicMemoryUsage() + it->GetMemPoolChildrenConst().DynamicMemoryUsage();
         bool fDependsWait = false;
-        CTxMemPoolEntry::Parents setParentCheck;
+        CTxMemPoolEntry::EntrySet setParentCheck;
         for (const CTxIn &txin : tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
             indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
@@ -695,7 +751,7 @@ void CTxMemPool::check(CChainState& active_chainstate) const
         assert(it->GetModFeesWithAncestors() == nFeesCheck);
 
         // Check children against mapNextTx
-        CTxMemPoolEntry::Children setChildrenCheck;
+        CTxMemPoolEntry::EntrySet setChildrenCheck;
         auto iter = mapNextTx.lower_bound(COutPoint(it->GetTx().GetHash(), 0));
         uint64_t child_sizes = 0;
         for (; iter != mapNextTx.end() && iter->first->hash == it->GetTx().GetHash(); ++iter) {
@@ -711,6 +767,19 @@ void CTxMemPool::check(CChainState& active_chainstate) const
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= child_sizes + it->GetTxSize());
 
+        // Check that parents and children are in the same cluster
+        if (it->m_cluster_id == 0) {
+            assert(it->GetMemPoolParentsConst().empty() && it->GetMemPoolChildrenConst().empty());
+        } else {
+            assert(m_clusters.at(it->m_cluster_id).at(it->m_cluster_idx) == it);
+        }
+        for (const CTxMemPoolEntry& parent : it->GetMemPoolParentsConst()) {
+            assert(parent.m_cluster_id == it->m_cluster_id);
+        }
+        for (const CTxMemPoolEntry& child : it->GetMemPoolChildrenConst()) {
+            assert(child.m_cluster_id == it->m_cluster_id);
+        }
+
         if (fDependsWait)
             waitingOnDependants.push_back(&(*it));
         else {
@@ -738,6 +807,34 @@ void CTxMemPool::check(CChainState& active_chainstate) const
         assert(&tx == it->second);
     }
 
+    // Check that every entry without a cluster of its own is in exactly one
+    // cluster, and that clusters that are not dirty are connected
+    size_t cluster_entries = 0;
+    for (const auto& [cluster_id, cluster] : m_clusters) {
+        assert(cluster.size() > 1);
+        innerUsage += memusage::DynamicUsage(cluster);
+        cluster_entries += cluster.size();
+        if (m_dirty_clusters.count(cluster_id)) continue;
+        setEntries connected{cluster.front()};
+        std::vector<txiter> stack{cluster.front()};
+        while (!stack.empty()) {
+            const txiter it = stack.back();
+            stack.pop_back();
+            assert(it->m_cluster_id == cluster_id);
+            for (const CTxMemPoolEntry& parent : it->GetMemPoolParentsConst()) {
+                if (connected.insert(mapTx.iterator_to(parent)).second) stack.push_back(mapTx.iterator_to(parent));
+            }
+            for (const CTxMemPoolEntry& child : it->GetMemPoolChildrenConst()) {
+                if (connected.insert(mapTx.iterator_to(child)).second) stack.push_back(mapTx.iterator_to(child));
+            }
+        }
+        assert(connected.size() == cluster.size());
+    }
+    assert(cluster_entries == size_t(std::count_if(mapTx.begin(), mapTx.end(), [](const CTxMemPoolEntry& entry) { return entry.m_cluster_id != 0; })));
+    for (uint64_t cluster_id : m_dirty_clusters) {
+        assert(m_clusters.count(cluster_id));
+    }
+
     assert(totalTxSize == checkTotal);
     assert(m_total_fee == check_total_fee);
     assert(innerUsage == cachedInnerUsage);
@@ -864,6 +961,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
             ++nTransactionsUpdated;
+            ResetAdditions();
         }
     }
     LogPrintf("PrioritiseTransaction: %s feerate += %s\n", hash.ToString(), FormatMoney(nFeeDelta));
@@ -951,7 +1049,9 @@ void CCoinsViewMemPool::PackageAddTransaction(const CTransactionRef& tx)
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
     // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    // The entries of each cluster are counted in cachedInnerUsage.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxHashes) +
+           memusage::DynamicUsage(m_additions) + memusage::DynamicUsage(m_clusters) + memusage::DynamicUsage(m_dirty_clusters) + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveUnbroadcastTx(const uint256& txid, const bool unchecked) {
@@ -965,12 +1065,147 @@ void CTxMemPool::RemoveUnbroadcastTx(const uint256& txid, const bool unchecked)
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
-    UpdateForRemoveFromMempool(stage, updateDescendants);
+    std::map<uint64_t, size_t> staged_per_cluster;
+    for (txiter it : stage) {
+        if (it->m_cluster_id != 0) ++staged_per_cluster[it->m_cluster_id];
+    }
+    // A block usually confirms whole packages. Split the dirty clusters it
+    // removes part of first, so that those packages are recognized as whole
+    // clusters below. This costs at most as much as updating the descendants
+    // of the removed entries does, and only happens once per block.
+    if (updateDescendants) {
+        bool split = false;
+        for (const auto& [cluster_id, staged_count] : staged_per_cluster) {
+            if (staged_count < m_clusters.at(cluster_id).size() && m_dirty_clusters.count(cluster_id)) {
+                SplitCluster(cluster_id);
+                split = true;
+            }
+        }
+        if (split) {
+            staged_per_cluster.clear();
+            for (txiter it : stage) {
+                if (it->m_cluster_id != 0) ++staged_per_cluster[it->m_cluster_id];
+            }
+        }
+    }
+    // Entries of clusters that are removed entirely, including those without
+    // a cluster of their own, have no ancestors or descendants left to update.
+    setEntries to_update;
+    for (txiter it : stage) {
+        if (it->m_cluster_id != 0 && staged_per_cluster[it->m_cluster_id] < m_clusters.at(it->m_cluster_id).size()) {
+            to_update.insert(it);
+        }
+    }
+    UpdateForRemoveFromMempool(to_update, updateDescendants);
     for (txiter it : stage) {
         removeUnchecked(it, reason);
     }
 }
 
+uint64_t CTxMemPool::GetCluster(txiter it)
+{
+    AssertLockHeld(cs);
+    if (it->m_cluster_id == 0) AddToCluster(m_next_cluster_id++, it);
+    return it->m_cluster_id;
+}
+
+void CTxMemPool::AddToCluster(uint64_t cluster_id, txiter it)
+{
+    AssertLockHeld(cs);
+    std::vector<txiter>& cluster = m_clusters[cluster_id];
+    cachedInnerUsage -= memusage::DynamicUsage(cluster);
+    it->m_cluster_id = cluster_id;
+    it->m_cluster_idx = cluster.size();
+    cluster.push_back(it);
+    cachedInnerUsage += memusage::DynamicUsage(cluster);
+}
+
+void CTxMemPool::RemoveFromCluster(txiter it)
+{
+    AssertLockHeld(cs);
+    if (it->m_cluster_id == 0) return;
+    auto cluster_it = m_clusters.find(it->m_cluster_id);
+    std::vector<txiter>& cluster = cluster_it->second;
+    cachedInnerUsage -= memusage::DynamicUsage(cluster);
+    cluster[it->m_cluster_idx] = cluster.back();
+    cluster[it->m_cluster_idx]->m_cluster_idx = it->m_cluster_idx;
+    cluster.pop_back();
+    if (cluster.size() == 1) {
+        // The last entry is left without links
+        cluster.front()->m_cluster_id = 0;
+        cluster.front()->m_cluster_idx = 0;
+        m_dirty_clusters.erase(cluster_it->first);
+        m_clusters.erase(cluster_it);
+        return;
+    }
+    if (cluster.size() * 2 < cluster.capacity()) {
+        cluster.shrink_to_fit();
+    }
+    cachedInnerUsage += memusage::DynamicUsage(cluster);
+    // Removing an entry that is linked to at most one other cannot disconnect
+    // the rest. Its links may still include entries that are being removed
+    // with it, which only errs on the side of splitting.
+    if (it->GetMemPoolParentsConst().size() + it->GetMemPoolChildrenConst().size() > 1) {
+        m_dirty_clusters.insert(cluster_it->first);
+    }
+}
+
+uint64_t CTxMemPool::MergeClusters(const std::set<uint64_t>& cluster_ids)
+{
+    AssertLockHeld(cs);
+    uint64_t target_id = *cluster_ids.begin();
+    for (uint64_t cluster_id : cluster_ids) {
+        if (m_clusters.at(cluster_id).size() > m_clusters.at(target_id).size()) target_id = cluster_id;
+    }
+    for (uint64_t cluster_id : cluster_ids) {
+        if (cluster_id == target_id) continue;
+        auto cluster = m_clusters.find(cluster_id);
+        for (txiter it : cluster->second) {
+            AddToCluster(target_id, it);
+        }
+        cachedInnerUsage -= memusage::DynamicUsage(cluster->second);
+        if (m_dirty_clusters.erase(cluster_id)) m_dirty_clusters.insert(target_id);
+        m_clusters.erase(cluster);
+    }
+    return target_id;
+}
+
+void CTxMemPool::SplitCluster(uint64_t cluster_id)
+{
+    AssertLockHeld(cs);
+    auto dirty = m_clusters.find(cluster_id);
+    const std::vector<txiter> entries = std::move(dirty->second);
+    cachedInnerUsage -= memusage::DynamicUsage(entries);
+    m_clusters.erase(dirty);
+    m_dirty_clusters.erase(cluster_id);
+
+    WITH_FRESH_EPOCH(m_epoch);
+    for (txiter entry : entries) {
+        if (visited(entry)) continue;
+        // Collect everything connected to this entry into a new cluster
+        const uint64_t new_id = m_next_cluster_id++;
+        AddToCluster(new_id, entry);
+        const std::vector<txiter>& cluster = m_clusters.at(new_id);
+        for (size_t i = 0; i < cluster.size(); ++i) {
+            const txiter it = cluster[i];
+            for (const CTxMemPoolEntry& parent : it->GetMemPoolParentsConst()) {
+                const txiter parent_it = mapTx.iterator_to(parent);
+                if (!visited(parent_it)) AddToCluster(new_id, parent_it);
+            }
+            for (const CTxMemPoolEntry& child : it->GetMemPoolChildrenConst()) {
+                const txiter child_it = mapTx.iterator_to(child);
+                if (!visited(child_it)) AddToCluster(new_id, child_it);
+            }
+        }
+        if (cluster.size() == 1) {
+            cachedInnerUsage -= memusage::DynamicUsage(cluster);
+            entry->m_cluster_id = 0;
+            entry->m_cluster_idx = 0;
+            m_clusters.erase(new_id);
+        }
+    }
+}
+
 int CTxMemPool::Expire(std::chrono::seconds time)
 {
     AssertLockHeld(cs);
@@ -1000,23 +1235,27 @@ void CTxMemPool::addUnchecked(const CTxMemPoolEntry &entry, bool validFeeEstimat
 void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
 {
     AssertLockHeld(cs);
-    CTxMemPoolEntry::Children s;
-    if (add && entry->GetMemPoolChildren().insert(*child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && entry->GetMemPoolChildren().erase(*child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    CTxMemPoolEntry::Children& children = entry->GetMemPoolChildren();
+    cachedInnerUsage -= children.DynamicMemoryUsage();
+    if (add) {
+        children.insert(*child);
+    } else {
+        children.erase(*child);
     }
+    cachedInnerUsage += children.DynamicMemoryUsage();
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
     AssertLockHeld(cs);
-    CTxMemPoolEntry::Parents s;
-    if (add && entry->GetMemPoolParents().insert(*parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && entry->GetMemPoolParents().erase(*parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    CTxMemPoolEntry::Parents& parents = entry->GetMemPoolParents();
+    cachedInnerUsage -= parents.DynamicMemoryUsage();
+    if (add) {
+        parents.insert(*parent);
+    } else {
+        parents.erase(*parent);
     }
+    cachedInnerUsage += parents.DynamicMemoryUsage();
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
@@ -1126,6 +1365,21 @@ void CTxMemPool::GetTransactionAncestry(const uint256& txid, size_t& ancestors,
     }
 }
 
+size_t CTxMemPool::GetClusterSize(const uint256& txid)
+{
+    LOCK(cs);
+    auto it = mapTx.find(txid);
+    if (it == mapTx.end()) return 0;
+    if (m_dirty_clusters.count(it->m_cluster_id)) SplitCluster(it->m_cluster_id);
+    return it->m_cluster_id == 0 ? 1 : m_clusters.at(it->m_cluster_id).size();
+}
+
+size_t CTxMemPool::GetDirtyClusterCount() const
+{
+    LOCK(cs);
+    return m_dirty_clusters.size();
+}
+
 bool CTxMemPool::IsLoaded() const
 {
     LOCK(cs);
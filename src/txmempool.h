@@ -11,6 +11,7 @@
 #include <optional>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -18,6 +19,7 @@
 #include <coins.h>
 #include <indirectmap.h>
 #include <policy/feerate.h>
+#include <prevector.h>
 #include <primitives/transaction.h>
 #include <random.h>
 #include <sync.h>
@@ -31,6 +33,7 @@
 
 class CBlockIndex;
 class CChainState;
+class CTxMemPoolEntry;
 extern RecursiveMutex cs_main;
 
 /** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
@@ -66,6 +69,52 @@ struct CompareIteratorByHash {
     }
 };
 
+/**
+ * The in-mempool parents or children of a mempool entry, as a set ordered by
+ * txid. Most transactions only have a few of them, so rather than in a
+ * std::set, which allocates a node for each, they are kept sorted in a
+ * prevector, which stores up to INLINE_LINKS of them without allocating.
+ */
+class CTxMemPoolEntryLinks
+{
+public:
+    static constexpr unsigned int INLINE_LINKS{2};
+
+private:
+    typedef prevector<INLINE_LINKS, const CTxMemPoolEntry*> links_type;
+    links_type m_links;
+
+public:
+    class const_iterator
+    {
+        links_type::const_iterator m_it;
+
+    public:
+        typedef std::ptrdiff_t difference_type;
+        typedef const CTxMemPoolEntry value_type;
+        typedef const CTxMemPoolEntry* pointer;
+        typedef const CTxMemPoolEntry& reference;
+        typedef std::forward_iterator_tag iterator_category;
+        explicit const_iterator(links_type::const_iterator it) : m_it(it) {}
+        const CTxMemPoolEntry& operator*() const { return **m_it; }
+        const CTxMemPoolEntry* operator->() const { return *m_it; }
+        const_iterator& operator++() { ++m_it; return *this; }
+        const_iterator operator++(int) { const_iterator copy(*this); ++m_it; return copy; }
+        bool operator==(const_iterator other) const { return m_it == other.m_it; }
+        bool operator!=(const_iterator other) const { return m_it != other.m_it; }
+    };
+
+    const_iterator begin() const { return const_iterator(m_links.begin()); }
+    const_iterator end() const { return const_iterator(m_links.end()); }
+    size_t size() const { return m_links.size(); }
+    bool empty() const { return m_links.empty(); }
+
+    std::pair<const_iterator, bool> insert(const CTxMemPoolEntry& entry);
+    size_t erase(const CTxMemPoolEntry& entry);
+
+    size_t DynamicMemoryUsage() const;
+};
+
 /** \class CTxMemPoolEntry
  *
  * CTxMemPoolEntry stores data about the corresponding transaction, as well
@@ -83,8 +132,10 @@ class CTxMemPoolEntry
 public:
     typedef std::reference_wrapper<const CTxMemPoolEntry> CTxMemPoolEntryRef;
     // two aliases, should the types ever diverge
-    typedef std::set<CTxMemPoolEntryRef, CompareIteratorByHash> Parents;
-    typedef std::set<CTxMemPoolEntryRef, CompareIteratorByHash> Children;
+    typedef CTxMemPoolEntryLinks Parents;
+    typedef CTxMemPoolEntryLinks Children;
+    //! Set of entries for walking the graph, which may grow much larger than Parents or Children
+    typedef std::set<CTxMemPoolEntryRef, CompareIteratorByHash> EntrySet;
 
 private:
     const CTransactionRef tx;
@@ -158,6 +209,8 @@ public:
     Children& GetMemPoolChildren() const { return m_children; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t m_cluster_id{0}; //!< Key of the cluster in mempool's m_clusters, or 0 if the entry has no parents or children
+    mutable size_t m_cluster_idx{0}; //!< Index in the entries of that cluster
     mutable Epoch::Marker m_epoch_marker; //!< epoch when last touched, useful for graph algorithms
 };
 
@@ -585,6 +638,38 @@ private:
      */
     std::set<uint256> m_unbroadcast_txids GUARDED_BY(cs);
 
+    //! Entries added since the last reset, in order. Used by BlockAssembler
+    //! to extend a cached block template instead of assembling a new one.
+    std::vector<txiter> m_additions GUARDED_BY(cs);
+    //! Incremented whenever entries are removed or their fees or ancestor
+    //! state change, which invalidates templates built from m_additions
+    uint64_t m_additions_reset GUARDED_BY(cs){0};
+
+    void ResetAdditions() EXCLUSIVE_LOCKS_REQUIRED(cs);
+
+    //! Entries of each cluster, by the m_cluster_id of the entries. All entries
+    //! connected by spending each other's outputs are in the same cluster. A
+    //! cluster is a maximal connected set, unless it is in m_dirty_clusters.
+    //! Entries without parents or children, usually most of them, are not in
+    //! any cluster, so that they take no memory here.
+    std::unordered_map<uint64_t, std::vector<txiter>> m_clusters GUARDED_BY(cs);
+    //! Clusters that had entries removed, which may have left them disconnected.
+    //! They are split again when a block removes part of them, or when their
+    //! size is asked for.
+    std::set<uint64_t> m_dirty_clusters GUARDED_BY(cs);
+    uint64_t m_next_cluster_id GUARDED_BY(cs){1};
+
+    /** Get the cluster of an entry, creating one for an entry that is not in any */
+    uint64_t GetCluster(txiter it) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Add an entry to a cluster, creating it if needed */
+    void AddToCluster(uint64_t cluster_id, txiter it) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Remove an entry from its cluster, and mark the rest of the cluster dirty */
+    void RemoveFromCluster(txiter it) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Move the entries of the given clusters into the largest one, and return its id */
+    uint64_t MergeClusters(const std::set<uint64_t>& cluster_ids) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Replace a dirty cluster by the connected sets of its entries */
+    void SplitCluster(uint64_t cluster_id) EXCLUSIVE_LOCKS_REQUIRED(cs);
+
 public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx GUARDED_BY(cs);
     std::map<uint256, CAmount> mapDeltas GUARDED_BY(cs);
@@ -709,6 +794,15 @@ public:
      */
     void GetTransactionAncestry(const uint256& txid, size_t& ancestors, size_t& descendants) const;
 
+    /**
+     * Return the number of transactions connected to the given transaction
+     * by spends, including itself, or 0 if it is not in the mempool.
+     */
+    size_t GetClusterSize(const uint256& txid);
+
+    /** Return the number of clusters that may have come apart; public only for testing */
+    size_t GetDirtyClusterCount() const;
+
     /** @returns true if the mempool is fully loaded */
     bool IsLoaded() const;
 
@@ -790,6 +884,18 @@ public:
         return m_sequence_number;
     }
 
+    /**
+     * Return the entries added since the additions were last reset, and in
+     * additions_reset how often that has happened. As long as it does not
+     * change, the returned entries stay valid and are only appended to.
+     */
+    const std::vector<txiter>& GetAdditions(uint64_t& additions_reset) const EXCLUSIVE_LOCKS_REQUIRED(cs)
+    {
+        AssertLockHeld(cs);
+        additions_reset = m_additions_reset;
+        return m_additions;
+    }
+
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
      *  the descendants for a single transaction that has been added to the
@@ -80,8 +80,9 @@ struct BlockHasher
 {
     // this used to call `GetCheapHash()` in uint256, which was later moved; the
     // cheap hash function simply calls ReadLE64() however, so the end result is
-    // identical
-    size_t operator()(const uint256& hash) const { return ReadLE64(hash.begin()); }
+    // identical. As with SaltedOutpointHasher, being noexcept keeps libstdc++
+    // from caching the hash in every BlockMap node.
+    size_t operator()(const uint256& hash) const noexcept { return ReadLE64(hash.begin()); }
 };
 
 class SaltedSipHasher
@@ -0,0 +1,126 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <util/lzcompress.h>
+
+#include <crypto/common.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace lz {
+namespace {
+
+constexpr int HASH_BITS{14};
+constexpr size_t MAX_OFFSET{0xffff};
+//! Token value meaning that more length bytes follow
+constexpr size_t LENGTH_MORE{15};
+
+uint32_t Hash4(const uint8_t* p)
+{
+    return (ReadLE32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+void WriteLength(std::vector<uint8_t>& out, size_t length)
+{
+    length -= LENGTH_MORE;
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(length);
+}
+
+void WriteSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literals_len, size_t offset, size_t match_len)
+{
+    const size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    out.push_back((std::min(literals_len, LENGTH_MORE) << 4) | std::min(match_code, LENGTH_MORE));
+    if (literals_len >= LENGTH_MORE) WriteLength(out, literals_len);
+    out.insert(out.end(), literals, literals + literals_len);
+    if (match_len == 0) return;
+    out.push_back(offset & 0xff);
+    out.push_back(offset >> 8);
+    if (match_code >= LENGTH_MORE) WriteLength(out, match_code);
+}
+
+bool ReadLength(Span<const uint8_t> data, size_t& pos, size_t& length)
+{
+    uint8_t byte;
+    do {
+        if (pos >= data.size()) return false;
+        byte = data[pos++];
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+} // namespace
+
+std::vector<uint8_t> Compress(Span<const uint8_t> data)
+{
+    std::vector<uint8_t> out;
+    out.reserve(data.size() / 2 + 16);
+    // Last position at which each hashed 4-byte sequence was seen
+    std::vector<size_t> table(size_t{1} << HASH_BITS, 0);
+    const uint8_t* const begin = data.data();
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= data.size()) {
+        const uint32_t hash = Hash4(begin + pos);
+        const size_t candidate = table[hash];
+        table[hash] = pos;
+        if (candidate < pos && pos - candidate <= MAX_OFFSET && memcmp(begin + candidate, begin + pos, LZ_MIN_MATCH) == 0) {
+            size_t match_len = LZ_MIN_MATCH;
+            while (pos + match_len < data.size() && begin[candidate + match_len] == begin[pos + match_len]) {
+                ++match_len;
+            }
+            WriteSequence(out, begin + anchor, pos - anchor, pos - candidate, match_len);
+            pos += match_len;
+            anchor = pos;
+        } else {
+            // Skip ahead faster the longer nothing matched, so that data which does not
+            // compress, like hashes and signatures, is passed over quickly.
+            pos += 1 + ((pos - anchor) >> 6);
+        }
+    }
+    WriteSequence(out, begin + anchor, data.size() - anchor, 0, 0);
+    return out;
+}
+
+bool Decompress(Span<const uint8_t> data, Span<uint8_t> out)
+{
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    while (in_pos < data.size()) {
+        const uint8_t token = data[in_pos++];
+        size_t literals_len = token >> 4;
+        if (literals_len == LENGTH_MORE && !ReadLength(data, in_pos, literals_len)) return false;
+        if (literals_len > data.size() - in_pos || literals_len > out.size() - out_pos) return false;
+        memcpy(out.data() + out_pos, data.data() + in_pos, literals_len);
+        in_pos += literals_len;
+        out_pos += literals_len;
+        // The last sequence has no match
+        if (in_pos == data.size()) break;
+
+        if (data.size() - in_pos < 2) return false;
+        const size_t offset = data[in_pos] | (size_t{data[in_pos + 1]} << 8);
+        in_pos += 2;
+        size_t match_len = token & 0xf;
+        if (match_len == LENGTH_MORE && !ReadLength(data, in_pos, match_len)) return false;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out_pos || match_len > out.size() - out_pos) return false;
+        if (offset >= match_len) {
+            memcpy(out.data() + out_pos, out.data() + out_pos - offset, match_len);
+        } else {
+            // Overlapping match, repeating the last offset bytes
+            for (size_t i = 0; i < match_len; ++i) {
+                out[out_pos + i] = out[out_pos + i - offset];
+            }
+        }
+        out_pos += match_len;
+    }
+    return out_pos == out.size();
+}
+
+} // namespace lz
@@ -0,0 +1,38 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTIL_LZCOMPRESS_H
+#define BITCOIN_UTIL_LZCOMPRESS_H
+
+#include <span.h>
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Fast LZ77 compression without entropy coding, in the spirit of LZ4.
+ *
+ * The output is a sequence of (literals, match) pairs. Each starts with a
+ * token byte holding the literal count in its upper and the match length
+ * minus LZ_MIN_MATCH in its lower four bits, where 15 means that further
+ * bytes follow, which are added until one is not 255. Then follow the
+ * literals, and the 16-bit little endian offset of the match, with its
+ * extra length bytes. The last pair has literals only.
+ */
+namespace lz {
+
+static constexpr size_t LZ_MIN_MATCH{4};
+
+/** Compress data. */
+std::vector<uint8_t> Compress(Span<const uint8_t> data);
+
+/**
+ * Decompress data into out, which must have the size of the original data.
+ * Returns false if data is malformed or does not decompress to that size.
+ */
+bool Decompress(Span<const uint8_t> data, Span<uint8_t> out);
+
+} // namespace lz
+
+#endif // BITCOIN_UTIL_LZCOMPRESS_H
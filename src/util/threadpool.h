@@ -0,0 +1,117 @@
+// Copyright (c) 2021 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTIL_THREADPOOL_H
+#define BITCOIN_UTIL_THREADPOOL_H
+
+#include <sync.h>
+#include <tinyformat.h>
+#include <util/threadnames.h>
+
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * A fixed-size pool of worker threads executing tasks in FIFO order.
+ *
+ * Unlike CCheckQueue, which is built around a master thread that waits for a
+ * whole batch of boolean checks, tasks submitted here are independent and
+ * each hands back its own std::future. Tasks submitted while the pool is not
+ * running, or still queued when it is stopped, are discarded, which leaves
+ * their futures with a broken promise.
+ */
+class ThreadPool
+{
+private:
+    const std::string m_name;
+
+    Mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_work_queue GUARDED_BY(m_mutex);
+    bool m_request_stop GUARDED_BY(m_mutex){true};
+    std::vector<std::thread> m_workers;
+
+    void Loop()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                WAIT_LOCK(m_mutex, lock);
+                m_cv.wait(lock, [&]() EXCLUSIVE_LOCKS_REQUIRED(m_mutex) { return m_request_stop || !m_work_queue.empty(); });
+                if (m_request_stop) return;
+                task = std::move(m_work_queue.front());
+                m_work_queue.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit ThreadPool(std::string name) : m_name(std::move(name)) {}
+
+    ~ThreadPool()
+    {
+        assert(m_workers.empty());
+    }
+
+    //! Spawn the worker threads. The pool must not be running.
+    void Start(int threads_num)
+    {
+        assert(m_workers.empty());
+        if (threads_num <= 0) return;
+        WITH_LOCK(m_mutex, m_request_stop = false);
+        for (int n = 0; n < threads_num; ++n) {
+            m_workers.emplace_back([this, n]() {
+                util::ThreadRename(strprintf("%s.%i", m_name, n));
+                Loop();
+            });
+        }
+    }
+
+    //! Stop and join all worker threads, dropping any tasks not yet started.
+    void Stop()
+    {
+        WITH_LOCK(m_mutex, m_request_stop = true);
+        m_cv.notify_all();
+        for (std::thread& t : m_workers) {
+            t.join();
+        }
+        m_workers.clear();
+        LOCK(m_mutex);
+        m_work_queue.clear();
+    }
+
+    //! Whether worker threads have been started.
+    bool IsRunning() const { return !m_workers.empty(); }
+
+    //! Number of worker threads.
+    size_t WorkersCount() const { return m_workers.size(); }
+
+    //! Queue a callable for execution and return a future for its result.
+    template <typename F>
+    auto Submit(F&& fn) -> std::future<std::invoke_result_t<F>>
+    {
+        using R = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+        std::future<R> result = task->get_future();
+        {
+            LOCK(m_mutex);
+            if (m_request_stop) return result;
+            m_work_queue.emplace_back([task]() { (*task)(); });
+        }
+        m_cv.notify_one();
+        return result;
+    }
+};
+
+#endif // BITCOIN_UTIL_THREADPOOL_H
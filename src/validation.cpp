@@ -48,13 +48,17 @@
 #include <util/rbf.h>
 #include <util/strencodings.h>
 #include <util/system.h>
+#include <util/thread.h>
+#include <util/threadpool.h>
 #include <util/translation.h>
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <future>
 #include <numeric>
 #include <optional>
 #include <string>
+#include <unordered_set>
 
 #include <boost/algorithm/string/replace.hpp>
 
@@ -69,6 +73,8 @@
 static const unsigned int EXTRA_DESCENDANT_TX_SIZE_LIMIT = 10000;
 /** Maximum kilobytes for transactions to store for processing during reorg */
 static const unsigned int MAX_DISCONNECTED_TX_POOL_SIZE = 20000;
+/** Maximum number of blocks disconnected together in a reorg, bounding the blocks and undo data held in memory */
+static const size_t MAX_DISCONNECT_BATCH_BLOCKS = 32;
 /** Time to wait between writing blocks/block index to disk. */
 static constexpr std::chrono::hours DATABASE_WRITE_INTERVAL{1};
 /** Time to wait between flushing chainstate to disk. */
@@ -119,8 +125,11 @@ Mutex g_best_block_mutex;
 std::condition_variable g_best_block_cv;
 uint256 g_best_block;
 bool g_parallel_script_checks{false};
+int g_script_check_batch_blocks = DEFAULT_SCRIPTCHECK_BATCH_BLOCKS;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
+bool g_coins_background_flush = DEFAULT_COINS_BACKGROUND_FLUSH;
+int g_coins_cache_retain = DEFAULT_COINS_CACHE_RETAIN;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 
@@ -177,6 +186,17 @@ bool CheckInputScripts(const CTransaction& tx, TxValidationState& state,
                        bool cacheFullScriptStore, PrecomputedTransactionData& txdata,
                        std::vector<CScriptCheck>* pvChecks = nullptr)
                        EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+static bool CheckInputScriptsParallel(const CTransaction& tx, TxValidationState& state,
+                                      const CCoinsViewCache& inputs, unsigned int flags, bool cacheSigStore,
+                                      bool cacheFullScriptStore, PrecomputedTransactionData& txdata)
+                                      EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+static bool VerifyInputScripts(const CTransaction& tx, TxValidationState& state, unsigned int flags,
+                               bool cacheSigStore, PrecomputedTransactionData& txdata,
+                               std::vector<CScriptCheck>* pvChecks = nullptr,
+                               unsigned int* failed_input = nullptr);
+static bool VerifyInputScriptsParallel(const CTransaction& tx, TxValidationState& state, unsigned int flags,
+                                       bool cacheSigStore, PrecomputedTransactionData& txdata,
+                                       unsigned int* failed_input = nullptr);
 
 bool CheckFinalTx(const CBlockIndex* active_chain_tip, const CTransaction &tx, int flags)
 {
@@ -419,7 +439,7 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, TxValidationS
     }
 
     // Call CheckInputScripts() to cache signature and script validity against current tip consensus rules.
-    return CheckInputScripts(tx, state, view, flags, /* cacheSigStore = */ true, /* cacheFullSciptStore = */ true, txdata);
+    return CheckInputScriptsParallel(tx, state, view, flags, /* cacheSigStore = */ true, /* cacheFullSciptStore = */ true, txdata);
 }
 
 namespace {
@@ -453,6 +473,10 @@ public:
          * any transaction spending the same inputs as a transaction in the mempool is considered
          * a conflict. */
         const bool m_allow_bip125_replacement{true};
+        /** Precomputed data of a transaction whose scripts were verified with our policy flags
+         * without holding cs_main, see AcceptToMemoryPoolPipelined(). PolicyScriptChecks() is
+         * skipped if the transaction still spends the outputs the scripts were verified against. */
+        const PrecomputedTransactionData* m_checked_txdata{nullptr};
     };
 
     // Single transaction acceptance
@@ -465,6 +489,11 @@ public:
     */
     PackageMempoolAcceptResult AcceptMultipleTransactions(const std::vector<CTransactionRef>& txns, ATMPArgs& args) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
+    // Run only the PreChecks() of AcceptSingleTransaction(), and return the outputs spent by
+    // the transaction, so that its scripts can be verified after releasing cs_main.
+    bool PreCheckSingleTransaction(const CTransactionRef& ptx, ATMPArgs& args, TxValidationState& state,
+                                   std::vector<CTxOut>& spent_outputs) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
 private:
     // All the intermediate state that gets passed between the various levels
     // of checking a given transaction.
@@ -497,6 +526,9 @@ private:
     // only invoke this on transactions that have otherwise passed policy checks.
     bool PolicyScriptChecks(const ATMPArgs& args, Workspace& ws, PrecomputedTransactionData& txdata) EXCLUSIVE_LOCKS_REQUIRED(cs_main, m_pool.cs);
 
+    // The outputs spent by a transaction that passed PreChecks().
+    std::vector<CTxOut> GetSpentOutputs(const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main, m_pool.cs);
+
     // Re-run the script checks, using consensus flags, and try to cache the
     // result in the scriptcache. This should be done after
     // PolicyScriptChecks(). This requires that all inputs either be in our
@@ -914,32 +946,65 @@ bool MemPoolAccept::PreChecks(ATMPArgs& args, Workspace& ws)
     return true;
 }
 
-bool MemPoolAccept::PolicyScriptChecks(const ATMPArgs& args, Workspace& ws, PrecomputedTransactionData& txdata)
+/**
+ * Verify the input scripts of a transaction with our policy flags against the
+ * spent outputs in txdata, which must be initialized. This does not need
+ * cs_main, see AcceptToMemoryPoolPipelined().
+ */
+static bool VerifyPolicyScripts(const CTransaction& tx, TxValidationState& state, PrecomputedTransactionData& txdata)
 {
-    const CTransaction& tx = *ws.m_ptx;
-    TxValidationState& state = ws.m_state;
-
     constexpr unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
 
-    // Check input scripts and signatures.
-    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-    if (!CheckInputScripts(tx, state, m_view, scriptVerifyFlags, true, false, txdata)) {
+    unsigned int failed_input{0};
+    if (!VerifyInputScriptsParallel(tx, state, scriptVerifyFlags, true, txdata, &failed_input)) {
+        if (tx.HasWitness()) return false; // state filled in by VerifyInputScriptsParallel
+
         // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
         // need to turn both off, and compare against just turning off CLEANSTACK
         // to see if the failure is specifically due to witness validation.
-        TxValidationState state_dummy; // Want reported failures to be from first CheckInputScripts
-        if (!tx.HasWitness() && CheckInputScripts(tx, state_dummy, m_view, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
-                !CheckInputScripts(tx, state_dummy, m_view, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
+        // The input that failed decides most cases on its own, so try it
+        // before the whole transaction.
+        constexpr unsigned int no_witness_flags = scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK);
+        constexpr unsigned int no_cleanstack_flags = scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK;
+        const CTxOut& spent_output = txdata.m_spent_outputs[failed_input];
+        if (!CScriptCheck(spent_output, tx, failed_input, no_witness_flags, true, &txdata)()) return false;
+
+        TxValidationState state_dummy; // Want reported failures to be from the first check
+        if (VerifyInputScriptsParallel(tx, state_dummy, no_witness_flags, true, txdata) &&
+                (!CScriptCheck(spent_output, tx, failed_input, no_cleanstack_flags, true, &txdata)() ||
+                 !VerifyInputScriptsParallel(tx, state_dummy, no_cleanstack_flags, true, txdata))) {
             // Only the witness is missing, so the transaction itself may be fine.
             state.Invalid(TxValidationResult::TX_WITNESS_STRIPPED,
                     state.GetRejectReason(), state.GetDebugMessage());
         }
-        return false; // state filled in by CheckInputScripts
+        return false;
     }
 
     return true;
 }
 
+std::vector<CTxOut> MemPoolAccept::GetSpentOutputs(const CTransaction& tx)
+{
+    std::vector<CTxOut> spent_outputs;
+    spent_outputs.reserve(tx.vin.size());
+    for (const CTxIn& txin : tx.vin) {
+        const Coin& coin = m_view.AccessCoin(txin.prevout);
+        assert(!coin.IsSpent());
+        spent_outputs.push_back(coin.out);
+    }
+    return spent_outputs;
+}
+
+bool MemPoolAccept::PolicyScriptChecks(const ATMPArgs& args, Workspace& ws, PrecomputedTransactionData& txdata)
+{
+    const CTransaction& tx = *ws.m_ptx;
+
+    // Check input scripts and signatures.
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    txdata.Init(tx, GetSpentOutputs(tx));
+    return VerifyPolicyScripts(tx, ws.m_state, txdata);
+}
+
 bool MemPoolAccept::ConsensusScriptChecks(const ATMPArgs& args, Workspace& ws, PrecomputedTransactionData& txdata)
 {
     const CTransaction& tx = *ws.m_ptx;
@@ -1032,7 +1097,12 @@ MempoolAcceptResult MemPoolAccept::AcceptSingleTransaction(const CTransactionRef
     // checks pass, to mitigate CPU exhaustion denial-of-service attacks.
     PrecomputedTransactionData txdata;
 
-    if (!PolicyScriptChecks(args, ws, txdata)) return MempoolAcceptResult::Failure(ws.m_state);
+    if (args.m_checked_txdata && args.m_checked_txdata->m_spent_outputs == GetSpentOutputs(*ptx)) {
+        // The scripts were already verified against the same outputs
+        txdata = *args.m_checked_txdata;
+    } else if (!PolicyScriptChecks(args, ws, txdata)) {
+        return MempoolAcceptResult::Failure(ws.m_state);
+    }
 
     if (!ConsensusScriptChecks(args, ws, txdata)) return MempoolAcceptResult::Failure(ws.m_state);
 
@@ -1048,6 +1118,22 @@ MempoolAcceptResult MemPoolAccept::AcceptSingleTransaction(const CTransactionRef
     return MempoolAcceptResult::Success(std::move(ws.m_replaced_transactions), ws.m_base_fees);
 }
 
+bool MemPoolAccept::PreCheckSingleTransaction(const CTransactionRef& ptx, ATMPArgs& args, TxValidationState& state,
+                                              std::vector<CTxOut>& spent_outputs)
+{
+    AssertLockHeld(cs_main);
+    LOCK(m_pool.cs);
+
+    Workspace ws(ptx);
+
+    if (!PreChecks(args, ws)) {
+        state = ws.m_state;
+        return false;
+    }
+    spent_outputs = GetSpentOutputs(*ptx);
+    return true;
+}
+
 PackageMempoolAcceptResult MemPoolAccept::AcceptMultipleTransactions(const std::vector<CTransactionRef>& txns, ATMPArgs& args)
 {
     AssertLockHeld(cs_main);
@@ -1101,26 +1187,34 @@ PackageMempoolAcceptResult MemPoolAccept::AcceptMultipleTransactions(const std::
 
 } // anon namespace
 
+/**
+ * Remove coins that were not present in the coins cache before validating a transaction that was
+ * not accepted; this is to prevent memory DoS in case we receive a large number of invalid
+ * transactions that attempt to overrun the in-memory coins cache (`CCoinsViewCache::cacheCoins`).
+ */
+static void UncacheCoins(CChainState& active_chainstate, const std::vector<COutPoint>& coins_to_uncache)
+    EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    for (const COutPoint& hashTx : coins_to_uncache) {
+        active_chainstate.CoinsTip().Uncache(hashTx);
+    }
+}
+
 /** (try to) add transaction to memory pool with a specified acceptance time **/
 static MempoolAcceptResult AcceptToMemoryPoolWithTime(const CChainParams& chainparams, CTxMemPool& pool,
                                                       CChainState& active_chainstate,
                                                       const CTransactionRef &tx, int64_t nAcceptTime,
-                                                      bool bypass_limits, bool test_accept)
+                                                      bool bypass_limits, bool test_accept,
+                                                      const PrecomputedTransactionData* checked_txdata = nullptr,
+                                                      std::vector<COutPoint> coins_to_uncache = {})
                                                       EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
-    std::vector<COutPoint> coins_to_uncache;
     MemPoolAccept::ATMPArgs args { chainparams, nAcceptTime, bypass_limits, coins_to_uncache,
-                                   test_accept, /* m_allow_bip125_replacement */ true };
+                                   test_accept, /* m_allow_bip125_replacement */ true, checked_txdata };
 
     const MempoolAcceptResult result = MemPoolAccept(pool, active_chainstate).AcceptSingleTransaction(tx, args);
     if (result.m_result_type != MempoolAcceptResult::ResultType::VALID) {
-        // Remove coins that were not present in the coins cache before calling
-        // AcceptSingleTransaction(); this is to prevent memory DoS in case we receive a large
-        // number of invalid transactions that attempt to overrun the in-memory coins cache
-        // (`CCoinsViewCache::cacheCoins`).
-
-        for (const COutPoint& hashTx : coins_to_uncache)
-            active_chainstate.CoinsTip().Uncache(hashTx);
+        UncacheCoins(active_chainstate, coins_to_uncache);
     }
     // After we've (potentially) uncached entries, ensure our coins cache is still within its size limits
     BlockValidationState state_dummy;
@@ -1134,6 +1228,50 @@ MempoolAcceptResult AcceptToMemoryPool(CChainState& active_chainstate, CTxMemPoo
     return AcceptToMemoryPoolWithTime(Params(), pool, active_chainstate, tx, GetTime(), bypass_limits, test_accept);
 }
 
+MempoolAcceptResult AcceptToMemoryPoolPipelined(CChainState& active_chainstate, CTxMemPool& pool, const CTransactionRef& tx)
+{
+    AssertLockNotHeld(cs_main);
+    // The checks before script verification run twice on this path. For a
+    // transaction with few inputs, that costs about as much time under
+    // cs_main as verifying its scripts would.
+    if (tx->vin.size() < MIN_PIPELINED_ACCEPT_INPUTS) {
+        LOCK(cs_main);
+        return AcceptToMemoryPool(active_chainstate, pool, tx, /* bypass_limits */ false);
+    }
+
+    const CChainParams& chainparams = Params();
+    std::vector<COutPoint> coins_to_uncache;
+    TxValidationState state;
+    std::vector<CTxOut> spent_outputs;
+
+    // Run the cheap checks first, and look up the outputs the transaction spends.
+    {
+        LOCK(cs_main);
+        MemPoolAccept::ATMPArgs args { chainparams, GetTime(), /* bypass_limits */ false, coins_to_uncache,
+                                       /* test_accept */ false, /* m_allow_bip125_replacement */ true };
+        if (!MemPoolAccept(pool, active_chainstate).PreCheckSingleTransaction(tx, args, state, spent_outputs)) {
+            UncacheCoins(active_chainstate, coins_to_uncache);
+            return MempoolAcceptResult::Failure(state);
+        }
+    }
+
+    // Verify the scripts against those outputs without holding cs_main.
+    PrecomputedTransactionData txdata;
+    txdata.Init(*tx, std::move(spent_outputs));
+    if (!VerifyPolicyScripts(*tx, state, txdata)) {
+        LOCK(cs_main);
+        UncacheCoins(active_chainstate, coins_to_uncache);
+        return MempoolAcceptResult::Failure(state);
+    }
+
+    // The chain and mempool may have changed in the meantime, so check the
+    // transaction again and add it to the mempool. Only the policy script
+    // checks are skipped, if it still spends the same outputs.
+    LOCK(cs_main);
+    return AcceptToMemoryPoolWithTime(chainparams, pool, active_chainstate, tx, GetTime(), false, false,
+                                      &txdata, std::move(coins_to_uncache));
+}
+
 PackageMempoolAcceptResult ProcessNewPackage(CChainState& active_chainstate, CTxMemPool& pool,
                                                    const Package& package, bool test_accept)
 {
@@ -1201,7 +1339,8 @@ CoinsViews::CoinsViews(
     bool in_memory,
     bool should_wipe) : m_dbview(
                             gArgs.GetDataDirNet() / ldb_name, cache_size_bytes, in_memory, should_wipe),
-                        m_catcherview(&m_dbview) {}
+                        m_flushview(m_dbview),
+                        m_catcherview(&m_flushview) {}
 
 void CoinsViews::InitCache()
 {
@@ -1371,6 +1510,14 @@ int BlockManager::GetSpendHeight(const CCoinsViewCache& inputs)
 static CuckooCache::cache<uint256, SignatureCacheHasher> g_scriptExecutionCache;
 static CSHA256 g_scriptExecutionCacheHasher;
 
+static uint256 ScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    CSHA256 hasher = g_scriptExecutionCacheHasher;
+    hasher.Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
+
 void InitScriptExecutionCache() {
     // Setup the salted hasher
     uint256 nonce = GetRandHash();
@@ -1413,18 +1560,12 @@ bool CheckInputScripts(const CTransaction& tx, TxValidationState& state,
 {
     if (tx.IsCoinBase()) return true;
 
-    if (pvChecks) {
-        pvChecks->reserve(tx.vin.size());
-    }
-
     // First check if script executions have been cached with the same
     // flags. Note that this assumes that the inputs provided are
     // correct (ie that the transaction hash which is in tx's prevouts
     // properly commits to the scriptPubKey in the inputs view of that
     // transaction).
-    uint256 hashCacheEntry;
-    CSHA256 hasher = g_scriptExecutionCacheHasher;
-    hasher.Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    const uint256 hashCacheEntry = ScriptExecutionCacheEntry(tx, flags);
     AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
     if (g_scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
         return true;
@@ -1442,8 +1583,70 @@ bool CheckInputScripts(const CTransaction& tx, TxValidationState& state,
         }
         txdata.Init(tx, std::move(spent_outputs));
     }
+
+    if (!VerifyInputScripts(tx, state, flags, cacheSigStore, txdata, pvChecks)) return false;
+
+    if (cacheFullScriptStore && !pvChecks) {
+        // We executed all of the provided scripts, and were told to
+        // cache the result. Do so now.
+        g_scriptExecutionCache.insert(hashCacheEntry);
+    }
+
+    return true;
+}
+
+/**
+ * Fill in state for a failed script check of tx, from the error the check
+ * reported.
+ */
+static bool ScriptCheckFailed(const CTransaction& tx, TxValidationState& state, bool cacheSigStore,
+                              PrecomputedTransactionData& txdata, const CScriptCheck& check)
+{
+    const unsigned int flags = check.GetFlags();
+    const unsigned int i = check.GetInputIndex();
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-standard DER encodings or non-null dummy
+        // arguments; if so, ensure we return NOT_STANDARD
+        // instead of CONSENSUS to avoid downstream users
+        // splitting the network between upgraded and
+        // non-upgraded nodes by banning CONSENSUS-failing
+        // data providers.
+        CScriptCheck check2(txdata.m_spent_outputs[i], tx, i,
+                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
+        if (check2())
+            return state.Invalid(TxValidationResult::TX_NOT_STANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+    }
+    // MANDATORY flag failures correspond to
+    // TxValidationResult::TX_CONSENSUS. Because CONSENSUS
+    // failures are the most serious case of validation
+    // failures, we may need to consider using
+    // RECENT_CONSENSUS_CHANGE for any script failure that
+    // could be due to non-upgraded nodes which we may want to
+    // support, to avoid splitting the network (but this
+    // depends on the details of how net_processing handles
+    // such errors).
+    return state.Invalid(TxValidationResult::TX_CONSENSUS, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+}
+
+/**
+ * The part of CheckInputScripts() that verifies the scripts against the
+ * spent outputs in txdata, which must be initialized. It does not use the
+ * script execution cache, so it does not need cs_main. If failed_input is
+ * set, it receives the index of the input that failed.
+ */
+static bool VerifyInputScripts(const CTransaction& tx, TxValidationState& state, unsigned int flags,
+                               bool cacheSigStore, PrecomputedTransactionData& txdata,
+                               std::vector<CScriptCheck>* pvChecks,
+                               unsigned int* failed_input)
+{
     assert(txdata.m_spent_outputs.size() == tx.vin.size());
 
+    if (pvChecks) {
+        pvChecks->reserve(tx.vin.size());
+    }
+
     for (unsigned int i = 0; i < tx.vin.size(); i++) {
 
         // We very carefully only pass in things to CScriptCheck which
@@ -1458,42 +1661,84 @@ bool CheckInputScripts(const CTransaction& tx, TxValidationState& state,
             pvChecks->push_back(CScriptCheck());
             check.swap(pvChecks->back());
         } else if (!check()) {
-            if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                // Check whether the failure was caused by a
-                // non-mandatory script verification check, such as
-                // non-standard DER encodings or non-null dummy
-                // arguments; if so, ensure we return NOT_STANDARD
-                // instead of CONSENSUS to avoid downstream users
-                // splitting the network between upgraded and
-                // non-upgraded nodes by banning CONSENSUS-failing
-                // data providers.
-                CScriptCheck check2(txdata.m_spent_outputs[i], tx, i,
-                        flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
-                if (check2())
-                    return state.Invalid(TxValidationResult::TX_NOT_STANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-            }
-            // MANDATORY flag failures correspond to
-            // TxValidationResult::TX_CONSENSUS. Because CONSENSUS
-            // failures are the most serious case of validation
-            // failures, we may need to consider using
-            // RECENT_CONSENSUS_CHANGE for any script failure that
-            // could be due to non-upgraded nodes which we may want to
-            // support, to avoid splitting the network (but this
-            // depends on the details of how net_processing handles
-            // such errors).
-            return state.Invalid(TxValidationResult::TX_CONSENSUS, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+            if (failed_input) *failed_input = i;
+            return ScriptCheckFailed(tx, state, cacheSigStore, txdata, check);
         }
     }
 
-    if (cacheFullScriptStore && !pvChecks) {
-        // We executed all of the provided scripts, and were told to
-        // cache the result. Do so now.
-        g_scriptExecutionCache.insert(hashCacheEntry);
+    return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/**
+ * Script checks of transactions for the mempool have their own queue and
+ * threads, as only one caller at a time can use a queue, and block
+ * validation should not wait for them.
+ */
+static CCheckQueue<CScriptCheck> mempoolscriptcheckqueue(128);
+
+/** Minimum number of inputs of a transaction for mempool acceptance to verify them on the mempool script check threads */
+static constexpr size_t MIN_PARALLEL_SCRIPTCHECK_INPUTS{16};
+
+/**
+ * Run script checks of a transaction for the mempool on the mempool script
+ * check threads, and wait for them to finish. If one fails, it is swapped
+ * into failed.
+ */
+static bool RunScriptChecksParallel(std::vector<CScriptCheck>& checks, CScriptCheck& failed)
+{
+    CCheckQueueControl<CScriptCheck> control(&mempoolscriptcheckqueue);
+    control.Add(checks);
+    return control.Wait(&failed);
+}
+
+/**
+ * Like CheckInputScripts(), but verify the scripts of transactions with many
+ * inputs on the mempool script check threads, so that large transactions do
+ * not hold up the calling thread for long.
+ */
+static bool CheckInputScriptsParallel(const CTransaction& tx, TxValidationState& state,
+                                      const CCoinsViewCache& inputs, unsigned int flags, bool cacheSigStore,
+                                      bool cacheFullScriptStore, PrecomputedTransactionData& txdata)
+{
+    if (!g_parallel_script_checks || tx.vin.size() < MIN_PARALLEL_SCRIPTCHECK_INPUTS) {
+        return CheckInputScripts(tx, state, inputs, flags, cacheSigStore, cacheFullScriptStore, txdata);
     }
 
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputScripts(tx, state, inputs, flags, cacheSigStore, cacheFullScriptStore, txdata, &vChecks)) {
+        return false;
+    }
+    // Script execution cache hit
+    if (vChecks.empty()) return true;
+
+    CScriptCheck failed;
+    if (!RunScriptChecksParallel(vChecks, failed)) {
+        return ScriptCheckFailed(tx, state, cacheSigStore, txdata, failed);
+    }
+    if (cacheFullScriptStore) {
+        g_scriptExecutionCache.insert(ScriptExecutionCacheEntry(tx, flags));
+    }
     return true;
 }
 
+/** Like CheckInputScriptsParallel(), but without the script execution cache, see VerifyInputScripts(). */
+static bool VerifyInputScriptsParallel(const CTransaction& tx, TxValidationState& state, unsigned int flags,
+                                       bool cacheSigStore, PrecomputedTransactionData& txdata,
+                                       unsigned int* failed_input)
+{
+    if (!g_parallel_script_checks || tx.vin.size() < MIN_PARALLEL_SCRIPTCHECK_INPUTS) {
+        return VerifyInputScripts(tx, state, flags, cacheSigStore, txdata, nullptr, failed_input);
+    }
+
+    std::vector<CScriptCheck> vChecks;
+    VerifyInputScripts(tx, state, flags, cacheSigStore, txdata, &vChecks);
+    CScriptCheck failed;
+    if (RunScriptChecksParallel(vChecks, failed)) return true;
+    if (failed_input) *failed_input = failed.GetInputIndex();
+    return ScriptCheckFailed(tx, state, cacheSigStore, txdata, failed);
+}
+
 bool AbortNode(BlockValidationState& state, const std::string& strMessage, const bilingual_str& userMessage)
 {
     AbortNode(strMessage, userMessage);
@@ -1501,17 +1746,19 @@ bool AbortNode(BlockValidationState& state, const std::string& strMessage, const
 }
 
 /**
- * Restore the UTXO in a Coin at a given COutPoint
- * @param undo The Coin to be restored.
- * @param view The coins view to which to apply the changes.
- * @param out The out point that corresponds to the tx input.
- * @return A DisconnectResult as an int
+ * Like ApplyTxInUndo, but if fLookupBase is false, only check view's cache for
+ * an unspent coin that would be overwritten. The coin being restored was spent
+ * by the disconnected block, so it can only be unspent in the coins database
+ * if that is corrupted, and looking that up costs a database read for every
+ * input that is not cached.
  */
-int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
+static int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out, bool fLookupBase)
 {
     bool fClean = true;
 
-    if (view.HaveCoin(out)) fClean = false; // overwriting transaction output
+    if (fLookupBase ? view.HaveCoin(out) : view.HaveCoinInCache(out)) {
+        fClean = false; // overwriting transaction output
+    }
 
     if (undo.nHeight == 0) {
         // Missing undo metadata (height and coinbase). Older versions included this
@@ -1529,23 +1776,29 @@ int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
     // possible_overwrite parameter to AddCoin must be set to true. We have
     // already checked whether an unspent coin exists above using HaveCoin, so
     // we don't need to guess. When fClean is false, an unspent coin already
-    // existed and it is an overwrite.
-    view.AddCoin(out, std::move(undo), !fClean);
+    // existed and it is an overwrite. Without the lookup, the coin must not be
+    // marked fresh, in case the database does have it.
+    view.AddCoin(out, std::move(undo), !fClean || !fLookupBase);
 
     return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
 }
 
-/** Undo the effects of this block (with given index) on the UTXO set represented by coins.
- *  When FAILED is returned, view is left in an indeterminate state. */
-DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view)
+/**
+ * Restore the UTXO in a Coin at a given COutPoint
+ * @param undo The Coin to be restored.
+ * @param view The coins view to which to apply the changes.
+ * @param out The out point that corresponds to the tx input.
+ * @return A DisconnectResult as an int
+ */
+int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
-    bool fClean = true;
+    return ApplyTxInUndo(std::move(undo), view, out, /*fLookupBase=*/true);
+}
 
-    CBlockUndo blockUndo;
-    if (!UndoReadFromDisk(blockUndo, pindex)) {
-        error("DisconnectBlock(): failure reading undo data");
-        return DISCONNECT_FAILED;
-    }
+/** Undo the effects of a block on view, given its undo data (see DisconnectBlock and ApplyTxInUndo). */
+static DisconnectResult ApplyBlockUndo(CBlockUndo& blockUndo, const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view, bool fLookupBase)
+{
+    bool fClean = true;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size()) {
         error("DisconnectBlock(): block and undo data inconsistent");
@@ -1580,7 +1833,7 @@ DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockI
             }
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                int res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out);
+                int res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out, fLookupBase);
                 if (res == DISCONNECT_FAILED) return DISCONNECT_FAILED;
                 fClean = fClean && res != DISCONNECT_UNCLEAN;
             }
@@ -1594,16 +1847,120 @@ DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockI
     return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** Undo the effects of this block (with given index) on the UTXO set represented by coins.
+ *  When FAILED is returned, view is left in an indeterminate state. */
+DisconnectResult CChainState::DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view)
+{
+    CBlockUndo blockUndo;
+    if (!UndoReadFromDisk(blockUndo, pindex)) {
+        error("DisconnectBlock(): failure reading undo data");
+        return DISCONNECT_FAILED;
+    }
+    return ApplyBlockUndo(blockUndo, block, pindex, view, /*fLookupBase=*/true);
+}
 
 void StartScriptCheckWorkerThreads(int threads_num)
 {
     scriptcheckqueue.StartWorkerThreads(threads_num);
+    mempoolscriptcheckqueue.StartWorkerThreads(std::min(threads_num, MAX_MEMPOOL_SCRIPTCHECK_THREADS), "mempoolsc");
 }
 
 void StopScriptCheckWorkerThreads()
 {
     scriptcheckqueue.StopWorkerThreads();
+    mempoolscriptcheckqueue.StopWorkerThreads();
+}
+
+/**
+ * Blocks connected together by ConnectTipBatch(), with their outstanding
+ * script checks. The checks point into the blocks' transactions and
+ * precomputed data, so those are declared before `control`, whose destructor
+ * waits for any checks still running.
+ */
+struct ScriptCheckBatch {
+    std::vector<std::shared_ptr<const CBlock>> blocks;
+    std::vector<std::vector<PrecomputedTransactionData>> txsdata;
+    //! Coins changes of the batch, on top of the coins tip until all checks passed.
+    CCoinsViewCache view;
+    CCheckQueueControl<CScriptCheck> control;
+
+    explicit ScriptCheckBatch(CCoinsView* base) : view(base), control(&scriptcheckqueue) {}
+};
+
+static ThreadPool g_coins_prefetch_pool{"coinsfetch"};
+
+void StartCoinsPrefetchThreads(int threads_num)
+{
+    g_coins_prefetch_pool.Start(threads_num);
+}
+
+void StopCoinsPrefetchThreads()
+{
+    g_coins_prefetch_pool.Stop();
+}
+
+/** Minimum number of outpoints looked up by a single coins prefetch task */
+static constexpr size_t MIN_COINSPREFETCH_BATCH{16};
+
+/**
+ * Look up the inputs of a block which are missing from cache in the coins
+ * database, split across the coins prefetch threads, and add the results to
+ * cache. ConnectBlock then finds them in memory instead of paying for one
+ * database read per input on the validation thread.
+ *
+ * cs_main must be held throughout so that the database cannot be written to
+ * while the lookups are in flight; db must be the view backing cache.
+ */
+static void PrefetchBlockCoins(const CBlock& block, CCoinsViewCache& cache, const CCoinsView& db) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    AssertLockHeld(cs_main);
+    if (!g_coins_prefetch_pool.IsRunning()) return;
+
+    // Outputs created within the block itself are never in the database.
+    std::unordered_set<uint256, SaltedTxidHasher> block_txids;
+    block_txids.reserve(block.vtx.size());
+    for (const auto& tx : block.vtx) {
+        block_txids.insert(tx->GetHash());
+    }
+    std::vector<COutPoint> missing;
+    for (const auto& tx : block.vtx) {
+        if (tx->IsCoinBase()) continue;
+        for (const CTxIn& txin : tx->vin) {
+            if (block_txids.count(txin.prevout.hash) || cache.HaveCoinInCache(txin.prevout)) continue;
+            missing.push_back(txin.prevout);
+        }
+    }
+    if (missing.empty()) return;
+
+    using FetchedCoins = std::vector<std::pair<COutPoint, Coin>>;
+    const size_t batch_size = std::max(MIN_COINSPREFETCH_BATCH, (missing.size() + g_coins_prefetch_pool.WorkersCount() - 1) / g_coins_prefetch_pool.WorkersCount());
+    std::vector<std::future<FetchedCoins>> batches;
+    for (size_t begin = 0; begin < missing.size(); begin += batch_size) {
+        const size_t end = std::min(begin + batch_size, missing.size());
+        batches.push_back(g_coins_prefetch_pool.Submit([&db, &missing, begin, end]() {
+            FetchedCoins fetched;
+            try {
+                for (size_t i = begin; i < end; ++i) {
+                    Coin coin;
+                    if (db.GetCoin(missing[i], coin)) fetched.emplace_back(missing[i], std::move(coin));
+                }
+            } catch (const std::runtime_error& e) {
+                // Leave read errors to be reported through the regular lookup
+                // path, which ConnectBlock falls back to for anything missing.
+                LogPrint(BCLog::COINDB, "%s: %s\n", __func__, e.what());
+            }
+            return fetched;
+        }));
+    }
+    for (auto& batch : batches) {
+        try {
+            for (auto& [outpoint, coin] : batch.get()) {
+                cache.EmplaceFetchedCoin(outpoint, std::move(coin));
+            }
+        } catch (const std::future_error&) {
+            // The lookups were discarded because the prefetch threads were stopped.
+        }
+    }
 }
 
 /**
@@ -1698,7 +2055,7 @@ static int64_t nBlocksTotal = 0;
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
  *  can fail if those validity checks fail (among other reasons). */
 bool CChainState::ConnectBlock(const CBlock& block, BlockValidationState& state, CBlockIndex* pindex,
-                               CCoinsViewCache& view, bool fJustCheck)
+                               CCoinsViewCache& view, bool fJustCheck, ScriptCheckBatch* batch)
 {
     AssertLockHeld(cs_main);
     assert(pindex);
@@ -1884,9 +2241,13 @@ bool CChainState::ConnectBlock(const CBlock& block, BlockValidationState& state,
     // until after `control` has run the script checks (potentially
     // in multiple threads). Preallocate the vector size so a new allocation
     // doesn't invalidate pointers into the vector, and keep txsdata in scope
-    // for as long as `control`.
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && g_parallel_script_checks ? &scriptcheckqueue : nullptr);
-    std::vector<PrecomputedTransactionData> txsdata(block.vtx.size());
+    // for as long as `control`. When connecting as part of a batch, both
+    // belong to the batch instead, as its checks outlive this call.
+    assert(!batch || (!fJustCheck && g_parallel_script_checks));
+    CCheckQueueControl<CScriptCheck> control(fScriptChecks && g_parallel_script_checks && !batch ? &scriptcheckqueue : nullptr);
+    std::vector<PrecomputedTransactionData> txsdata_local;
+    std::vector<PrecomputedTransactionData>& txsdata{batch ? batch->txsdata.emplace_back() : txsdata_local};
+    txsdata.resize(block.vtx.size());
 
     std::vector<int> prevheights;
     CAmount nFees = 0;
@@ -1951,7 +2312,11 @@ bool CChainState::ConnectBlock(const CBlock& block, BlockValidationState& state,
                 return error("ConnectBlock(): CheckInputScripts on %s failed with %s",
                     tx.GetHash().ToString(), state.ToString());
             }
-            control.Add(vChecks);
+            if (batch) {
+                batch->control.Add(vChecks);
+            } else {
+                control.Add(vChecks);
+            }
         }
 
         CTxUndo undoDummy;
@@ -1979,11 +2344,11 @@ bool CChainState::ConnectBlock(const CBlock& block, BlockValidationState& state,
     if (fJustCheck)
         return true;
 
-    if (!WriteUndoDataForBlock(blockundo, state, pindex, m_params)) {
+    if (!WriteUndoDataForBlock(std::move(blockundo), state, pindex, m_params)) {
         return false;
     }
 
-    if (!pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
+    if (!batch && !pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
         pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
         setDirtyBlockIndex.insert(pindex);
     }
@@ -2044,6 +2409,7 @@ bool CChainState::FlushStateToDisk(
     static std::chrono::microseconds nLastFlush{0};
     std::set<int> setFilesToPrune;
     bool full_flush_completed = false;
+    std::optional<CBlockLocator> background_flush_completed;
 
     const size_t coins_count = CoinsTip().GetCacheSize();
     const size_t coins_mem_usage = CoinsTip().DynamicMemoryUsage();
@@ -2053,6 +2419,18 @@ bool CChainState::FlushStateToDisk(
         bool fFlushForPrune = false;
         bool fDoFullFlush = false;
 
+        // Pick up the result of a background coins flush which has completed since the last call.
+        CCoinsViewBackgroundFlush& flushview = m_coins_views->m_flushview;
+        auto finish_background_flush = [&]() EXCLUSIVE_LOCKS_REQUIRED(::cs_main) {
+            if (!flushview.Sync()) return false;
+            background_flush_completed = std::move(m_background_flush_locator);
+            m_background_flush_locator.reset();
+            return true;
+        };
+        if (flushview.HasPendingWrite() && !flushview.IsWriting() && !finish_background_flush()) {
+            return AbortNode(state, "Failed to write to coin database");
+        }
+
         CoinsCacheSizeState cache_state = GetCoinsCacheSizeState(&m_mempool);
         LOCK(cs_LastBlockFile);
         if (fPruneMode && (fCheckForPruning || nManualPruneHeight > 0) && !fReindex) {
@@ -2110,12 +2488,19 @@ bool CChainState::FlushStateToDisk(
 
                 // First make sure all block and undo data is flushed to disk.
                 FlushBlockFile();
+                if (!WaitForBlockWrites()) {
+                    return AbortNode(state, "Failed to write block and undo data");
+                }
             }
 
             // Then update all block file information (which may refer to block and undo files).
             {
                 LOG_TIME_MILLIS_WITH_CATEGORY("write block index to disk", BCLog::BENCH);
 
+                // A block index loaded from a stale snapshot must not overwrite the database.
+                if (!m_blockman.WaitForIndexSnapshotCheck()) {
+                    return AbortNode(state, "Block index snapshot does not match the block tree database");
+                }
                 std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
                 vFiles.reserve(setDirtyFileInfo.size());
                 for (std::set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); ) {
@@ -2153,13 +2538,39 @@ bool CChainState::FlushStateToDisk(
             if (!CheckDiskSpace(gArgs.GetDataDirNet(), 48 * 2 * 2 * CoinsTip().GetCacheSize())) {
                 return AbortNode(state, "Disk space is too low!", _("Disk space is too low!"));
             }
+            // Only one background write can be in progress at a time.
+            if (flushview.HasPendingWrite() && !finish_background_flush()) {
+                return AbortNode(state, "Failed to write to coin database");
+            }
+            // Writing in the background is limited to flushes triggered by
+            // cache size or time, so that callers requesting a flush and
+            // pruning, which deletes block files, only ever see durable state.
+            const bool background = g_coins_background_flush && !fFlushForPrune &&
+                                    (mode == FlushStateMode::IF_NEEDED || mode == FlushStateMode::PERIODIC);
+            flushview.SetBackground(background);
+            // Flushes triggered by cache size or time may keep the recently
+            // used part of the cache, so that validation does not restart
+            // from a cold cache.
+            const size_t retain_bytes = (mode == FlushStateMode::IF_NEEDED || mode == FlushStateMode::PERIODIC) ?
+                                            m_coinstip_cache_size_bytes / 100 * g_coins_cache_retain : 0;
             // Flush the chainstate (which may refer to block index entries).
-            if (!CoinsTip().Flush())
+            if (!(retain_bytes > 0 ? CoinsTip().PartialFlush(retain_bytes) : CoinsTip().Flush()))
                 return AbortNode(state, "Failed to write to coin database");
+            if (retain_bytes > 0) {
+                LogPrint(BCLog::COINDB, "Kept %u coins (%.2fkB) in the cache after flushing\n",
+                         CoinsTip().GetCacheSize(), CoinsTip().DynamicMemoryUsage() / 1000.0);
+            }
             nLastFlush = nNow;
-            full_flush_completed = true;
+            if (background) {
+                m_background_flush_locator = m_chain.GetLocator();
+            } else {
+                full_flush_completed = true;
+            }
         }
     }
+    if (background_flush_completed) {
+        GetMainSignals().ChainStateFlushed(*background_flush_completed);
+    }
     if (full_flush_completed) {
         // Update best block in wallet (so we can detect restored wallets).
         GetMainSignals().ChainStateFlushed(m_chain.GetLocator());
@@ -2241,6 +2652,23 @@ static void UpdateTip(CTxMemPool& mempool, const CBlockIndex* pindexNew, const C
       !warning_messages.empty() ? strprintf(" warning='%s'", warning_messages.original) : "");
 }
 
+/**
+ * Save the transactions of a disconnected block to re-add to the mempool at
+ * the end of the reorg, within the memory limit for them.
+ */
+static void AddToDisconnectPool(const CBlock& block, DisconnectedBlockTransactions& disconnectpool, CTxMemPool& mempool) EXCLUSIVE_LOCKS_REQUIRED(mempool.cs)
+{
+    for (auto it = block.vtx.rbegin(); it != block.vtx.rend(); ++it) {
+        disconnectpool.addTransaction(*it);
+    }
+    while (disconnectpool.DynamicMemoryUsage() > MAX_DISCONNECTED_TX_POOL_SIZE * 1000) {
+        // Drop the earliest entry, and remove its children from the mempool.
+        auto it = disconnectpool.queuedTx.get<insertion_order>().begin();
+        mempool.removeRecursive(**it, MemPoolRemovalReason::REORG);
+        disconnectpool.removeEntry(it);
+    }
+}
+
 /** Disconnect m_chain's tip.
   * After calling, the mempool will be in an inconsistent state, with
   * transactions from disconnected blocks being added to disconnectpool.  You
@@ -2281,16 +2709,7 @@ bool CChainState::DisconnectTip(BlockValidationState& state, DisconnectedBlockTr
     }
 
     if (disconnectpool) {
-        // Save transactions to re-add to mempool at end of reorg
-        for (auto it = block.vtx.rbegin(); it != block.vtx.rend(); ++it) {
-            disconnectpool->addTransaction(*it);
-        }
-        while (disconnectpool->DynamicMemoryUsage() > MAX_DISCONNECTED_TX_POOL_SIZE * 1000) {
-            // Drop the earliest entry, and remove its children from the mempool.
-            auto it = disconnectpool->queuedTx.get<insertion_order>().begin();
-            m_mempool.removeRecursive(**it, MemPoolRemovalReason::REORG);
-            disconnectpool->removeEntry(it);
-        }
+        AddToDisconnectPool(block, *disconnectpool, m_mempool);
     }
 
     m_chain.SetTip(pindexDelete->pprev);
@@ -2302,7 +2721,58 @@ bool CChainState::DisconnectTip(BlockValidationState& state, DisconnectedBlockTr
     return true;
 }
 
+bool CChainState::DisconnectTips(BlockValidationState& state, size_t nMaxBlocks, const CBlockIndex* pindexFork, DisconnectedBlockTransactions* disconnectpool)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(m_mempool.cs);
+
+    std::vector<CBlockIndex*> vpindexDelete;
+    for (CBlockIndex* pindex = m_chain.Tip(); pindex != pindexFork && vpindexDelete.size() < nMaxBlocks; pindex = pindex->pprev) {
+        assert(pindex);
+        vpindexDelete.push_back(pindex);
+    }
+    // Read blocks and undo data in parallel.
+    int64_t nStart = GetTimeMicros();
+    std::vector<std::pair<std::shared_ptr<CBlock>, CBlockUndo>> blocks;
+    if (!ReadBlocksWithUndo(vpindexDelete, m_params.GetConsensus(), blocks)) {
+        return error("DisconnectTips(): Failed to read blocks or undo data");
+    }
+    int64_t nTime1 = GetTimeMicros();
+    LogPrint(BCLog::BENCH, "- Read %u blocks to disconnect: %.2fms\n", vpindexDelete.size(), (nTime1 - nStart) * MILLI);
+    // Apply all blocks atomically to the chain state, as one change to the cache.
+    {
+        CCoinsViewCache view(&CoinsTip());
+        assert(view.GetBestBlock() == vpindexDelete.front()->GetBlockHash());
+        for (size_t i = 0; i < vpindexDelete.size(); ++i) {
+            auto& [pblock, blockundo] = blocks[i];
+            if (ApplyBlockUndo(blockundo, *pblock, vpindexDelete[i], view, /*fLookupBase=*/false) != DISCONNECT_OK) {
+                return error("DisconnectTips(): DisconnectBlock %s failed", vpindexDelete[i]->GetBlockHash().ToString());
+            }
+        }
+        bool flushed = view.Flush();
+        assert(flushed);
+    }
+    LogPrint(BCLog::BENCH, "- Disconnect %u blocks: %.2fms\n", vpindexDelete.size(), (GetTimeMicros() - nTime1) * MILLI);
+    // Write the chain state to disk, if necessary.
+    if (!FlushStateToDisk(state, FlushStateMode::IF_NEEDED)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < vpindexDelete.size(); ++i) {
+        CBlockIndex* pindexDelete = vpindexDelete[i];
+        std::shared_ptr<CBlock> pblock = std::move(blocks[i].first);
+        if (disconnectpool) {
+            AddToDisconnectPool(*pblock, *disconnectpool, m_mempool);
+        }
+        m_chain.SetTip(pindexDelete->pprev);
+        UpdateTip(m_mempool, pindexDelete->pprev, m_params, *this);
+        GetMainSignals().BlockDisconnected(pblock, pindexDelete);
+    }
+    return true;
+}
+
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetchCoins = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -2364,11 +2834,14 @@ bool CChainState::ConnectTip(BlockValidationState& state, CBlockIndex* pindexNew
     int64_t nTime1 = GetTimeMicros();
     std::shared_ptr<const CBlock> pthisBlock;
     if (!pblock) {
-        std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
-        if (!ReadBlockFromDisk(*pblockNew, pindexNew, m_params.GetConsensus())) {
-            return AbortNode(state, "Failed to read block");
+        pthisBlock = m_block_prefetcher.Take(pindexNew);
+        if (!pthisBlock) {
+            std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
+            if (!ReadBlockFromDisk(*pblockNew, pindexNew, m_params.GetConsensus())) {
+                return AbortNode(state, "Failed to read block");
+            }
+            pthisBlock = pblockNew;
         }
-        pthisBlock = pblockNew;
     } else {
         pthisBlock = pblock;
     }
@@ -2377,6 +2850,10 @@ bool CChainState::ConnectTip(BlockValidationState& state, CBlockIndex* pindexNew
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint(BCLog::BENCH, "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * MILLI, nTimeReadFromDisk * MICRO);
+    PrefetchBlockCoins(blockConnecting, CoinsTip(), m_coins_views->m_flushview);
+    int64_t nTime2b = GetTimeMicros(); nTimePrefetchCoins += nTime2b - nTime2;
+    LogPrint(BCLog::BENCH, "  - Prefetch coins: %.2fms [%.2fs]\n", (nTime2b - nTime2) * MILLI, nTimePrefetchCoins * MICRO);
+    nTime2 = nTime2b;
     {
         CCoinsViewCache view(&CoinsTip());
         bool rv = ConnectBlock(blockConnecting, state, pindexNew, view);
@@ -2415,6 +2892,66 @@ bool CChainState::ConnectTip(BlockValidationState& state, CBlockIndex* pindexNew
     return true;
 }
 
+bool CChainState::ConnectTipBatch(BlockValidationState& state, const std::vector<CBlockIndex*>& blocks, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions& disconnectpool)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(m_mempool.cs);
+
+    assert(!blocks.empty() && blocks.front()->pprev == m_chain.Tip());
+    int64_t nTime1 = GetTimeMicros();
+    ScriptCheckBatch batch{&CoinsTip()};
+    for (CBlockIndex* pindex : blocks) {
+        std::shared_ptr<const CBlock> pthisBlock;
+        if (pblock && pindex == pindexMostWork) {
+            pthisBlock = pblock;
+        } else {
+            pthisBlock = m_block_prefetcher.Take(pindex);
+        }
+        if (!pthisBlock) {
+            std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
+            if (!ReadBlockFromDisk(*pblockNew, pindex, m_params.GetConsensus())) {
+                return AbortNode(state, "Failed to read block");
+            }
+            pthisBlock = pblockNew;
+        }
+        batch.blocks.push_back(pthisBlock);
+        PrefetchBlockCoins(*pthisBlock, CoinsTip(), m_coins_views->m_flushview);
+        CCoinsViewCache view(&batch.view);
+        if (!ConnectBlock(*pthisBlock, state, pindex, view, false, &batch)) {
+            return error("%s: ConnectBlock %s failed, %s", __func__, pindex->GetBlockHash().ToString(), state.ToString());
+        }
+        bool flushed = view.Flush();
+        assert(flushed);
+    }
+    int64_t nTime2 = GetTimeMicros();
+    if (!batch.control.Wait()) {
+        LogPrintf("%s: script checks of blocks %d to %d failed\n", __func__, blocks.front()->nHeight, blocks.back()->nHeight);
+        return state.Invalid(BlockValidationResult::BLOCK_CONSENSUS, "block-validation-failed");
+    }
+    int64_t nTime3 = GetTimeMicros();
+    LogPrint(BCLog::BENCH, "  - Connect %u blocks: %.2fms, wait for script checks: %.2fms\n", blocks.size(), (nTime2 - nTime1) * MILLI, (nTime3 - nTime2) * MILLI);
+
+    // All blocks are valid; apply them in order, as ConnectTip would have.
+    bool flushed = batch.view.Flush();
+    assert(flushed);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        CBlockIndex* pindex = blocks[i];
+        const CBlock& block = *batch.blocks[i];
+        if (!pindex->IsValid(BLOCK_VALID_SCRIPTS)) {
+            pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+            setDirtyBlockIndex.insert(pindex);
+        }
+        GetMainSignals().BlockChecked(block, state);
+        m_mempool.removeForBlock(block.vtx, pindex->nHeight);
+        disconnectpool.removeForBlock(block.vtx);
+        m_chain.SetTip(pindex);
+        UpdateTip(m_mempool, pindex, m_params, *this);
+        connectTrace.BlockConnected(pindex, batch.blocks[i]);
+    }
+    // Write the chain state to disk, if necessary.
+    return FlushStateToDisk(state, FlushStateMode::IF_NEEDED);
+}
+
 /**
  * Return the tip of the chain with the most work in it, that isn't
  * known to be invalid (it's however far from certain to be valid).
@@ -2504,7 +3041,11 @@ bool CChainState::ActivateBestChainStep(BlockValidationState& state, CBlockIndex
     bool fBlocksDisconnected = false;
     DisconnectedBlockTransactions disconnectpool;
     while (m_chain.Tip() && m_chain.Tip() != pindexFork) {
-        if (!DisconnectTip(state, &disconnectpool)) {
+        // Disconnect several blocks at once when reorganizing deeper than one block.
+        const bool fDisconnected = m_chain.Tip()->pprev != pindexFork && pindexFork ?
+                                       DisconnectTips(state, MAX_DISCONNECT_BATCH_BLOCKS, pindexFork, &disconnectpool) :
+                                       DisconnectTip(state, &disconnectpool);
+        if (!fDisconnected) {
             // This is likely a fatal error, but keep the mempool consistent,
             // just in case. Only remove from the mempool in this case.
             UpdateMempoolForReorg(*this, m_mempool, disconnectpool, false);
@@ -2535,6 +3076,39 @@ bool CChainState::ActivateBestChainStep(BlockValidationState& state, CBlockIndex
         }
         nHeight = nTargetHeight;
 
+        // Start reading the blocks we are about to connect, except one we were handed already.
+        std::vector<const CBlockIndex*> vpindexUpcoming;
+        vpindexUpcoming.reserve(vpindexToConnect.size());
+        for (const CBlockIndex* pindexUpcoming : reverse_iterate(vpindexToConnect)) {
+            if (pblock && pindexUpcoming == pindexMostWork) continue;
+            vpindexUpcoming.push_back(pindexUpcoming);
+        }
+        m_block_prefetcher.Prefetch(vpindexUpcoming, m_params.GetConsensus());
+
+        // During initial block download, connect the first few blocks as one
+        // batch so that their script checks overlap. This is only done when
+        // extending the current tip, so the batch always leaves us in a better
+        // position. If any of its blocks is invalid, fall through and connect
+        // them one at a time, without returning early, to find out which.
+        size_t nReplay = 0;
+        const size_t nBatch = fBlocksDisconnected || !g_parallel_script_checks || !IsInitialBlockDownload() ? 0 :
+                              std::min<size_t>(g_script_check_batch_blocks, vpindexToConnect.size());
+        if (nBatch > 1) {
+            const std::vector<CBlockIndex*> vpindexBatch(vpindexToConnect.rbegin(), vpindexToConnect.rbegin() + nBatch);
+            if (ConnectTipBatch(state, vpindexBatch, pindexMostWork, pblock, connectTrace, disconnectpool)) {
+                PruneBlockIndexCandidates();
+                // Return temporarily to release the lock.
+                break;
+            }
+            if (!state.IsInvalid()) {
+                // A system error occurred, see below.
+                UpdateMempoolForReorg(*this, m_mempool, disconnectpool, false);
+                return false;
+            }
+            state = BlockValidationState();
+            nReplay = nBatch;
+        }
+
         // Connect new blocks.
         for (CBlockIndex* pindexConnect : reverse_iterate(vpindexToConnect)) {
             if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : std::shared_ptr<const CBlock>(), connectTrace, disconnectpool)) {
@@ -2556,6 +3130,7 @@ bool CChainState::ActivateBestChainStep(BlockValidationState& state, CBlockIndex
                 }
             } else {
                 PruneBlockIndexCandidates();
+                if (nReplay > 0 && --nReplay > 0) continue;
                 if (!pindexOldTip || m_chain.Tip()->nChainWork > pindexOldTip->nChainWork) {
                     // We're in a better position than we were. Return temporarily to release the lock.
                     fContinue = false;
@@ -2628,6 +3203,12 @@ bool CChainState::ActivateBestChain(BlockValidationState& state, std::shared_ptr
     // we use m_cs_chainstate to enforce mutual exclusion so that only one caller may execute this function at a time
     LOCK(m_cs_chainstate);
 
+    // The proof of work of a block index loaded from a snapshot is only
+    // checked in the background, so don't build on it before that is done.
+    if (!m_blockman.WaitForIndexSnapshotCheck()) {
+        return AbortNode(state, "Block index snapshot does not match the block tree database");
+    }
+
     CBlockIndex *pindexMostWork = nullptr;
     CBlockIndex *pindexNewTip = nullptr;
     int nStopAtHeight = gArgs.GetArg("-stopatheight", DEFAULT_STOPATHEIGHT);
@@ -2927,7 +3508,7 @@ CBlockIndex* BlockManager::AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
+    CBlockIndex* pindexNew = NewBlockIndex(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -3138,6 +3719,28 @@ CBlockIndex* BlockManager::GetLastCheckpoint(const CCheckpointData& data)
     return nullptr;
 }
 
+static bool CheckBlockHeaderWork(const CBlockHeader& block, BlockValidationState& state, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
+{
+    // Check proof of work
+    if (block.nBits != GetNextWorkRequired(pindexPrev, &block, consensusParams))
+        return state.Invalid(BlockValidationResult::BLOCK_INVALID_HEADER, "bad-diffbits", "incorrect proof of work");
+
+    return true;
+}
+
+static bool CheckBlockHeaderTime(const CBlockHeader& block, BlockValidationState& state, const CBlockIndex* pindexPrev, int64_t nAdjustedTime)
+{
+    // Check timestamp against prev
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(BlockValidationResult::BLOCK_INVALID_HEADER, "time-too-old", "block's timestamp is too early");
+
+    // Check timestamp
+    if (block.GetBlockTime() > nAdjustedTime + MAX_FUTURE_BLOCK_TIME)
+        return state.Invalid(BlockValidationResult::BLOCK_TIME_FUTURE, "time-too-new", "block timestamp too far in the future");
+
+    return true;
+}
+
 /** Context-dependent validity checks.
  *  By "context", we mean only the previous block headers, but not the UTXO
  *  set; UTXO-related validity checks are done in ConnectBlock().
@@ -3146,16 +3749,18 @@ CBlockIndex* BlockManager::GetLastCheckpoint(const CCheckpointData& data)
  *  enforced in this function (eg by adding a new consensus rule). See comment
  *  in ConnectBlock().
  *  Note that -reindex-chainstate skips the validation that happens here!
+ *  With fPrechecked, only the checks needing the block index are done, as
+ *  PrecheckBlockHeaders already did the others.
  */
-static bool ContextualCheckBlockHeader(const CBlockHeader& block, BlockValidationState& state, BlockManager& blockman, const CChainParams& params, const CBlockIndex* pindexPrev, int64_t nAdjustedTime) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+static bool ContextualCheckBlockHeader(const CBlockHeader& block, BlockValidationState& state, BlockManager& blockman, const CChainParams& params, const CBlockIndex* pindexPrev, int64_t nAdjustedTime, bool fPrechecked = false) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     assert(pindexPrev != nullptr);
     const int nHeight = pindexPrev->nHeight + 1;
 
-    // Check proof of work
     const Consensus::Params& consensusParams = params.GetConsensus();
-    if (block.nBits != GetNextWorkRequired(pindexPrev, &block, consensusParams))
-        return state.Invalid(BlockValidationResult::BLOCK_INVALID_HEADER, "bad-diffbits", "incorrect proof of work");
+    if (!fPrechecked && !CheckBlockHeaderWork(block, state, consensusParams, pindexPrev)) {
+        return false;
+    }
 
     // Check against checkpoints
     if (fCheckpointsEnabled) {
@@ -3169,13 +3774,9 @@ static bool ContextualCheckBlockHeader(const CBlockHeader& block, BlockValidatio
         }
     }
 
-    // Check timestamp against prev
-    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
-        return state.Invalid(BlockValidationResult::BLOCK_INVALID_HEADER, "time-too-old", "block's timestamp is too early");
-
-    // Check timestamp
-    if (block.GetBlockTime() > nAdjustedTime + MAX_FUTURE_BLOCK_TIME)
-        return state.Invalid(BlockValidationResult::BLOCK_TIME_FUTURE, "time-too-new", "block timestamp too far in the future");
+    if (!fPrechecked && !CheckBlockHeaderTime(block, state, pindexPrev, nAdjustedTime)) {
+        return false;
+    }
 
     // Reject blocks with outdated version
     if ((block.nVersion < 2 && DeploymentActiveAfter(pindexPrev, consensusParams, Consensus::DEPLOYMENT_HEIGHTINCB)) ||
@@ -3276,11 +3877,11 @@ static bool ContextualCheckBlock(const CBlock& block, BlockValidationState& stat
     return true;
 }
 
-bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, const uint256* pprechecked_hash)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = pprechecked_hash ? *pprechecked_hash : block.GetHash();
     BlockMap::iterator miSelf = m_block_index.find(hash);
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
         if (miSelf != m_block_index.end()) {
@@ -3295,7 +3896,7 @@ bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationS
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus())) {
+        if (!pprechecked_hash && !CheckBlockHeader(block, state, chainparams.GetConsensus())) {
             LogPrint(BCLog::VALIDATION, "%s: Consensus::CheckBlockHeader: %s, %s\n", __func__, hash.ToString(), state.ToString());
             return false;
         }
@@ -3312,7 +3913,7 @@ bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationS
             LogPrintf("ERROR: %s: prev block invalid\n", __func__);
             return state.Invalid(BlockValidationResult::BLOCK_INVALID_PREV, "bad-prevblk");
         }
-        if (!ContextualCheckBlockHeader(block, state, *this, chainparams, pindexPrev, GetAdjustedTime()))
+        if (!ContextualCheckBlockHeader(block, state, *this, chainparams, pindexPrev, GetAdjustedTime(), /*fPrechecked=*/pprechecked_hash != nullptr))
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), state.ToString());
 
         /* Determine if this block descends from any block which has been found
@@ -3362,16 +3963,107 @@ bool BlockManager::AcceptBlockHeader(const CBlockHeader& block, BlockValidationS
     return true;
 }
 
+static ThreadPool g_header_check_pool{"hdrcheck"};
+
+void StartHeaderCheckThreads(int threads_num)
+{
+    g_header_check_pool.Start(threads_num);
+}
+
+void StopHeaderCheckThreads()
+{
+    g_header_check_pool.Stop();
+}
+
+/** Minimum number of headers hashed and checked for proof of work by a single header check task */
+static constexpr size_t MIN_HEADERCHECK_BATCH{128};
+
+/**
+ * Check a chain of headers following pindexPrev without holding cs_main: the
+ * hashes and proof of work of all headers in parallel on the header check
+ * threads, then that each links to the one before, and the difficulty and
+ * timestamp checks of ContextualCheckBlockHeader against a temporary index of
+ * the headers. Only the checks against the block index remain to be done under
+ * cs_main (see AcceptBlockHeader).
+ *
+ * pindexPrev and its ancestors are only read for the fields that do not change
+ * once an entry is in the block index. Returns the number of leading headers
+ * that passed, whose hashes are in hashes; the first header that did not is
+ * checked again under cs_main to report why.
+ */
+static size_t PrecheckBlockHeaders(const std::vector<CBlockHeader>& headers, const CBlockIndex* pindexPrev, const Consensus::Params& consensusParams, std::vector<uint256>& hashes)
+{
+    hashes.resize(headers.size());
+    const auto check_pow = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            // As in CheckBlockHeader
+            hashes[i] = headers[i].GetHash();
+            if (!CheckProofOfWork(hashes[i], headers[i].nBits, consensusParams)) return i;
+        }
+        return end;
+    };
+    size_t nChecked = headers.size();
+    if (g_header_check_pool.IsRunning() && headers.size() >= 2 * MIN_HEADERCHECK_BATCH) {
+        const size_t batch_size = std::max(MIN_HEADERCHECK_BATCH, (headers.size() + g_header_check_pool.WorkersCount() - 1) / g_header_check_pool.WorkersCount());
+        std::vector<std::future<size_t>> batches;
+        for (size_t begin = 0; begin < headers.size(); begin += batch_size) {
+            batches.push_back(g_header_check_pool.Submit([&check_pow, begin, end = std::min(begin + batch_size, headers.size())] { return check_pow(begin, end); }));
+        }
+        for (size_t n = 0; n < batches.size(); ++n) {
+            size_t nBatchChecked = n * batch_size;
+            try {
+                nBatchChecked = batches[n].get();
+            } catch (const std::future_error&) {
+                // The checks were discarded because the header check threads were stopped.
+            }
+            if (nBatchChecked < std::min((n + 1) * batch_size, headers.size())) nChecked = std::min(nChecked, nBatchChecked);
+        }
+    } else {
+        nChecked = check_pow(0, headers.size());
+    }
+
+    // Contextual checks, each header against a temporary index entry for the one before.
+    std::vector<CBlockIndex> vindex;
+    vindex.reserve(nChecked);
+    const int64_t nAdjustedTime = GetAdjustedTime();
+    for (size_t i = 0; i < nChecked; ++i) {
+        const CBlockIndex* pprev = i == 0 ? pindexPrev : &vindex.back();
+        if (headers[i].hashPrevBlock != *pprev->phashBlock) return i;
+        BlockValidationState dummy;
+        if (!CheckBlockHeaderWork(headers[i], dummy, consensusParams, pprev) ||
+            !CheckBlockHeaderTime(headers[i], dummy, pprev, nAdjustedTime)) {
+            return i;
+        }
+        CBlockIndex& index = vindex.emplace_back(headers[i]);
+        index.phashBlock = &hashes[i];
+        index.pprev = const_cast<CBlockIndex*>(pprev);
+        index.nHeight = pprev->nHeight + 1;
+        index.BuildSkip();
+    }
+    return nChecked;
+}
+
 // Exposed wrapper for AcceptBlockHeader
 bool ChainstateManager::ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, BlockValidationState& state, const CChainParams& chainparams, const CBlockIndex** ppindex)
 {
     AssertLockNotHeld(cs_main);
+    // Do the checks which do not need the block index before taking cs_main,
+    // so that it is only held to look up and insert the headers.
+    std::vector<uint256> hashes;
+    size_t nPrechecked = 0;
+    if (!headers.empty()) {
+        const CBlockIndex* pindexPrev = WITH_LOCK(cs_main, return m_blockman.LookupBlockIndex(headers.front().hashPrevBlock));
+        if (pindexPrev) {
+            nPrechecked = PrecheckBlockHeaders(headers, pindexPrev, chainparams.GetConsensus(), hashes);
+        }
+    }
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
+        for (size_t i = 0; i < headers.size(); ++i) {
+            const CBlockHeader& header = headers[i];
             CBlockIndex *pindex = nullptr; // Use a temp pindex instead of ppindex to avoid a const_cast
             bool accepted = m_blockman.AcceptBlockHeader(
-                header, state, chainparams, &pindex);
+                header, state, chainparams, &pindex, i < nPrechecked ? &hashes[i] : nullptr);
             ActiveChainstate().CheckBlockIndex();
 
             if (!accepted) {
@@ -3687,7 +4379,7 @@ CBlockIndex * BlockManager::InsertBlockIndex(const uint256& hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
+    CBlockIndex* pindexNew = NewBlockIndex();
     mi = m_block_index.insert(std::make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -3699,8 +4391,11 @@ bool BlockManager::LoadBlockIndex(
     CBlockTreeDB& blocktree,
     std::set<CBlockIndex*, CBlockIndexWorkComparator>& block_index_candidates)
 {
-    if (!blocktree.LoadBlockIndexGuts(consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); }))
+    const int64_t nTime1 = GetTimeMillis();
+    if (!LoadIndexSnapshot(consensus_params, blocktree) &&
+        !blocktree.LoadBlockIndexGuts(consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); }))
         return false;
+    const int64_t nTime2 = GetTimeMillis();
 
     // Calculate nChainWork
     std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
@@ -3711,6 +4406,7 @@ bool BlockManager::LoadBlockIndex(
         vSortedByHeight.push_back(std::make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    const int64_t nTime3 = GetTimeMillis();
     for (const std::pair<int, CBlockIndex*>& item : vSortedByHeight)
     {
         if (ShutdownRequested()) return false;
@@ -3745,19 +4441,97 @@ bool BlockManager::LoadBlockIndex(
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == nullptr || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
+    const int64_t nTime4 = GetTimeMillis();
+    LogPrintf("Loaded %u block index entries: read and check %dms, sort %dms, link %dms\n",
+        m_block_index.size(), nTime2 - nTime1, nTime3 - nTime2, nTime4 - nTime3);
+
+    return true;
+}
+
+bool BlockManager::LoadIndexSnapshot(const Consensus::Params& consensus_params, CBlockTreeDB& blocktree)
+{
+    if (m_index_snapshot_path.empty()) return false;
+
+    std::vector<unsigned char> data;
+    {
+        CAutoFile file(fsbridge::fopen(m_index_snapshot_path, "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) return false;
+        // Read it in one go, the entries are parsed from memory below.
+        if (fseek(file.Get(), 0, SEEK_END) == 0) {
+            const long size = ftell(file.Get());
+            if (size > 0 && fseek(file.Get(), 0, SEEK_SET) == 0) {
+                data.resize(size);
+                if (fread(data.data(), 1, data.size(), file.Get()) != data.size()) data.clear();
+            }
+        }
+    }
+    // The snapshot is only valid until the block index is written again, so
+    // never use it twice. Should we crash, the next start reads the database.
+    try {
+        fs::remove(m_index_snapshot_path);
+    } catch (const fs::filesystem_error& e) {
+        return error("%s: failed to remove %s: %s", __func__, m_index_snapshot_path.string(), fsbridge::get_filesystem_error_message(e));
+    }
+
+    bool reindexing;
+    blocktree.ReadReindexing(reindexing);
+    if (data.empty() || reindexing) return false;
+    if (!CBlockTreeDB::LoadBlockIndexSnapshot(data, consensus_params, [this](const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) { return this->InsertBlockIndex(hash); })) {
+        LogPrintf("Block index snapshot is invalid, loading the block index from the database\n");
+        Unload();
+        return false;
+    }
 
+    // Check the snapshot against the database in the background. Until that
+    // finished, no block is connected and nothing is written to the block
+    // index database, see WaitForIndexSnapshotCheck.
+    m_index_snapshot_ok = true;
+    LOCK(m_index_snapshot_mutex);
+    m_index_snapshot_check = std::thread(&util::TraceThread, "idxcheck", [this, &consensus_params, &blocktree, data = std::move(data)] {
+        const int64_t start = GetTimeMillis();
+        m_index_snapshot_ok = blocktree.CheckBlockIndexSnapshot(data, consensus_params);
+        LogPrintf("Checked block index snapshot against the database in %dms: %s\n", GetTimeMillis() - start, m_index_snapshot_ok ? "ok" : "mismatch");
+    });
     return true;
 }
 
+bool BlockManager::WaitForIndexSnapshotCheck()
+{
+    LOCK(m_index_snapshot_mutex);
+    if (m_index_snapshot_check.joinable()) m_index_snapshot_check.join();
+    return m_index_snapshot_ok;
+}
+
+void BlockManager::WriteIndexSnapshot(const Consensus::Params& consensus_params)
+{
+    if (m_index_snapshot_path.empty() || !WaitForIndexSnapshotCheck()) return;
+    if (!setDirtyBlockIndex.empty()) {
+        LogPrintf("%s: block index not flushed, not writing a snapshot\n", __func__);
+        return;
+    }
+    const int64_t start = GetTimeMillis();
+    std::vector<const CBlockIndex*> entries;
+    entries.reserve(m_block_index.size());
+    for (const auto& [hash, pindex] : m_block_index) {
+        entries.push_back(pindex);
+    }
+    std::sort(entries.begin(), entries.end(), [](const CBlockIndex* a, const CBlockIndex* b) {
+        return a->GetBlockHash() < b->GetBlockHash();
+    });
+    if (CBlockTreeDB::WriteBlockIndexSnapshot(m_index_snapshot_path, entries, consensus_params.hashGenesisBlock)) {
+        LogPrintf("Wrote block index snapshot of %u entries in %dms\n", entries.size(), GetTimeMillis() - start);
+    }
+}
+
 void BlockManager::Unload() {
+    // The background check only refers to the database, which is closed after this.
+    WaitForIndexSnapshotCheck();
     m_failed_blocks.clear();
     m_blocks_unlinked.clear();
 
-    for (const BlockMap::value_type& entry : m_block_index) {
-        delete entry.second;
-    }
-
-    m_block_index.clear();
+    // The entries live in the pool of the map (see NewBlockIndex), which is
+    // released as a whole when replaced by a new one.
+    m_block_index = BlockMap{};
 }
 
 bool CChainState::LoadBlockIndexDB()
@@ -3797,7 +4571,7 @@ bool CChainState::LoadBlockIndexDB()
     for (std::set<int>::iterator it = setBlkDataFiles.begin(); it != setBlkDataFiles.end(); it++)
     {
         FlatFilePos pos(*it, 0);
-        if (CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION).IsNull()) {
+        if (!IsBlockFileCompressed(*it) && CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION).IsNull()) {
             return false;
         }
     }
@@ -4151,13 +4925,16 @@ bool CChainState::LoadGenesisBlock()
     return true;
 }
 
-void CChainState::LoadExternalBlockFile(FILE* fileIn, FlatFilePos* dbp)
-{
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, FlatFilePos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+/** Disk positions of blocks with unknown parent (only used for reindex) */
+static std::multimap<uint256, FlatFilePos> mapBlocksUnknownParent;
 
-    int nLoaded = 0;
+/**
+ * Find the blocks in a file of serialized blocks, each preceded by the
+ * message start and its size, and pass them to fn with their position in the
+ * file. Stops early when fn returns false.
+ */
+static void ReadExternalBlocks(FILE* fileIn, const CChainParams& params, const std::function<bool(const std::shared_ptr<CBlock>&, uint64_t)>& fn)
+{
     try {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
@@ -4172,10 +4949,10 @@ void CChainState::LoadExternalBlockFile(FILE* fileIn, FlatFilePos* dbp)
             try {
                 // locate a header
                 unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
-                blkdat.FindByte(m_params.MessageStart()[0]);
+                blkdat.FindByte(params.MessageStart()[0]);
                 nRewind = blkdat.GetPos()+1;
                 blkdat >> buf;
-                if (memcmp(buf, m_params.MessageStart(), CMessageHeader::MESSAGE_START_SIZE)) {
+                if (memcmp(buf, params.MessageStart(), CMessageHeader::MESSAGE_START_SIZE)) {
                     continue;
                 }
                 // read size
@@ -4189,82 +4966,128 @@ void CChainState::LoadExternalBlockFile(FILE* fileIn, FlatFilePos* dbp)
             try {
                 // read block
                 uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
                 blkdat.SetLimit(nBlockPos + nSize);
                 std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-                CBlock& block = *pblock;
-                blkdat >> block;
+                blkdat >> *pblock;
                 nRewind = blkdat.GetPos();
+                if (!fn(pblock, nBlockPos)) break;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+}
 
-                uint256 hash = block.GetHash();
-                {
-                    LOCK(cs_main);
-                    // detect out of order blocks, and store them for later
-                    if (hash != m_params.GetConsensus().hashGenesisBlock && !m_blockman.LookupBlockIndex(block.hashPrevBlock)) {
-                        LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                                block.hashPrevBlock.ToString());
-                        if (dbp)
-                            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                        continue;
-                    }
+std::vector<std::pair<std::shared_ptr<CBlock>, FlatFilePos>> ScanBlockFile(FILE* fileIn, int nFile, const CChainParams& params)
+{
+    std::vector<std::pair<std::shared_ptr<CBlock>, FlatFilePos>> blocks;
+    ReadExternalBlocks(fileIn, params, [&](const std::shared_ptr<CBlock>& pblock, uint64_t nBlockPos) {
+        // CheckBlock caches its result in the block, so that AcceptBlock
+        // does not repeat it.
+        BlockValidationState state;
+        CheckBlock(*pblock, state, params.GetConsensus());
+        blocks.emplace_back(pblock, FlatFilePos(nFile, nBlockPos));
+        return true;
+    });
+    return blocks;
+}
 
-                    // process in case the block isn't known yet
-                    CBlockIndex* pindex = m_blockman.LookupBlockIndex(hash);
-                    if (!pindex || (pindex->nStatus & BLOCK_HAVE_DATA) == 0) {
-                      BlockValidationState state;
-                      if (AcceptBlock(pblock, state, nullptr, true, dbp, nullptr)) {
-                          nLoaded++;
-                      }
-                      if (state.IsError()) {
-                          break;
-                      }
-                    } else if (hash != m_params.GetConsensus().hashGenesisBlock && pindex->nHeight % 1000 == 0) {
-                        LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), pindex->nHeight);
-                    }
-                }
+bool CChainState::LoadExternalBlock(std::shared_ptr<CBlock> pblock, FlatFilePos* dbp, int& nLoaded)
+{
+    const CBlock& block = *pblock;
+    uint256 hash = block.GetHash();
+    {
+        LOCK(cs_main);
+        // detect out of order blocks, and store them for later
+        if (hash != m_params.GetConsensus().hashGenesisBlock && !m_blockman.LookupBlockIndex(block.hashPrevBlock)) {
+            LogPrint(BCLog::REINDEX, "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                    block.hashPrevBlock.ToString());
+            if (dbp)
+                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+            return true;
+        }
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == m_params.GetConsensus().hashGenesisBlock) {
-                    BlockValidationState state;
-                    if (!ActivateBestChain(state, nullptr)) {
-                        break;
-                    }
-                }
+        // process in case the block isn't known yet
+        CBlockIndex* pindex = m_blockman.LookupBlockIndex(hash);
+        if (!pindex || (pindex->nStatus & BLOCK_HAVE_DATA) == 0) {
+          BlockValidationState state;
+          if (AcceptBlock(pblock, state, nullptr, true, dbp, nullptr)) {
+              nLoaded++;
+          }
+          if (state.IsError()) {
+              return false;
+          }
+        } else if (hash != m_params.GetConsensus().hashGenesisBlock && pindex->nHeight % 1000 == 0) {
+            LogPrint(BCLog::REINDEX, "Block Import: already had block %s at height %d\n", hash.ToString(), pindex->nHeight);
+        }
+    }
 
-                NotifyHeaderTip(*this);
-
-                // Recursively process earlier encountered successors of this block
-                std::deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, FlatFilePos>::iterator, std::multimap<uint256, FlatFilePos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, FlatFilePos>::iterator it = range.first;
-                        std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, m_params.GetConsensus())) {
-                            LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            BlockValidationState dummy;
-                            if (AcceptBlock(pblockrecursive, dummy, nullptr, true, &it->second, nullptr)) {
-                                nLoaded++;
-                                queue.push_back(pblockrecursive->GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip(*this);
-                    }
+    // Activate the genesis block so normal node progress can continue
+    if (hash == m_params.GetConsensus().hashGenesisBlock) {
+        BlockValidationState state;
+        if (!ActivateBestChain(state, nullptr)) {
+            return false;
+        }
+    }
+
+    NotifyHeaderTip(*this);
+
+    // Recursively process earlier encountered successors of this block
+    std::deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, FlatFilePos>::iterator, std::multimap<uint256, FlatFilePos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, FlatFilePos>::iterator it = range.first;
+            std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
+            if (ReadBlockFromDisk(*pblockrecursive, it->second, m_params.GetConsensus())) {
+                LogPrint(BCLog::REINDEX, "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
+                        head.ToString());
+                LOCK(cs_main);
+                BlockValidationState dummy;
+                if (AcceptBlock(pblockrecursive, dummy, nullptr, true, &it->second, nullptr)) {
+                    nLoaded++;
+                    queue.push_back(pblockrecursive->GetHash());
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+            NotifyHeaderTip(*this);
         }
-    } catch (const std::runtime_error& e) {
-        AbortNode(std::string("System error: ") + e.what());
+    }
+    return true;
+}
+
+void CChainState::LoadExternalBlockFile(FILE* fileIn, FlatFilePos* dbp)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    ReadExternalBlocks(fileIn, m_params, [&](const std::shared_ptr<CBlock>& pblock, uint64_t nBlockPos) {
+        if (dbp)
+            dbp->nPos = nBlockPos;
+        return LoadExternalBlock(pblock, dbp, nLoaded);
+    });
+    LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+}
+
+void CChainState::LoadScannedBlockFile(std::vector<std::pair<std::shared_ptr<CBlock>, FlatFilePos>>& blocks)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nLoaded = 0;
+    try {
+        for (auto& [pblock, pos] : blocks) {
+            if (ShutdownRequested()) return;
+            // Release each block once it is indexed, rather than with the whole file
+            if (!LoadExternalBlock(std::move(pblock), &pos, nLoaded)) break;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: I/O error - %s\n", __func__, e.what());
     }
     LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
 }
@@ -4471,6 +5294,16 @@ bool CChainState::ResizeCoinsCaches(size_t coinstip_size, size_t coinsdb_size)
     size_t old_coinstip_size = m_coinstip_cache_size_bytes;
     m_coinstip_cache_size_bytes = coinstip_size;
     m_coinsdb_cache_size_bytes = coinsdb_size;
+    // The database must not be written to while its cache is being replaced.
+    const bool background_flush_ok = m_coins_views->m_flushview.Sync();
+    std::optional<CBlockLocator> background_flush_completed = std::move(m_background_flush_locator);
+    m_background_flush_locator.reset();
+    if (!background_flush_ok) {
+        return error("%s: background coins flush failed", __func__);
+    }
+    if (background_flush_completed) {
+        GetMainSignals().ChainStateFlushed(*background_flush_completed);
+    }
     CoinsDB().ResizeCache(coinsdb_size);
 
     LogPrintf("[%s] resized coinsdb cache to %.1f MiB\n",
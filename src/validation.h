@@ -12,10 +12,12 @@
 
 #include <amount.h>
 #include <attributes.h>
+#include <chain.h>
 #include <coins.h>
 #include <consensus/validation.h>
 #include <crypto/common.h> // for ReadLE64
 #include <fs.h>
+#include <node/blockstorage.h>
 #include <node/utxo_snapshot.h>
 #include <policy/feerate.h>
 #include <policy/packages.h>
@@ -25,10 +27,12 @@
 #include <txmempool.h> // For CTxMemPool::cs
 #include <txdb.h>
 #include <serialize.h>
+#include <support/allocators/pool.h>
 #include <util/check.h>
 #include <util/hasher.h>
 #include <util/translation.h>
 
+#include <algorithm>
 #include <atomic>
 #include <map>
 #include <memory>
@@ -75,6 +79,20 @@ static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
 static const int MAX_SCRIPTCHECK_THREADS = 15;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of blocks whose script checks may be outstanding at once */
+static const int MAX_SCRIPTCHECK_BATCH_BLOCKS = 32;
+/** -parblocks default (number of blocks whose script checks may overlap during initial block download, 1 = one at a time) */
+static const int DEFAULT_SCRIPTCHECK_BATCH_BLOCKS = 4;
+/** Maximum number of threads looking up block inputs in the coins database */
+static const int MAX_COINSPREFETCH_THREADS = 32;
+/** -coinsprefetchthreads default (number of threads looking up block inputs, 0 = disabled) */
+static const int DEFAULT_COINSPREFETCH_THREADS = 4;
+/** Maximum number of threads verifying the scripts of transactions for the mempool */
+static const int MAX_MEMPOOL_SCRIPTCHECK_THREADS = 4;
+/** Maximum number of threads checking the proof of work of received headers */
+static const int MAX_HEADERCHECK_THREADS = 4;
+/** -blockindexsnapshot default (write a snapshot of the block index at shutdown to load it faster at startup) */
+static const bool DEFAULT_BLOCKINDEX_SNAPSHOT = false;
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
@@ -82,6 +100,12 @@ static constexpr bool DEFAULT_COINSTATSINDEX{false};
 static const char* const DEFAULT_BLOCKFILTERINDEX = "0";
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -coinsbackgroundflush */
+static const bool DEFAULT_COINS_BACKGROUND_FLUSH = false;
+/** Default for -coinscacheretain, the percentage of the coins cache kept across flushes */
+static const int DEFAULT_COINS_CACHE_RETAIN = 0;
+/** Maximum for -coinscacheretain, leaving room before the cache counts as large again */
+static const int MAX_COINS_CACHE_RETAIN = 75;
 /** Default for -stopatheight */
 static const int DEFAULT_STOPATHEIGHT = 0;
 /** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of ::ChainActive().Tip() will not be pruned. */
@@ -106,7 +130,13 @@ enum class SynchronizationState {
 };
 
 extern RecursiveMutex cs_main;
-typedef std::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+/** Largest allocation served from the block index pool: a CBlockIndex, or a
+ *  BlockMap node holding its entry plus the node's own pointer. */
+static constexpr size_t BLOCK_MAP_POOL_BLOCK_BYTES{(std::max(sizeof(CBlockIndex), sizeof(std::pair<const uint256, CBlockIndex*>) + 2 * sizeof(void*)) + alignof(void*) - 1) / alignof(void*) * alignof(void*)};
+/** Allocator keeping BlockMap nodes, and the CBlockIndex entries they point
+ *  to (see BlockManager::InsertBlockIndex), together in one pool */
+typedef PoolAllocator<std::pair<const uint256, CBlockIndex*>, BLOCK_MAP_POOL_BLOCK_BYTES, alignof(void*)> BlockMapAllocator;
+typedef std::unordered_map<uint256, CBlockIndex*, BlockHasher, std::equal_to<uint256>, BlockMapAllocator> BlockMap;
 extern Mutex g_best_block_mutex;
 extern std::condition_variable g_best_block_cv;
 extern uint256 g_best_block;
@@ -114,8 +144,14 @@ extern uint256 g_best_block;
  * False indicates all script checking is done on the main threadMessageHandler thread.
  */
 extern bool g_parallel_script_checks;
+/** Number of blocks connected as one unit during initial block download so that their script checks overlap (-parblocks). */
+extern int g_script_check_batch_blocks;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
+/** Whether periodic coins cache flushes are written to disk on a background thread (-coinsbackgroundflush). */
+extern bool g_coins_background_flush;
+/** Percentage of the coins cache size kept resident by flushes triggered by cache size or time (-coinscacheretain). */
+extern int g_coins_cache_retain;
 extern bool fCheckpointsEnabled;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
@@ -136,10 +172,18 @@ extern const std::vector<std::string> CHECKLEVEL_DOC;
 
 /** Unload database information */
 void UnloadBlockIndex(CTxMemPool* mempool, ChainstateManager& chainman);
-/** Run instances of script checking worker threads */
+/** Run instances of script checking worker threads, for blocks and, up to MAX_MEMPOOL_SCRIPTCHECK_THREADS of them, for the mempool */
 void StartScriptCheckWorkerThreads(int threads_num);
 /** Stop all of the script checking worker threads */
 void StopScriptCheckWorkerThreads();
+/** Run threads looking up the inputs of blocks about to be connected in the coins database */
+void StartCoinsPrefetchThreads(int threads_num);
+/** Stop all of the coins prefetch threads */
+void StopCoinsPrefetchThreads();
+/** Run threads checking the proof of work of received headers */
+void StartHeaderCheckThreads(int threads_num);
+/** Stop all of the header check threads */
+void StopHeaderCheckThreads();
 /**
  * Return transaction from the block at block_index.
  * If block_index is not provided, fall back to mempool.
@@ -232,6 +276,21 @@ struct PackageMempoolAcceptResult
 MempoolAcceptResult AcceptToMemoryPool(CChainState& active_chainstate, CTxMemPool& pool, const CTransactionRef& tx,
                                        bool bypass_limits, bool test_accept=false) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
+/** Minimum number of inputs of a transaction for AcceptToMemoryPoolPipelined() to verify its scripts without cs_main */
+static const unsigned int MIN_PIPELINED_ACCEPT_INPUTS = 4;
+
+/**
+ * (Try to) add a transaction to the memory pool like AcceptToMemoryPool(), but without holding
+ * cs_main while its scripts are verified. The cheap checks are run and the spent outputs looked up
+ * under cs_main first, then the scripts are verified against those outputs, on the script check
+ * threads for transactions with many inputs. Finally, the transaction is checked again under
+ * cs_main and added to the mempool, only skipping the script checks with our policy flags if it
+ * still spends the same outputs. Transactions with fewer than MIN_PIPELINED_ACCEPT_INPUTS inputs
+ * are simply passed to AcceptToMemoryPool().
+ */
+MempoolAcceptResult AcceptToMemoryPoolPipelined(CChainState& active_chainstate, CTxMemPool& pool, const CTransactionRef& tx)
+    LOCKS_EXCLUDED(cs_main);
+
 /**
 * Atomically test acceptance of a package. If the package only contains one tx, package rules still
 * apply. Package validation does not allow BIP125 replacements, so the transaction(s) cannot spend
@@ -325,6 +384,8 @@ public:
     }
 
     ScriptError GetScriptError() const { return error; }
+    unsigned int GetInputIndex() const { return nIn; }
+    unsigned int GetFlags() const { return nFlags; }
 };
 
 /** Initializes the script-execution cache */
@@ -335,6 +396,13 @@ void InitScriptExecutionCache();
 /** Context-independent validity checks */
 bool CheckBlock(const CBlock& block, BlockValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
+/**
+ * Read all blocks from a block file for -reindex, with their positions, and
+ * run CheckBlock on them. Does not need cs_main, so several files can be
+ * scanned in parallel before LoadScannedBlockFile imports them in order.
+ */
+std::vector<std::pair<std::shared_ptr<CBlock>, FlatFilePos>> ScanBlockFile(FILE* fileIn, int nFile, const CChainParams& params);
+
 /** Check a block is completely valid from start to finish (only works on top of our current best block) */
 bool TestBlockValidity(BlockValidationState& state,
                        const CChainParams& chainparams,
@@ -371,6 +439,7 @@ enum DisconnectResult
 };
 
 class ConnectTrace;
+struct ScriptCheckBatch;
 
 /** @see CChainState::FlushStateToDisk */
 enum class FlushStateMode {
@@ -417,6 +486,14 @@ private:
      */
     void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfterHeight, int chain_tip_height, int prune_height, bool is_ibd);
 
+    //! Compares a block index loaded from a snapshot against the database
+    Mutex m_index_snapshot_mutex;
+    std::thread m_index_snapshot_check GUARDED_BY(m_index_snapshot_mutex);
+    std::atomic<bool> m_index_snapshot_ok{true};
+
+    /** Load the block index from m_index_snapshot_path, deleting the file. */
+    bool LoadIndexSnapshot(const Consensus::Params& consensus_params, CBlockTreeDB& blocktree) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
 public:
     BlockMap m_block_index GUARDED_BY(cs_main);
 
@@ -463,22 +540,57 @@ public:
     /** Clear all data members. */
     void Unload() EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
+    /**
+     * Where a snapshot of the block index is written at shutdown and loaded
+     * from at the next startup, instead of reading every entry from the block
+     * tree database. Empty if disabled (see -blockindexsnapshot).
+     */
+    fs::path m_index_snapshot_path;
+
+    /**
+     * Wait until a block index loaded from a snapshot has been checked
+     * against the block tree database, including the proof of work of its
+     * headers. Returns false if it didn't match, in which case the block
+     * index must neither be written nor be used to connect blocks.
+     */
+    bool WaitForIndexSnapshotCheck() LOCKS_EXCLUDED(m_index_snapshot_mutex);
+
+    /** Write the block index to m_index_snapshot_path, if set. */
+    void WriteIndexSnapshot(const Consensus::Params& consensus_params) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
     CBlockIndex* AddToBlockIndex(const CBlockHeader& block) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
     /** Create a new block index entry for a given block hash */
     CBlockIndex* InsertBlockIndex(const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
+    /**
+     * Construct a CBlockIndex in the pool of m_block_index, next to the map
+     * nodes. It is freed together with the map in Unload(), which is why
+     * CBlockIndex must stay trivially destructible.
+     */
+    template <typename... Args>
+    CBlockIndex* NewBlockIndex(Args&&... args) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+    {
+        static_assert(std::is_trivially_destructible_v<CBlockIndex>);
+        static_assert(alignof(CBlockIndex) <= alignof(void*));
+        void* p = m_block_index.get_allocator().resource()->Allocate(sizeof(CBlockIndex), alignof(CBlockIndex));
+        return new (p) CBlockIndex(std::forward<Args>(args)...);
+    }
+
     //! Mark one block file as pruned (modify associated database entries)
     void PruneOneBlockFile(const int fileNumber) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     /**
      * If a block header hasn't already been seen, call CheckBlockHeader on it, ensure
      * that it doesn't descend from an invalid block, and then add it to m_block_index.
+     * pprechecked_hash is the hash of a header which already passed the checks that
+     * do not need the block index (see ProcessNewBlockHeaders), which are skipped.
      */
     bool AcceptBlockHeader(
         const CBlockHeader& block,
         BlockValidationState& state,
         const CChainParams& chainparams,
-        CBlockIndex** ppindex) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+        CBlockIndex** ppindex,
+        const uint256* pprechecked_hash = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     CBlockIndex* LookupBlockIndex(const uint256& hash) const EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
@@ -516,6 +628,10 @@ public:
     //! All unspent coins reside in this store.
     CCoinsViewDB m_dbview GUARDED_BY(cs_main);
 
+    //! This view can write cache flushes to the leveldb instance in the background, while
+    //! serving lookups for the coins being written.
+    CCoinsViewBackgroundFlush m_flushview GUARDED_BY(cs_main);
+
     //! This view wraps access to the leveldb instance and handles read errors gracefully.
     CCoinsViewErrorCatcher m_catcherview GUARDED_BY(cs_main);
 
@@ -595,6 +711,12 @@ protected:
     //! Manages the UTXO set, which is a reflection of the contents of `m_chain`.
     std::unique_ptr<CoinsViews> m_coins_views;
 
+    //! Reads blocks ahead of ConnectTip while the current block is being connected.
+    BlockPrefetcher m_block_prefetcher;
+
+    //! Locator of the tip flushed by a background coins flush that has not been waited for yet.
+    std::optional<CBlockLocator> m_background_flush_locator GUARDED_BY(::cs_main);
+
 public:
     //! Reference to a BlockManager instance which itself is shared across all
     //! CChainState instances.
@@ -650,6 +772,12 @@ public:
     }
 
     //! @returns A reference to the on-disk UTXO set database.
+    //!
+    //! This bypasses the coins of a background flush which is still being
+    //! written (see -coinsbackgroundflush). Callers must either use it before
+    //! blocks are connected, or call ForceFlushStateToDisk(), which waits for
+    //! the write, and open their cursor or read the best block without
+    //! releasing cs_main in between.
     CCoinsViewDB& CoinsDB() EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     {
         return m_coins_views->m_dbview;
@@ -678,6 +806,8 @@ public:
 
     /** Import blocks from an external file */
     void LoadExternalBlockFile(FILE* fileIn, FlatFilePos* dbp = nullptr);
+    /** Import the blocks of a block file found by ScanBlockFile, in file order */
+    void LoadScannedBlockFile(std::vector<std::pair<std::shared_ptr<CBlock>, FlatFilePos>>& blocks);
 
     /**
      * Update the on-disk chain state.
@@ -722,14 +852,30 @@ public:
         std::shared_ptr<const CBlock> pblock = nullptr) LOCKS_EXCLUDED(cs_main);
 
     bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, BlockValidationState& state, CBlockIndex** ppindex, bool fRequested, const FlatFilePos* dbp, bool* fNewBlock) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+    /**
+     * Store a block read from a block file or external file in the block index,
+     * and then any out of order blocks that were waiting for it. Returns false on
+     * errors that should stop the import.
+     */
+    bool LoadExternalBlock(std::shared_ptr<CBlock> pblock, FlatFilePos* dbp, int& nLoaded) LOCKS_EXCLUDED(cs_main);
 
     // Block (dis)connection on a given view:
     DisconnectResult DisconnectBlock(const CBlock& block, const CBlockIndex* pindex, CCoinsViewCache& view);
+    /** With a batch, script checks are queued on it instead of being waited
+     *  for, and the block is not marked BLOCK_VALID_SCRIPTS (see ConnectTipBatch). */
     bool ConnectBlock(const CBlock& block, BlockValidationState& state, CBlockIndex* pindex,
-                      CCoinsViewCache& view, bool fJustCheck = false) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+                      CCoinsViewCache& view, bool fJustCheck = false, ScriptCheckBatch* batch = nullptr) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
     // Apply the effects of a block disconnection on the UTXO set.
     bool DisconnectTip(BlockValidationState& state, DisconnectedBlockTransactions* disconnectpool) EXCLUSIVE_LOCKS_REQUIRED(cs_main, m_mempool.cs);
+    /**
+     * Disconnect up to nMaxBlocks blocks from the tip towards pindexFork, as
+     * DisconnectTip would one after another. Their blocks and undo data are
+     * read in parallel and applied to the coins cache as one change, and
+     * restored coins are not looked up in the coins database (see
+     * ApplyTxInUndo).
+     */
+    bool DisconnectTips(BlockValidationState& state, size_t nMaxBlocks, const CBlockIndex* pindexFork, DisconnectedBlockTransactions* disconnectpool) EXCLUSIVE_LOCKS_REQUIRED(cs_main, m_mempool.cs);
 
     // Manual block validity manipulation:
     /** Mark a block as precious and reorganize.
@@ -786,6 +932,15 @@ public:
 private:
     bool ActivateBestChainStep(BlockValidationState& state, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace) EXCLUSIVE_LOCKS_REQUIRED(cs_main, m_mempool.cs);
     bool ConnectTip(BlockValidationState& state, CBlockIndex* pindexNew, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions& disconnectpool) EXCLUSIVE_LOCKS_REQUIRED(cs_main, m_mempool.cs);
+    /**
+     * Connect consecutive blocks on top of the tip as one unit. Script checks
+     * of each block are queued without waiting for them, so the check threads
+     * stay busy while the next block is connected. The chain, the coins tip and
+     * validation signals are only updated once all checks passed. If any block
+     * fails, nothing is applied and false is returned with an invalid state;
+     * the caller then connects the blocks one by one to find the culprit.
+     */
+    bool ConnectTipBatch(BlockValidationState& state, const std::vector<CBlockIndex*>& blocks, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions& disconnectpool) EXCLUSIVE_LOCKS_REQUIRED(cs_main, m_mempool.cs);
 
     void InvalidBlockFound(CBlockIndex* pindex, const BlockValidationState& state) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
     CBlockIndex* FindMostWorkChain() EXCLUSIVE_LOCKS_REQUIRED(cs_main);
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+# Copyright (c) 2021 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the block index snapshot (-blockindexsnapshot).
+
+- A clean shutdown writes the snapshot, the next startup loads and removes it.
+- A snapshot is removed when starting with -blockindexsnapshot=0.
+- A stale snapshot is detected and the node aborts before it connects a
+  block or writes the block index; the next startup reads the block index
+  from the database.
+"""
+
+import os
+import shutil
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal
+
+
+class BlockIndexSnapshotTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 1
+        self.extra_args = [["-blockindexsnapshot"]]
+
+    def snapshot_path(self):
+        return os.path.join(self.nodes[0].datadir, self.chain, "blocks", "index.snapshot")
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(200)
+        best_hash = node.getbestblockhash()
+
+        self.log.info("Write the snapshot at shutdown and load it at startup")
+        self.stop_node(0)
+        assert os.path.exists(self.snapshot_path())
+        with node.assert_debug_log(["Loaded 201 block index entries", "Checked block index snapshot against the database"]):
+            self.start_node(0)
+            node.syncwithvalidationinterfacequeue()
+        assert not os.path.exists(self.snapshot_path())
+        assert_equal(node.getbestblockhash(), best_hash)
+        assert_equal(node.getblockchaininfo()["headers"], 200)
+
+        self.log.info("Remove the snapshot when starting with it disabled")
+        self.stop_node(0)
+        assert os.path.exists(self.snapshot_path())
+        self.start_node(0, extra_args=["-blockindexsnapshot=0"])
+        assert not os.path.exists(self.snapshot_path())
+        assert_equal(node.getbestblockhash(), best_hash)
+
+        self.log.info("Abort when a stale snapshot does not match the database")
+        self.restart_node(0)
+        stale_path = self.snapshot_path() + ".stale"
+        self.stop_node(0)
+        shutil.copyfile(self.snapshot_path(), stale_path)
+        self.start_node(0)
+        # Mark the tip invalid in the database, but not in the stale snapshot
+        node.invalidateblock(best_hash)
+        new_best_hash = node.getbestblockhash()
+        self.stop_node(0)
+        os.replace(stale_path, self.snapshot_path())
+        with node.assert_debug_log(["differs from the database", "Block index snapshot does not match the block tree database"]):
+            # Activating the best chain at startup has to wait for the check, and then aborts
+            node.start()
+            node.wait_until_stopped()
+        assert not os.path.exists(self.snapshot_path())
+
+        self.log.info("Load the block index from the database after that")
+        self.start_node(0)
+        assert_equal(node.getbestblockhash(), new_best_hash)
+
+
+if __name__ == '__main__':
+    BlockIndexSnapshotTest().main()
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# Copyright (c) 2021 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test block file compression (-compressblockfiles).
+
+- Cold block and undo files are compressed at startup, and the originals
+  are removed on the next pass.
+- Blocks, undo data and indexed transactions are read from the compressed
+  files.
+- -reindex restores the compressed files.
+"""
+
+import os
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal
+
+
+class CompressBlockFilesTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 1
+        self.extra_args = [["-fastprune", "-txindex", "-compressblockfiles"]]
+
+    def blocks_path(self, name):
+        return os.path.join(self.nodes[0].datadir, self.chain, "blocks", name)
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(600)
+        best_hash = node.getbestblockhash()
+        block_hash = node.getblockhash(10)
+        block = node.getblock(block_hash, 2)
+        txid = block["tx"][0]["txid"]
+        stats = node.getblockstats(10)
+
+        self.log.info("Compress cold files, and remove the originals on the next pass")
+        with node.assert_debug_log(["Compressed blk00000.dat", "Compressed rev00000.dat"]):
+            self.restart_node(0)
+            self.wait_until(lambda: os.path.exists(self.blocks_path("rev00000.cdat")))
+        assert os.path.exists(self.blocks_path("blk00000.cdat"))
+        assert os.path.exists(self.blocks_path("blk00000.dat"))
+        self.restart_node(0)
+        self.wait_until(lambda: not os.path.exists(self.blocks_path("rev00000.dat")))
+        assert os.path.exists(self.blocks_path("blk00000.cdat"))
+        assert not os.path.exists(self.blocks_path("blk00000.dat"))
+
+        self.log.info("Read blocks, undo data and transactions from compressed files")
+        assert_equal(node.getblock(block_hash, 2), block)
+        assert_equal(node.getblockstats(10), stats)
+        assert_equal(node.getrawtransaction(txid, True)["blockhash"], block_hash)
+
+        self.log.info("Restore compressed files for -reindex")
+        self.restart_node(0, extra_args=["-fastprune", "-txindex", "-reindex"])
+        assert os.path.exists(self.blocks_path("blk00000.dat"))
+        assert not os.path.exists(self.blocks_path("blk00000.cdat"))
+        assert_equal(node.getbestblockhash(), best_hash)
+        assert_equal(node.getblock(block_hash, 2), block)
+
+
+if __name__ == '__main__':
+    CompressBlockFilesTest().main()